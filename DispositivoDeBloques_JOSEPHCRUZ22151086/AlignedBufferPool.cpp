@@ -0,0 +1,70 @@
+#include "AlignedBufferPool.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+AlignedBufferPool::~AlignedBufferPool()
+{
+ clear();
+}
+
+bool AlignedBufferPool::reset(std::size_t bufferSize, std::size_t alignment, std::size_t initialCount)
+{
+ clear();
+
+ std::lock_guard<std::mutex> lock(mutex);
+ size = bufferSize;
+ align = alignment;
+ for (std::size_t i = 0; i < initialCount; i++)
+ {
+  char *buf = allocate();
+  if (!buf)
+   return false;
+  freeList.push_back(buf);
+ }
+ return true;
+}
+
+void AlignedBufferPool::clear()
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ for (char *buf : allBuffers)
+  std::free(buf);
+ allBuffers.clear();
+ freeList.clear();
+}
+
+char *AlignedBufferPool::allocate()
+{
+ void *ptr = nullptr;
+ if (::posix_memalign(&ptr, align, size) != 0)
+  return nullptr;
+ // Los bloques se rellenan con ceros, asi un buffer nuevo no expone basura
+ std::memset(ptr, 0, size);
+ allBuffers.push_back(static_cast<char *>(ptr));
+ return static_cast<char *>(ptr);
+}
+
+char *AlignedBufferPool::acquire()
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (freeList.empty())
+  return allocate();
+
+ char *buf = freeList.back();
+ freeList.pop_back();
+ return buf;
+}
+
+void AlignedBufferPool::release(char *buffer)
+{
+ if (!buffer)
+  return;
+ std::lock_guard<std::mutex> lock(mutex);
+ freeList.push_back(buffer);
+}
+
+bool AlignedBufferPool::isAligned(const void *ptr) const
+{
+ return align != 0 && (reinterpret_cast<std::uintptr_t>(ptr) % align) == 0;
+}
@@ -0,0 +1,41 @@
+#ifndef ALIGNEDBUFFERPOOL_H
+#define ALIGNEDBUFFERPOOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Pool de buffers de un bloque alineados en memoria, necesarios para E/S con O_DIRECT.
+// acquire/release son seguros entre hilos. Si el pool se vacia se reserva un buffer nuevo,
+// que al devolverse queda en el pool para la siguiente vez.
+class AlignedBufferPool
+{
+public:
+ AlignedBufferPool() = default;
+ ~AlignedBufferPool();
+
+ AlignedBufferPool(const AlignedBufferPool &) = delete;
+ AlignedBufferPool &operator=(const AlignedBufferPool &) = delete;
+
+ // Libera lo anterior y prepara initialCount buffers de bufferSize bytes alineados a alignment
+ bool reset(std::size_t bufferSize, std::size_t alignment, std::size_t initialCount);
+ void clear();
+
+ char *acquire();
+ void release(char *buffer);
+
+ std::size_t bufferSize() const { return size; }
+ std::size_t alignment() const { return align; }
+ bool isAligned(const void *ptr) const;
+
+private:
+ std::mutex mutex;
+ std::vector<char *> freeList;
+ std::vector<char *> allBuffers;
+ std::size_t size = 0;
+ std::size_t align = 0;
+
+ char *allocate();
+};
+
+#endif // ALIGNEDBUFFERPOOL_H
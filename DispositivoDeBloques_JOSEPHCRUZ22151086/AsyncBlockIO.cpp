@@ -0,0 +1,313 @@
+#include "AsyncBlockIO.h"
+#include "IoStats.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// No dependemos de liburing, se usan las syscalls directamente
+static int uringSetup(unsigned entries, struct io_uring_params *params)
+{
+ return (int)::syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+ return (int)::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+AsyncBlockIO::AsyncBlockIO(IBlockDevice &device, unsigned queueDepth) : device(device), depth(queueDepth == 0 ? 1 : queueDepth)
+{
+ slots.resize(depth);
+ for (unsigned i = depth; i > 0; i--)
+  freeSlots.push_back(i - 1);
+
+ // Sin descriptor propio (Stream, memoria) se queda en modo sincrono
+ if (device.nativeHandle() >= 0)
+ {
+  if (!setupRing(depth))
+   teardownRing();
+ }
+}
+
+AsyncBlockIO::~AsyncBlockIO()
+{
+ drain();
+ teardownRing();
+}
+
+bool AsyncBlockIO::setupRing(unsigned entries)
+{
+ struct io_uring_params params;
+ std::memset(&params, 0, sizeof(params));
+
+ ringFd = uringSetup(entries, &params);
+ if (ringFd < 0)
+ {
+  ringFd = -1;
+  return false;
+ }
+
+ sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+ cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+ bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+ if (singleMmap)
+ {
+  // Ambos anillos comparten el mismo mapeo
+  sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+ }
+
+ sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+ if (sqRing == MAP_FAILED)
+ {
+  sqRing = nullptr;
+  return false;
+ }
+
+ if (singleMmap)
+ {
+  cqRing = sqRing;
+ }
+ else
+ {
+  cqRing = ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+  if (cqRing == MAP_FAILED)
+  {
+   cqRing = nullptr;
+   return false;
+  }
+ }
+
+ sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+ sqes = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+ if (sqes == MAP_FAILED)
+ {
+  sqes = nullptr;
+  return false;
+ }
+
+ char *sq = static_cast<char *>(sqRing);
+ char *cq = static_cast<char *>(cqRing);
+ sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+ sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+ sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+ sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+ cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+ cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+ cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+ cqes = cq + params.cq_off.cqes;
+ return true;
+}
+
+void AsyncBlockIO::teardownRing()
+{
+ if (sqes)
+  ::munmap(sqes, sqesSize);
+ if (cqRing && cqRing != sqRing)
+  ::munmap(cqRing, cqRingSize);
+ if (sqRing)
+  ::munmap(sqRing, sqRingSize);
+ sqes = nullptr;
+ sqRing = nullptr;
+ cqRing = nullptr;
+ if (ringFd >= 0)
+  ::close(ringFd);
+ ringFd = -1;
+}
+
+bool AsyncBlockIO::submitRead(std::size_t blockNumber, char *buffer, Callback callback)
+{
+ return submit(false, blockNumber, buffer, std::move(callback));
+}
+
+bool AsyncBlockIO::submitWrite(std::size_t blockNumber, const char *data, Callback callback)
+{
+ return submit(true, blockNumber, const_cast<char *>(data), std::move(callback));
+}
+
+bool AsyncBlockIO::submit(bool write, std::size_t blockNumber, char *buffer, Callback callback)
+{
+ if (blockNumber >= device.blockCount)
+ {
+  std::cerr << "Número de bloque inválido.\n";
+  return false;
+ }
+
+ // El dispositivo pudo cerrarse o reabrirse con otro backend desde la construccion: sin
+ // descriptor propio la operacion va por readBlock/writeBlock aunque haya anillo
+ int handle = device.nativeHandle();
+ if (ringFd < 0 || handle < 0)
+ {
+  // Modo sincrono: la operacion se hace ya, la completion se entrega en poll/wait
+  bool ok = write ? device.writeBlock(blockNumber, buffer, device.blockSize)
+                  : device.readBlock(blockNumber, buffer);
+  readyCompletions.push_back(Completion{blockNumber, std::move(callback), ok});
+  inFlightCount++;
+  return true;
+ }
+
+ // Con O_DIRECT el kernel rechaza buffers no alineados
+ if (device.requiresAlignment() && reinterpret_cast<std::uintptr_t>(buffer) % device.bufferAlignment() != 0)
+ {
+  std::cerr << "Buffer no alineado para E/S directa.\n";
+  return false;
+ }
+
+ // Cola llena: procesar completions hasta liberar un lugar
+ while (freeSlots.empty())
+ {
+  if (wait(1) == 0)
+   return false;
+ }
+
+ unsigned slot = freeSlots.back();
+ freeSlots.pop_back();
+ slots[slot].blockNumber = blockNumber;
+ slots[slot].callback = std::move(callback);
+ slots[slot].buffer = buffer;
+ slots[slot].write = write;
+ slots[slot].busy = true;
+ slots[slot].startNanos = IoStats::now();
+
+ unsigned tail = *sqTail;
+ unsigned index = tail & *sqMask;
+ struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(sqes) + index;
+ std::memset(sqe, 0, sizeof(*sqe));
+ sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+ sqe->fd = handle;
+ sqe->addr = reinterpret_cast<uint64_t>(buffer);
+ sqe->len = (uint32_t)device.blockSize;
+ sqe->off = device.blockOffset(blockNumber);
+ sqe->user_data = slot;
+ sqArray[index] = index;
+ // El kernel debe ver la sqe completa antes que el nuevo tail
+ __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+ toSubmit++;
+ inFlightCount++;
+ return true;
+}
+
+// Envia las sqe pendientes y opcionalmente espera minComplete completions
+bool AsyncBlockIO::enter(unsigned minComplete)
+{
+ if (toSubmit == 0 && minComplete == 0)
+  return true;
+
+ unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+ while (true)
+ {
+  int ret = uringEnter(ringFd, toSubmit, minComplete, flags);
+  if (ret < 0 && errno == EINTR)
+   continue;
+  if (ret < 0)
+  {
+   std::cerr << "Error en io_uring_enter.\n";
+   return false;
+  }
+  toSubmit -= std::min<unsigned>(toSubmit, (unsigned)ret);
+  return true;
+ }
+}
+
+// Procesa todas las completions disponibles en el anillo
+std::size_t AsyncBlockIO::reap()
+{
+ std::size_t processed = 0;
+ unsigned head = *cqHead;
+ while (true)
+ {
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+   break;
+
+  struct io_uring_cqe *cqe = static_cast<struct io_uring_cqe *>(cqes) + (head & *cqMask);
+  unsigned slot = (unsigned)cqe->user_data;
+  bool ok = cqe->res == (int32_t)device.blockSize;
+  head++;
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+  // Se libera el lugar antes del callback para que este pueda enviar mas operaciones
+  Request &req = slots[slot];
+  Callback callback = std::move(req.callback);
+  std::size_t blockNumber = req.blockNumber;
+  // La E/S no paso por readBlock/writeBlock, el dispositivo mantiene sus checksums aqui
+  if (ok && req.write)
+   device.blockWritten(blockNumber, req.buffer);
+  else if (ok)
+   ok = device.verifyBlock(blockNumber, req.buffer);
+  if (req.write)
+   device.recordWrite(blockNumber, 1, ok, req.startNanos);
+  else
+   device.recordRead(blockNumber, 1, ok, req.startNanos);
+  req.callback = nullptr;
+  req.busy = false;
+  freeSlots.push_back(slot);
+  inFlightCount--;
+  processed++;
+
+  if (callback)
+   callback(blockNumber, ok);
+ }
+ return processed;
+}
+
+// Entrega las completions hechas de forma sincrona
+std::size_t AsyncBlockIO::deliverReady()
+{
+ std::size_t processed = 0;
+ while (!readyCompletions.empty())
+ {
+  Completion done = std::move(readyCompletions.front());
+  readyCompletions.pop_front();
+  inFlightCount--;
+  processed++;
+  if (done.callback)
+   done.callback(done.blockNumber, done.ok);
+ }
+ return processed;
+}
+
+std::size_t AsyncBlockIO::poll()
+{
+ std::size_t processed = deliverReady();
+ if (ringFd < 0)
+  return processed;
+
+ enter(0);
+ return processed + reap();
+}
+
+std::size_t AsyncBlockIO::wait(std::size_t minCompletions)
+{
+ if (ringFd < 0)
+  return poll();
+
+ std::size_t processed = deliverReady() + reap();
+ while (processed < minCompletions && inFlightCount > 0)
+ {
+  // Un callback pudo encolar operaciones sincronas; esas no tienen completion en el anillo
+  if (!readyCompletions.empty())
+  {
+   processed += deliverReady();
+   continue;
+  }
+  if (freeSlots.size() == slots.size() || !enter(1))
+   break;
+  processed += reap();
+ }
+ return processed;
+}
+
+void AsyncBlockIO::drain()
+{
+ while (inFlightCount > 0)
+ {
+  if (wait(inFlightCount) == 0 && ringFd >= 0)
+   break;
+ }
+}
@@ -0,0 +1,101 @@
+#ifndef ASYNCBLOCKIO_H
+#define ASYNCBLOCKIO_H
+
+#include "IBlockDevice.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+// E/S asincrona de bloques sobre un dispositivo con descriptor propio (BlockDevice con
+// Mmap, Pread o Direct). Usa io_uring para mantener varias lecturas/escrituras en vuelo;
+// si io_uring no esta disponible (kernel viejo, seccomp, backend Stream, dispositivo en
+// memoria) hace cada operacion de forma sincrona al enviarla y solo entrega la completion despues.
+// El descriptor se consulta en cada envio: si el dispositivo se cerro o se reabrio con Stream,
+// las operaciones siguientes tambien van por el camino sincrono.
+// En ambos casos los callbacks se llaman unicamente desde poll()/wait()/drain().
+class AsyncBlockIO
+{
+public:
+ // ok=false si la operacion fallo o transfirio menos de blockSize bytes
+ using Callback = std::function<void(std::size_t blockNumber, bool ok)>;
+
+ AsyncBlockIO(IBlockDevice &device, unsigned queueDepth = 32);
+ ~AsyncBlockIO();
+
+ AsyncBlockIO(const AsyncBlockIO &) = delete;
+ AsyncBlockIO &operator=(const AsyncBlockIO &) = delete;
+
+ // buffer debe tener blockSize bytes y seguir vivo hasta que llegue la completion.
+ // Si el dispositivo exige alineacion (Backend::Direct) debe estar alineado a device.bufferAlignment().
+ // Si la cola esta llena primero se espera a que termine alguna operacion.
+ bool submitRead(std::size_t blockNumber, char *buffer, Callback callback = nullptr);
+ bool submitWrite(std::size_t blockNumber, const char *data, Callback callback = nullptr);
+
+ // Procesa las completions listas sin bloquear. Devuelve cuantas se procesaron.
+ std::size_t poll();
+ // Bloquea hasta procesar al menos minCompletions (o hasta que no quede nada en vuelo)
+ std::size_t wait(std::size_t minCompletions = 1);
+ // Espera todas las operaciones pendientes
+ void drain();
+
+ std::size_t inFlight() const { return inFlightCount; }
+ unsigned queueDepth() const { return depth; }
+ bool usingUring() const { return ringFd >= 0; }
+
+private:
+ struct Request
+ {
+  std::size_t blockNumber = 0;
+  Callback callback;
+  char *buffer = nullptr;
+  bool write = false;
+  bool busy = false;
+  uint64_t startNanos = 0; // para las estadisticas del dispositivo
+ };
+
+ struct Completion
+ {
+  std::size_t blockNumber;
+  Callback callback;
+  bool ok;
+ };
+
+ IBlockDevice &device;
+ unsigned depth;
+ std::size_t inFlightCount = 0;
+
+ // Estado de io_uring (ringFd = -1 => modo sincrono)
+ int ringFd = -1;
+ void *sqRing = nullptr;
+ void *cqRing = nullptr;
+ std::size_t sqRingSize = 0;
+ std::size_t cqRingSize = 0;
+ void *sqes = nullptr;
+ std::size_t sqesSize = 0;
+ unsigned *sqHead = nullptr;
+ unsigned *sqTail = nullptr;
+ unsigned *sqMask = nullptr;
+ unsigned *sqArray = nullptr;
+ unsigned *cqHead = nullptr;
+ unsigned *cqTail = nullptr;
+ unsigned *cqMask = nullptr;
+ void *cqes = nullptr;
+ unsigned toSubmit = 0;
+
+ std::vector<Request> slots;
+ std::vector<unsigned> freeSlots;
+
+ // Completions del modo sincrono, pendientes de entregar
+ std::deque<Completion> readyCompletions;
+
+ bool setupRing(unsigned entries);
+ void teardownRing();
+ bool submit(bool write, std::size_t blockNumber, char *buffer, Callback callback);
+ bool enter(unsigned minComplete);
+ std::size_t reap();
+ std::size_t deliverReady();
+};
+
+#endif // ASYNCBLOCKIO_H
@@ -0,0 +1,343 @@
+#include "BlockCache.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+BlockCache::BlockCache(IBlockDevice &device, std::size_t capacity, std::size_t shardCount) : device(device)
+{
+ if (capacity == 0)
+  capacity = 1;
+ if (shardCount == 0)
+ {
+  shardCount = std::max(1u, std::thread::hardware_concurrency());
+  shardCount = std::min(shardCount, std::max<std::size_t>(1, capacity / min_frames_per_shard));
+ }
+ shardCount = std::min(shardCount, capacity);
+
+ // La capacidad se reparte entre los shards, los primeros reciben el resto
+ for (std::size_t i = 0; i < shardCount; i++)
+ {
+  auto shard = std::make_unique<Shard>();
+  std::size_t frames = capacity / shardCount + (i < capacity % shardCount ? 1 : 0);
+  shard->frames.resize(frames);
+  shard->arena.assign(frames * device.blockSize, 0);
+  shard->index.reserve(frames);
+  // Con 3/4 del shard sucio se escribe todo de una vez, asi el desalojo casi siempre
+  // encuentra bloques limpios y no tiene que escribir de a uno
+  shard->dirtyLimit = std::max<std::size_t>(1, frames * 3 / 4);
+  shards.push_back(std::move(shard));
+ }
+}
+
+BlockCache::~BlockCache()
+{
+ flush();
+}
+
+std::size_t BlockCache::shardIndex(std::size_t blockNumber) const
+{
+ // Mezcla multiplicativa del numero de racha para repartir zonas vecinas entre shards
+ uint64_t run = (uint64_t)(blockNumber / shard_run);
+ uint64_t h = run * 0x9E3779B97F4A7C15ULL;
+ return (std::size_t)((h >> 32) % shards.size());
+}
+
+BlockCache::Shard &BlockCache::shardFor(std::size_t blockNumber)
+{
+ return *shards[shardIndex(blockNumber)];
+}
+
+bool BlockCache::findFrame(Shard &shard, std::size_t blockNumber, std::size_t &frame)
+{
+ auto it = shard.index.find(blockNumber);
+ if (it == shard.index.end())
+  return false;
+ frame = it->second;
+ shard.frames[frame].referenced = true;
+ return true;
+}
+
+// Consigue un frame para blockNumber usando CLOCK: se recorre el anillo quitando la marca
+// de referencia hasta encontrar un frame libre o no referenciado. Si la victima esta sucia
+// se escribe antes de reutilizarla.
+bool BlockCache::claimFrame(Shard &shard, std::size_t blockNumber, std::size_t &frame)
+{
+ while (true)
+ {
+  Frame &candidate = shard.frames[shard.hand];
+  std::size_t current = shard.hand;
+  shard.hand = (shard.hand + 1) % shard.frames.size();
+
+  if (candidate.valid && candidate.referenced)
+  {
+   candidate.referenced = false;
+   continue;
+  }
+
+  if (candidate.valid)
+  {
+   if (candidate.dirty)
+   {
+    if (!device.writeBlock(candidate.blockNumber, frameData(shard, current), device.blockSize))
+     return false;
+    candidate.dirty = false;
+    shard.dirtyCount--;
+    shard.counters.writebacks++;
+   }
+   shard.index.erase(candidate.blockNumber);
+   shard.counters.evictions++;
+  }
+
+  candidate.blockNumber = blockNumber;
+  candidate.valid = true;
+  candidate.dirty = false;
+  candidate.referenced = true;
+  shard.index[blockNumber] = current;
+  frame = current;
+  return true;
+ }
+}
+
+bool BlockCache::readBlock(std::size_t blockNumber, char *buffer)
+{
+ Shard &shard = shardFor(blockNumber);
+ std::lock_guard<std::mutex> lock(shard.mutex);
+ std::size_t frame;
+ if (findFrame(shard, blockNumber, frame))
+ {
+  shard.counters.hits++;
+  std::memcpy(buffer, frameData(shard, frame), device.blockSize);
+  return true;
+ }
+
+ // El fallo se lee con el lock del shard tomado, asi ningun otro hilo puede escribir y
+ // desalojar el bloque mientras tanto (y dejar en la cache una copia vieja)
+ shard.counters.misses++;
+ if (!device.readBlock(blockNumber, buffer))
+  return false;
+ if (claimFrame(shard, blockNumber, frame))
+  std::memcpy(frameData(shard, frame), buffer, device.blockSize);
+ return true;
+}
+
+bool BlockCache::readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+  return false;
+
+ // Se toman los locks de los shards que toca el lote (siempre en el mismo orden), los
+ // aciertos se copian ya y los fallos de todos los shards se leen en un solo lote: una
+ // racha de un archivo cruza varios shards y el dispositivo la agrupa en una sola lectura
+ std::vector<char> touched(shards.size(), 0);
+ for (auto blockNumber : blockNumbers)
+  touched[shardIndex(blockNumber)] = 1;
+ std::vector<std::unique_lock<std::mutex>> locks;
+ for (std::size_t s = 0; s < shards.size(); s++)
+ {
+  if (touched[s])
+   locks.emplace_back(shards[s]->mutex);
+ }
+
+ std::vector<std::size_t> missBlocks;
+ std::vector<char *> missBuffers;
+ for (std::size_t i = 0; i < blockNumbers.size(); i++)
+ {
+  Shard &shard = shardFor(blockNumbers[i]);
+  std::size_t frame;
+  if (findFrame(shard, blockNumbers[i], frame))
+  {
+   shard.counters.hits++;
+   std::memcpy(buffers[i], frameData(shard, frame), device.blockSize);
+  }
+  else
+  {
+   shard.counters.misses++;
+   missBlocks.push_back(blockNumbers[i]);
+   missBuffers.push_back(buffers[i]);
+  }
+ }
+
+ if (missBlocks.empty())
+  return true;
+ if (!device.readBlocks(missBlocks, missBuffers))
+  return false;
+
+ for (std::size_t i = 0; i < missBlocks.size(); i++)
+ {
+  Shard &shard = shardFor(missBlocks[i]);
+  std::size_t frame;
+  if (findFrame(shard, missBlocks[i], frame))
+   continue;
+  if (claimFrame(shard, missBlocks[i], frame))
+   std::memcpy(frameData(shard, frame), missBuffers[i], device.blockSize);
+ }
+ return true;
+}
+
+bool BlockCache::writeLocked(Shard &shard, std::size_t blockNumber, const char *data, std::size_t size)
+{
+ if (blockNumber >= device.blockCount || size > device.blockSize)
+ {
+  std::cerr << "Escritura inválida en la cache de bloques.\n";
+  return false;
+ }
+
+ // Se sobreescribe el bloque completo, no hace falta leerlo antes
+ std::size_t frame;
+ if (!findFrame(shard, blockNumber, frame) && !claimFrame(shard, blockNumber, frame))
+  return false;
+
+ char *dst = frameData(shard, frame);
+ std::memcpy(dst, data, size);
+ std::memset(dst + size, 0, device.blockSize - size);
+ if (!shard.frames[frame].dirty)
+ {
+  shard.frames[frame].dirty = true;
+  shard.dirtyCount++;
+ }
+
+ if (shard.dirtyCount >= shard.dirtyLimit)
+  return flushShards({&shard});
+ return true;
+}
+
+bool BlockCache::writeBlock(std::size_t blockNumber, const char *data, std::size_t size)
+{
+ Shard &shard = shardFor(blockNumber);
+ std::lock_guard<std::mutex> lock(shard.mutex);
+ return writeLocked(shard, blockNumber, data, size);
+}
+
+bool BlockCache::writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+  return false;
+
+ for (std::size_t i = 0; i < blockNumbers.size(); i++)
+ {
+  Shard &shard = shardFor(blockNumbers[i]);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (!writeLocked(shard, blockNumbers[i], buffers[i], device.blockSize))
+   return false;
+ }
+ return true;
+}
+
+bool BlockCache::flush()
+{
+ // Se toman todos los locks (siempre en el mismo orden) para escribir los sucios de
+ // todos los shards en un solo lote y aprovechar los bloques consecutivos
+ std::vector<std::unique_lock<std::mutex>> locks;
+ std::vector<Shard *> all;
+ for (auto &shard : shards)
+ {
+  locks.emplace_back(shard->mutex);
+  all.push_back(shard.get());
+ }
+ return flushShards(all);
+}
+
+// Los shards recibidos ya deben estar bloqueados por el llamador
+bool BlockCache::flushShards(const std::vector<Shard *> &lockedShards)
+{
+ std::vector<std::size_t> blockNumbers;
+ std::vector<const char *> buffers;
+ for (Shard *shard : lockedShards)
+ {
+  if (shard->dirtyCount == 0)
+   continue;
+  for (std::size_t i = 0; i < shard->frames.size(); i++)
+  {
+   if (shard->frames[i].valid && shard->frames[i].dirty)
+   {
+    blockNumbers.push_back(shard->frames[i].blockNumber);
+    buffers.push_back(frameData(*shard, i));
+   }
+  }
+ }
+ if (blockNumbers.empty())
+  return true;
+
+ // writeBlocks ordena y agrupa los bloques consecutivos
+ if (!device.writeBlocks(blockNumbers, buffers))
+ {
+  std::cerr << "Error escribiendo bloques sucios de la cache.\n";
+  return false;
+ }
+
+ for (Shard *shard : lockedShards)
+ {
+  for (auto &frame : shard->frames)
+  {
+   if (frame.valid && frame.dirty)
+   {
+    frame.dirty = false;
+    shard->counters.writebacks++;
+   }
+  }
+  shard->dirtyCount = 0;
+ }
+ return true;
+}
+
+void BlockCache::invalidate(std::size_t blockNumber)
+{
+ Shard &shard = shardFor(blockNumber);
+ std::lock_guard<std::mutex> lock(shard.mutex);
+ auto it = shard.index.find(blockNumber);
+ if (it == shard.index.end())
+  return;
+
+ Frame &frame = shard.frames[it->second];
+ if (frame.dirty)
+  shard.dirtyCount--;
+ frame = Frame();
+ shard.index.erase(it);
+}
+
+bool BlockCache::contains(std::size_t blockNumber) const
+{
+ const Shard &shard = *shards[shardIndex(blockNumber)];
+ std::lock_guard<std::mutex> lock(shard.mutex);
+ return shard.index.count(blockNumber) > 0;
+}
+
+std::size_t BlockCache::capacity() const
+{
+ std::size_t total = 0;
+ for (auto &shard : shards)
+  total += shard->frames.size();
+ return total;
+}
+
+std::size_t BlockCache::dirtyBlocks() const
+{
+ std::size_t total = 0;
+ for (auto &shard : shards)
+ {
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  total += shard->dirtyCount;
+ }
+ return total;
+}
+
+BlockCache::Stats BlockCache::stats() const
+{
+ Stats total;
+ for (std::size_t i = 0; i < shards.size(); i++)
+ {
+  Stats st = shardStats(i);
+  total.hits += st.hits;
+  total.misses += st.misses;
+  total.evictions += st.evictions;
+  total.writebacks += st.writebacks;
+ }
+ return total;
+}
+
+BlockCache::Stats BlockCache::shardStats(std::size_t shard) const
+{
+ std::lock_guard<std::mutex> lock(shards[shard]->mutex);
+ return shards[shard]->counters;
+}
@@ -0,0 +1,96 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "IBlockDevice.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Cache de bloques write-back entre FileSystem y el dispositivo.
+// Mantiene hasta capacity bloques en memoria con reemplazo CLOCK. Las escrituras solo
+// marcan el bloque como sucio; se escriben al dispositivo en flush(), al desalojar un
+// bloque sucio, o cuando la cantidad de sucios pasa el limite (presion de memoria).
+//
+// La cache se divide en shards segun el numero de bloque, cada uno con su propio lock,
+// su reloj CLOCK y sus contadores, para que lectores en distintos hilos no compitan por
+// un solo lock. Cada grupo de shard_run bloques consecutivos cae en el mismo shard; un
+// lote que toca varios shards los bloquea juntos y lee todos sus fallos en una sola llamada
+// al dispositivo, asi las rachas de un archivo no se parten por shard.
+class BlockCache
+{
+public:
+ struct Stats
+ {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t writebacks = 0;
+ };
+
+ // shards = 0 elige segun la cantidad de nucleos (manteniendo al menos 16 bloques por shard)
+ BlockCache(IBlockDevice &device, std::size_t capacity, std::size_t shards = 0);
+ ~BlockCache();
+
+ BlockCache(const BlockCache &) = delete;
+ BlockCache &operator=(const BlockCache &) = delete;
+
+ // Misma semantica que los metodos de IBlockDevice (buffers de blockSize bytes,
+ // writeBlock rellena con ceros si size < blockSize). Seguros entre hilos.
+ bool readBlock(std::size_t blockNumber, char *buffer);
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size);
+ bool readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers);
+ bool writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers);
+
+ // Escribe todos los bloques sucios en un solo lote (no llama device.flush)
+ bool flush();
+ // Olvida un bloque sin escribirlo, para cuando alguien lo modifico directo en el dispositivo
+ void invalidate(std::size_t blockNumber);
+
+ bool contains(std::size_t blockNumber) const;
+
+ std::size_t capacity() const;
+ std::size_t shardCount() const { return shards.size(); }
+ std::size_t dirtyBlocks() const;
+ Stats stats() const; // suma de todos los shards
+ Stats shardStats(std::size_t shard) const;
+
+private:
+ struct Frame
+ {
+  std::size_t blockNumber = 0;
+  bool valid = false;
+  bool dirty = false;
+  bool referenced = false;
+ };
+
+ struct Shard
+ {
+  std::vector<Frame> frames;
+  std::vector<char> arena; // frames.size() * blockSize bytes, un bloque por frame
+  std::unordered_map<std::size_t, std::size_t> index;
+  std::size_t hand = 0;
+  std::size_t dirtyCount = 0;
+  std::size_t dirtyLimit = 1;
+  Stats counters;
+  mutable std::mutex mutex;
+ };
+
+ IBlockDevice &device;
+ std::vector<std::unique_ptr<Shard>> shards;
+
+ static constexpr std::size_t shard_run = 16;
+ static constexpr std::size_t min_frames_per_shard = 16;
+
+ std::size_t shardIndex(std::size_t blockNumber) const;
+ Shard &shardFor(std::size_t blockNumber);
+ char *frameData(Shard &shard, std::size_t frame) { return shard.arena.data() + frame * device.blockSize; }
+ bool findFrame(Shard &shard, std::size_t blockNumber, std::size_t &frame);
+ bool claimFrame(Shard &shard, std::size_t blockNumber, std::size_t &frame);
+ bool writeLocked(Shard &shard, std::size_t blockNumber, const char *data, std::size_t size);
+ bool flushShards(const std::vector<Shard *> &lockedShards);
+};
+
+#endif // BLOCKCACHE_H
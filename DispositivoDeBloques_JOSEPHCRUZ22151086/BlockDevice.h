@@ -1,31 +1,217 @@
 #ifndef BLOCKDEVICE_H
 #define BLOCKDEVICE_H
 
+#include "AlignedBufferPool.h"
+#include "IBlockDevice.h"
+#include "BlockTrace.h"
+#include "IoStats.h"
 #include <cstddef>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <mutex>
+#include <atomic>
 
-class BlockDevice
+struct iovec;
+
+// Dispositivo de bloques respaldado por un archivo imagen en el host
+class BlockDevice : public IBlockDevice
 {
 public:
- BlockDevice() : blockCount(0), blockSize(0) {}
- BlockDevice(std::size_t blockCount, std::size_t blockSize) : blockCount(blockCount), blockSize(blockSize) {}
+ // Forma en la que se accede a la imagen
+ // Stream: std::fstream (comportamiento original)
+ // Mmap: toda la imagen mapeada en memoria, readBlock/blockView sin syscalls
+ // Pread: descriptor con pread/pwrite posicionales, sin cursor compartido
+ // Direct: como Pread pero con O_DIRECT (sin cache de paginas del host), toda la E/S
+ //         pasa por buffers alineados del pool. Requiere una imagen con Layout::Aligned
+ // Con Mmap, Pread y Direct varios hilos pueden llamar readBlock al mismo tiempo;
+ // con Stream tambien se puede, pero las operaciones se serializan con un lock.
+ enum class Backend
+ {
+  Stream,
+  Mmap,
+  Pread,
+  Direct
+ };
+
+ // Disposicion de la imagen en el archivo
+ // Compact: cabecera de 16 bytes y los bloques justo despues (formato original)
+ // Aligned: cabecera extendida y los bloques empiezan en un offset alineado a 4096
+ enum class Layout
+ {
+  Compact,
+  Aligned
+ };
+
+ // Como se reserva el espacio de la imagen en el host al crearla
+ // Sparse: solo se fija el tamaño, el host asigna espacio a medida que se escribe (original)
+ // Reserved: fallocate reserva todo el espacio de una vez (extents contiguos, sin ENOSPC despues)
+ // Zeroed: se escriben ceros en toda la imagen
+ enum class Allocation
+ {
+  Sparse,
+  Reserved,
+  Zeroed
+ };
 
- bool create(const std::string &filename, std::size_t block_size, std::size_t block_count);
- bool open(const std::string &filename);
- bool close();
+ BlockDevice() {}
+ BlockDevice(std::size_t blockCount, std::size_t blockSize) : IBlockDevice(blockCount, blockSize) {}
+ ~BlockDevice() override;
+
+ // checksums = true guarda un CRC32C por bloque (implica Layout::Aligned)
+ bool create(const std::string &filename, std::size_t block_size, std::size_t block_count, Layout layout = Layout::Compact,
+             Allocation allocation = Allocation::Sparse, bool checksums = false);
+ bool open(const std::string &filename, Backend backend = Backend::Stream);
+ bool close() override;
+ bool flush() override;
  bool writeBlock(std::size_t blockNumber, const std::vector<char> &data);
  std::vector<char> readBlock(std::size_t blockNumber);
 
- std::size_t blockCount;
- std::size_t blockSize;
+ // Variantes sin reservar memoria: leen a un buffer del llamador (de blockSize bytes)
+ // y escriben desde uno de size <= blockSize, rellenando con ceros sin copiar los datos
+ bool readBlock(std::size_t blockNumber, char *buffer) override;
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) override;
+
+ // Lectura/escritura por lotes: buffers[i] corresponde a blockNumbers[i] y debe tener blockSize bytes.
+ // Los bloques consecutivos se agrupan en una sola llamada preadv/pwritev (o un solo seek con Stream).
+ bool readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers) override;
+ bool writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers) override;
+
+ // Avisa que el contenido de los bloques ya no importa: se perfora un hueco en el archivo
+ // del host (FALLOC_FL_PUNCH_HOLE) para que deje de ocupar disco. Los bloques se leen como
+ // ceros despues. Los bloques consecutivos se descartan en una sola llamada.
+ bool discardBlocks(const std::vector<std::size_t> &blockNumbers) override;
+ bool discardBlock(std::size_t blockNumber);
+ bool supportsDiscard() const override { return discardSupported; }
+
+ // Extiende el archivo imagen y actualiza blockCount en la cabecera. Con Mmap se rehace el
+ // mapeo. En las imagenes con checksums la tabla ya tiene su lugar reservado, solo se puede
+ // crecer hasta completar su ultimo trozo de checksum_chunk bytes.
+ bool grow(std::size_t newBlockCount) override;
+ bool supportsGrow() const override { return true; }
+
+ // Devuelve una vista directa al bloque dentro del mapeo (sin copia).
+ // Solo disponible con Backend::Mmap, en otro caso la vista viene vacia.
+ BlockView blockView(std::size_t blockNumber) const override;
+ bool providesViews() const override { return mode == Backend::Mmap; }
+
+ Backend backend() const { return mode; }
+ Layout layout() const { return dataOffset == metadata_size ? Layout::Compact : Layout::Aligned; }
+
+ // Buffers alineados listos para E/S directa; si el llamador lee/escribe desde uno de
+ // estos con Backend::Direct se evita la copia intermedia
+ AlignedBufferPool &bufferPool() { return pool; }
+ bool requiresAlignment() const override { return mode == Backend::Direct; }
+ std::size_t bufferAlignment() const override { return requiresAlignment() ? direct_alignment : 1; }
+
+ // Descriptor del archivo (solo con Mmap, Pread o Direct; -1 con Stream o sin imagen) y
+ // posicion de un bloque dentro de la imagen, para quien necesite emitir su propia E/S (AsyncBlockIO)
+ int nativeHandle() const override
+ {
+  return mode == Backend::Mmap || mode == Backend::Pread || mode == Backend::Direct ? fd : -1;
+ }
+ std::size_t blockOffset(std::size_t blockNumber) const override { return dataOffset + (blockNumber * blockSize); }
+
+ // Sumas de verificacion: en las imagenes creadas con checksums cada bloque tiene un CRC32C
+ // de blockMetaSize bytes en una tabla despues de la cabecera extendida. Se actualiza en cada
+ // escritura y se verifica en cada lectura (readBlock, lotes, blockView y AsyncBlockIO);
+ // un bloque que no coincide hace fallar la lectura. La tabla se escribe en flush() y close().
+ // Costo: con lecturas que vienen del almacenamiento el CRC queda muy por debajo del 5% del
+ // tiempo de lectura, pero si los bloques ya estan en la cache de paginas del host la lectura
+ // es una copia en memoria y el CRC pasa a ser una parte grande (cerca del 30% con bloques de
+ // 4 KiB). El comando checksum muestra la fraccion medida.
+ struct ChecksumStats
+ {
+  uint64_t verified = 0;    // bloques verificados
+  uint64_t failures = 0;    // bloques con CRC distinto al guardado
+  uint64_t updated = 0;     // CRC recalculados por escrituras
+  uint64_t nanoseconds = 0; // tiempo total verificando
+ };
+ bool checksumsEnabled() const { return checksums; }
+ ChecksumStats checksumStats() const;
+ bool verifyBlock(std::size_t blockNumber, const char *data) override;
+ void blockWritten(std::size_t blockNumber, const char *data) override;
+ void recordRead(std::size_t firstBlock, std::size_t count, bool ok, uint64_t startNanos) override;
+ void recordWrite(std::size_t firstBlock, std::size_t count, bool ok, uint64_t startNanos) override;
+
+ // Estadisticas de E/S: toda llamada a readBlock, writeBlock, los lotes, discardBlocks y
+ // flush se cuenta y se mide. La E/S que emite AsyncBlockIO con nativeHandle() y las
+ // lecturas con blockView se cuentan cuando quien las hace llama a recordRead/recordWrite.
+ IoStats::Summary ioStats() const { return stats.summary(); }
+ // Tambien reinicia los contadores de verificacion, para comparar el mismo intervalo
+ void resetIoStats();
+
+ // Traza de E/S: graba las mismas llamadas que cuentan las estadisticas (sin los datos)
+ // hasta stopTrace(). Ver BlockTrace.h y la herramienta TraceReplay.
+ bool startTrace(const std::string &filename) { return trace.start(filename, blockSize, blockCount); }
+ bool stopTrace() { return trace.stop(); }
+ bool tracing() const { return trace.active(); }
+ uint64_t tracedRecords() const { return trace.recorded(); }
 
 private:
  std::fstream file;
+ std::mutex streamMutex; // protege el cursor compartido de file
+ Backend mode = Backend::Stream;
+ int fd = -1;
+ char *mapBase = nullptr;
+ std::size_t mapLength = 0;
+
+ bool openDescriptor(const std::string &filename, Backend backend);
+ void closeDescriptor();
+ std::vector<char> zeroBlock; // bloque de ceros reutilizado para el relleno de writeBlock
+ std::size_t dataOffset = metadata_size; // donde empieza el bloque 0 dentro del archivo
+ AlignedBufferPool pool;
+
+ bool readHeader(const char *raw, std::size_t length);
+ bool flushImage();
+ bool discardImageBlocks(const std::vector<std::size_t> &blockNumbers);
+ bool readBlockData(std::size_t blockNumber, char *buffer);
+ bool writeBlockData(std::size_t blockNumber, const char *data, std::size_t size);
+
+ bool checksums = false;
+ std::size_t checksumOffset = 0;
+ std::size_t checksumLength = 0;
+ AlignedBufferPool tableMemory;      // copia de la tabla en memoria (con Mmap se usa el mapeo)
+ uint32_t *table = nullptr;
+ std::vector<uint8_t> tableDirty;    // un byte por cada checksum_chunk bytes de la tabla
+ uint32_t zeroChecksum = 0;          // CRC de un bloque lleno de ceros
+ mutable std::atomic<uint64_t> checksumsVerified{0};
+ mutable std::atomic<uint64_t> checksumFailures{0};
+ std::atomic<uint64_t> checksumsUpdated{0};
+ mutable std::atomic<uint64_t> checksumNanos{0};
+
+ bool loadChecksums();
+ bool saveChecksums();
+ void releaseChecksums();
+ void updateChecksum(std::size_t blockNumber, const char *data, std::size_t size);
+ bool checkBlock(std::size_t blockNumber, const char *data) const;
+ // Sin medir ni contar: quien verifica un lote mide el lote entero con countVerified
+ bool matchesChecksum(std::size_t blockNumber, const char *data) const;
+ void countVerified(std::size_t blocks, uint64_t startNanos) const;
+ bool allocateImage(const std::string &filename, std::size_t fileSize, Allocation allocation);
+ bool punchRange(int handle, std::size_t firstBlock, std::size_t count);
+
+ std::string imagePath; // Stream no tiene descriptor propio, se abre uno al descartar
+ bool discardSupported = true; // pasa a false si el host no soporta perforar huecos
+ IoStats stats;
+ TraceRecorder trace;
+
+ bool transferRun(bool write, std::size_t firstBlock, struct iovec *iov, std::size_t count);
+ template <typename BufferPtr>
+ bool transferBatch(bool write, const std::vector<std::size_t> &blockNumbers, const std::vector<BufferPtr> &buffers);
+
  static constexpr std::size_t metadata_size = 16; // 8 bytes para blockSize y blockCount + 8 relleno
  static constexpr std::size_t blockMetaSize = 4;
+ // Layout::Aligned: la cabecera extendida empieza con este numero magico ("BDEVEXT1")
+ static constexpr uint64_t extended_magic = 0x3154584556454442ULL;
+ static constexpr std::size_t extended_header_size = 64;
+ static constexpr std::size_t aligned_data_offset = 4096;
+ static constexpr std::size_t direct_alignment = 4096;
+ static constexpr std::size_t direct_sector_size = 512;
+ static constexpr std::size_t direct_pool_buffers = 16;
+ static constexpr uint64_t header_flag_checksums = 1;
+ static constexpr std::size_t checksum_chunk = 4096; // unidad en la que se escribe la tabla
 };
 
 #endif // BLOCKDEVICE_H
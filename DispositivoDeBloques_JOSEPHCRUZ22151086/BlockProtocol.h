@@ -0,0 +1,57 @@
+#ifndef BLOCKPROTOCOL_H
+#define BLOCKPROTOCOL_H
+
+#include <cstdint>
+
+// Protocolo entre BlockServer y RemoteBlockDevice sobre un socket Unix (SOCK_STREAM).
+// Cada pedido es una cabecera de 24 bytes, seguida en Write de count*blockSize bytes de
+// datos; cada respuesta una cabecera de 16 bytes, seguida en Read/Hello de length bytes.
+// El cliente puede mandar muchos pedidos sin esperar las respuestas (pipelining): el
+// servidor los atiende y responde en el orden en que llegaron, y tag identifica a cual
+// pedido corresponde cada respuesta. Enteros en el orden de bytes del host (el socket es local).
+enum class BlockOp : uint32_t
+{
+ Hello = 1,   // respuesta: BlockDeviceInfo
+ Read = 2,    // count bloques desde block
+ Write = 3,   // count bloques desde block
+ Flush = 4,
+ Discard = 5, // count bloques desde block
+};
+
+struct BlockRequest
+{
+ uint32_t op; // BlockOp
+ uint32_t count;
+ uint64_t tag;
+ uint64_t block;
+};
+static_assert(sizeof(BlockRequest) == 24, "El pedido mide 24 bytes");
+
+// Valores de BlockResponse::status
+constexpr uint32_t BLOCK_STATUS_OK = 0;
+constexpr uint32_t BLOCK_STATUS_ERROR = 1;   // el dispositivo fallo
+constexpr uint32_t BLOCK_STATUS_INVALID = 2; // pedido fuera de rango u operacion desconocida
+
+struct BlockResponse
+{
+ uint64_t tag;
+ uint32_t status;
+ uint32_t length; // bytes que siguen
+};
+static_assert(sizeof(BlockResponse) == 16, "La respuesta mide 16 bytes");
+
+constexpr uint32_t BLOCK_INFO_DISCARD = 1; // el dispositivo soporta Discard
+
+struct BlockDeviceInfo
+{
+ uint64_t blockSize;
+ uint64_t blockCount;
+ uint32_t flags;
+ uint32_t reserved;
+};
+static_assert(sizeof(BlockDeviceInfo) == 24, "La descripcion del dispositivo mide 24 bytes");
+
+// Bloques como maximo en un pedido Read/Write; el cliente parte los lotes mas grandes
+constexpr uint32_t BLOCK_MAX_REQUEST_BLOCKS = 256;
+
+#endif // BLOCKPROTOCOL_H
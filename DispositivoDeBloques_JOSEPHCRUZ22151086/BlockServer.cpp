@@ -0,0 +1,513 @@
+// Servidor de bloques: abre una imagen y atiende pedidos de lectura, escritura, flush y
+// descarte de otros procesos por un socket Unix (protocolo en BlockProtocol.h; el cliente
+// es RemoteBlockDevice, comando connect del REPL).
+//
+// Uso: BlockServer <imagen> <socket> [stream|mmap|pread|direct]
+//
+// Un solo hilo con un lazo epoll atiende todas las conexiones. De cada conexion se procesa
+// todo lo que ya llego: los pedidos Read (o Write) seguidos se juntan en una sola llamada
+// readBlocks (writeBlocks), asi los bloques consecutivos de varios pedidos salen en una
+// sola preadv/pwritev, y sus respuestas se mandan juntas. Si un cliente no lee sus
+// respuestas se deja de leer lo que manda hasta que las reciba. SIGINT/SIGTERM terminan el
+// servidor despues de hacer flush de la imagen.
+#include "BlockDevice.h"
+#include "BlockProtocol.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+ stopRequested = 1;
+}
+
+struct Connection
+{
+ int fd = -1;
+ std::vector<char> in;      // bytes recibidos
+ std::size_t inPos = 0;     // lo anterior ya se proceso
+ std::vector<char> out;     // respuestas por mandar
+ std::size_t outPos = 0;    // lo anterior ya se mando
+ uint32_t events = 0;       // lo registrado en epoll
+};
+
+class BlockServer
+{
+public:
+ explicit BlockServer(BlockDevice &image) : image(image) {}
+ ~BlockServer();
+
+ bool listen(const std::string &socketPath);
+ void run();
+
+ uint64_t requestsServed() const { return served; }
+ uint64_t connectionsAccepted() const { return accepted; }
+
+private:
+ static constexpr std::size_t receive_chunk = 256 * 1024;
+ static constexpr std::size_t max_pending_output = 8 * 1024 * 1024; // con mas se deja de leer
+ static constexpr std::size_t max_coalesced_blocks = 1024;          // por llamada al dispositivo
+
+ BlockDevice &image;
+ int listener = -1;
+ int epollFd = -1;
+ std::string path;
+ std::map<int, Connection> connections;
+ uint64_t served = 0;
+ uint64_t accepted = 0;
+
+ void acceptClients();
+ bool receive(Connection &conn);
+ bool process(Connection &conn);
+ bool send(Connection &conn);
+ void updateInterest(Connection &conn);
+ void drop(int fd);
+
+ void respond(Connection &conn, uint64_t tag, uint32_t status, const void *data = nullptr, std::size_t length = 0);
+ std::size_t payloadLength(const BlockRequest &request) const;
+ bool inRange(const BlockRequest &request) const;
+ // Pedido de lectura/escritura a atender en grupo; data apunta al buffer de entrada
+ struct Transfer
+ {
+  BlockRequest request;
+  const char *data;
+ };
+ void serveTransfers(Connection &conn, std::vector<Transfer> &group, bool write);
+};
+
+BlockServer::~BlockServer()
+{
+ for (auto &entry : connections)
+  ::close(entry.first);
+ if (listener >= 0)
+ {
+  ::close(listener);
+  ::unlink(path.c_str());
+ }
+ if (epollFd >= 0)
+  ::close(epollFd);
+}
+
+bool BlockServer::listen(const std::string &socketPath)
+{
+ struct sockaddr_un addr = {};
+ addr.sun_family = AF_UNIX;
+ if (socketPath.size() >= sizeof(addr.sun_path))
+ {
+  std::cerr << "La ruta del socket es demasiado larga.\n";
+  return false;
+ }
+ std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+ // Un socket que quedo de una ejecucion anterior se reemplaza
+ struct stat st;
+ if (::stat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+  ::unlink(socketPath.c_str());
+
+ listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+ if (listener < 0 || ::bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+     ::listen(listener, SOMAXCONN) != 0)
+ {
+  std::cerr << "No se pudo escuchar en " << socketPath << ": " << std::strerror(errno) << "\n";
+  if (listener >= 0)
+   ::close(listener);
+  listener = -1;
+  return false;
+ }
+ path = socketPath;
+
+ epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+ struct epoll_event ev = {};
+ ev.events = EPOLLIN;
+ ev.data.fd = listener;
+ if (epollFd < 0 || ::epoll_ctl(epollFd, EPOLL_CTL_ADD, listener, &ev) != 0)
+ {
+  std::cerr << "No se pudo crear el epoll.\n";
+  return false;
+ }
+ return true;
+}
+
+void BlockServer::run()
+{
+ struct epoll_event events[64];
+ while (!stopRequested)
+ {
+  int n = ::epoll_wait(epollFd, events, 64, -1);
+  if (n < 0)
+  {
+   if (errno == EINTR)
+    continue;
+   std::cerr << "Error en epoll_wait: " << std::strerror(errno) << "\n";
+   return;
+  }
+  for (int i = 0; i < n; i++)
+  {
+   int fd = events[i].data.fd;
+   if (fd == listener)
+   {
+    acceptClients();
+    continue;
+   }
+   auto it = connections.find(fd);
+   if (it == connections.end())
+    continue;
+   Connection &conn = it->second;
+   bool alive = true;
+   if (events[i].events & EPOLLOUT)
+    alive = send(conn);
+   if (alive && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    alive = receive(conn);
+   // Al terminar de mandar se retoma lo que quedo sin procesar por falta de lugar
+   if (alive)
+    alive = process(conn) && send(conn);
+   if (alive)
+    updateInterest(conn);
+   else
+    drop(fd);
+  }
+ }
+}
+
+void BlockServer::acceptClients()
+{
+ while (true)
+ {
+  int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+  {
+   if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    std::cerr << "Error aceptando una conexión: " << std::strerror(errno) << "\n";
+   return;
+  }
+  Connection &conn = connections[fd];
+  conn.fd = fd;
+  conn.events = EPOLLIN;
+  struct epoll_event ev = {};
+  ev.events = conn.events;
+  ev.data.fd = fd;
+  if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0)
+  {
+   connections.erase(fd);
+   ::close(fd);
+   continue;
+  }
+  accepted++;
+ }
+}
+
+void BlockServer::drop(int fd)
+{
+ ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+ ::close(fd);
+ connections.erase(fd);
+}
+
+void BlockServer::updateInterest(Connection &conn)
+{
+ std::size_t pending = conn.out.size() - conn.outPos;
+ uint32_t wanted = 0;
+ if (pending < max_pending_output)
+  wanted |= EPOLLIN;
+ if (pending > 0)
+  wanted |= EPOLLOUT;
+ if (wanted == conn.events)
+  return;
+ struct epoll_event ev = {};
+ ev.events = wanted;
+ ev.data.fd = conn.fd;
+ ::epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &ev);
+ conn.events = wanted;
+}
+
+// Una lectura por evento (epoll por nivel vuelve a avisar si queda algo). false si se cerro
+bool BlockServer::receive(Connection &conn)
+{
+ // Lo ya procesado se descarta antes de agregar mas
+ if (conn.inPos > 0)
+ {
+  conn.in.erase(conn.in.begin(), conn.in.begin() + (std::ptrdiff_t)conn.inPos);
+  conn.inPos = 0;
+ }
+ std::size_t old = conn.in.size();
+ conn.in.resize(old + receive_chunk);
+ ssize_t n = ::recv(conn.fd, conn.in.data() + old, receive_chunk, 0);
+ if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+ {
+  conn.in.resize(old);
+  return true;
+ }
+ if (n <= 0)
+  return false;
+ conn.in.resize(old + (std::size_t)n);
+ return true;
+}
+
+bool BlockServer::send(Connection &conn)
+{
+ while (conn.outPos < conn.out.size())
+ {
+  ssize_t n = ::send(conn.fd, conn.out.data() + conn.outPos, conn.out.size() - conn.outPos, MSG_NOSIGNAL);
+  if (n < 0)
+  {
+   if (errno == EINTR)
+    continue;
+   if (errno == EAGAIN || errno == EWOULDBLOCK)
+    break;
+   return false;
+  }
+  conn.outPos += (std::size_t)n;
+ }
+ if (conn.outPos == conn.out.size())
+ {
+  conn.out.clear();
+  conn.outPos = 0;
+ }
+ return true;
+}
+
+void BlockServer::respond(Connection &conn, uint64_t tag, uint32_t status, const void *data, std::size_t length)
+{
+ BlockResponse response;
+ response.tag = tag;
+ response.status = status;
+ response.length = (uint32_t)length;
+ const char *raw = reinterpret_cast<const char *>(&response);
+ conn.out.insert(conn.out.end(), raw, raw + sizeof(response));
+ if (length > 0)
+ {
+  const char *bytes = static_cast<const char *>(data);
+  conn.out.insert(conn.out.end(), bytes, bytes + length);
+ }
+ served++;
+}
+
+std::size_t BlockServer::payloadLength(const BlockRequest &request) const
+{
+ return request.op == (uint32_t)BlockOp::Write ? (std::size_t)request.count * image.blockSize : 0;
+}
+
+bool BlockServer::inRange(const BlockRequest &request) const
+{
+ return request.count > 0 && request.block < image.blockCount && request.count <= image.blockCount - request.block;
+}
+
+// Procesa los pedidos completos que hay en el buffer de entrada. false si el cliente
+// mando algo que no se puede interpretar (se corta la conexion)
+bool BlockServer::process(Connection &conn)
+{
+ std::vector<Transfer> group;
+ bool groupWrite = false;
+ std::size_t groupBlocks = 0;
+
+ while (conn.out.size() - conn.outPos < max_pending_output)
+ {
+  // La cabecera se copia: dentro del buffer puede no estar alineada
+  std::size_t available = conn.in.size() - conn.inPos;
+  BlockRequest header;
+  const BlockRequest *request = nullptr;
+  if (available >= sizeof(BlockRequest))
+  {
+   std::memcpy(&header, conn.in.data() + conn.inPos, sizeof(header));
+   request = &header;
+   bool transfer = request->op == (uint32_t)BlockOp::Read || request->op == (uint32_t)BlockOp::Write;
+   if (transfer && request->count > BLOCK_MAX_REQUEST_BLOCKS)
+   {
+    std::cerr << "Pedido demasiado grande, se cierra la conexión.\n";
+    return false;
+   }
+   if (available < sizeof(BlockRequest) + payloadLength(*request))
+    request = nullptr;
+  }
+
+  // Un grupo de lecturas o escrituras se atiende cuando llega algo distinto, se llena o no hay mas
+  bool isWrite = request && request->op == (uint32_t)BlockOp::Write;
+  bool transfer = request && (request->op == (uint32_t)BlockOp::Read || isWrite) && inRange(*request);
+  if (!group.empty() &&
+      (!transfer || isWrite != groupWrite || groupBlocks + request->count > max_coalesced_blocks))
+  {
+   serveTransfers(conn, group, groupWrite);
+   groupBlocks = 0;
+  }
+  if (!request)
+   break;
+  // Los datos quedan en el buffer de entrada, que no cambia hasta el proximo receive()
+  const char *data = conn.in.data() + conn.inPos + sizeof(BlockRequest);
+  conn.inPos += sizeof(BlockRequest) + payloadLength(*request);
+
+  if (transfer)
+  {
+   group.push_back(Transfer{header, data});
+   groupWrite = isWrite;
+   groupBlocks += request->count;
+   continue;
+  }
+
+  switch ((BlockOp)request->op)
+  {
+  case BlockOp::Hello:
+  {
+   BlockDeviceInfo info{};
+   info.blockSize = image.blockSize;
+   info.blockCount = image.blockCount;
+   info.flags = image.supportsDiscard() ? BLOCK_INFO_DISCARD : 0;
+   respond(conn, request->tag, BLOCK_STATUS_OK, &info, sizeof(info));
+   break;
+  }
+  case BlockOp::Read:
+  case BlockOp::Write:
+   // Fuera de rango (los validos se juntaron en el grupo)
+   respond(conn, request->tag, BLOCK_STATUS_INVALID);
+   break;
+  case BlockOp::Flush:
+   respond(conn, request->tag, image.flush() ? BLOCK_STATUS_OK : BLOCK_STATUS_ERROR);
+   break;
+  case BlockOp::Discard:
+  {
+   if (!inRange(*request))
+   {
+    respond(conn, request->tag, BLOCK_STATUS_INVALID);
+    break;
+   }
+   std::vector<std::size_t> blocks(request->count);
+   for (uint32_t b = 0; b < request->count; b++)
+    blocks[b] = request->block + b;
+   respond(conn, request->tag, image.discardBlocks(blocks) ? BLOCK_STATUS_OK : BLOCK_STATUS_ERROR);
+   break;
+  }
+  default:
+   std::cerr << "Operación desconocida (" << request->op << "), se cierra la conexión.\n";
+   return false;
+  }
+ }
+ if (!group.empty())
+  serveTransfers(conn, group, groupWrite);
+ return true;
+}
+
+// Atiende varios pedidos Read (o Write) seguidos con una sola llamada al dispositivo
+void BlockServer::serveTransfers(Connection &conn, std::vector<Transfer> &group, bool write)
+{
+ std::vector<std::size_t> blocks;
+ for (const Transfer &t : group)
+  for (uint32_t b = 0; b < t.request.count; b++)
+   blocks.push_back(t.request.block + b);
+
+ if (write)
+ {
+  std::vector<const char *> buffers;
+  for (const Transfer &t : group)
+   for (uint32_t b = 0; b < t.request.count; b++)
+    buffers.push_back(t.data + (std::size_t)b * image.blockSize);
+  bool ok = blocks.size() == 1 ? image.writeBlock(blocks[0], buffers[0], image.blockSize)
+                               : image.writeBlocks(blocks, buffers);
+  for (const Transfer &t : group)
+   respond(conn, t.request.tag, ok ? BLOCK_STATUS_OK : BLOCK_STATUS_ERROR);
+ }
+ else
+ {
+  // Las respuestas se arman en su lugar del buffer de salida y se lee directo ahi
+  std::size_t start = conn.out.size();
+  std::size_t total = 0;
+  for (const Transfer &t : group)
+   total += sizeof(BlockResponse) + (std::size_t)t.request.count * image.blockSize;
+  conn.out.resize(start + total);
+
+  std::vector<char *> buffers;
+  std::size_t pos = start;
+  for (const Transfer &t : group)
+  {
+   pos += sizeof(BlockResponse);
+   for (uint32_t b = 0; b < t.request.count; b++)
+   {
+    buffers.push_back(conn.out.data() + pos);
+    pos += image.blockSize;
+   }
+  }
+  bool ok = blocks.size() == 1 ? image.readBlock(blocks[0], buffers[0]) : image.readBlocks(blocks, buffers);
+
+  if (ok)
+  {
+   pos = start;
+   for (const Transfer &t : group)
+   {
+    BlockResponse response;
+    response.tag = t.request.tag;
+    response.status = BLOCK_STATUS_OK;
+    response.length = (uint32_t)(t.request.count * image.blockSize);
+    std::memcpy(conn.out.data() + pos, &response, sizeof(response));
+    pos += sizeof(response) + response.length;
+    served++;
+   }
+  }
+  else
+  {
+   conn.out.resize(start);
+   for (const Transfer &t : group)
+    respond(conn, t.request.tag, BLOCK_STATUS_ERROR);
+  }
+ }
+ group.clear();
+}
+
+static bool parseBackend(const std::string &name, BlockDevice::Backend &backend)
+{
+ if (name == "stream")
+  backend = BlockDevice::Backend::Stream;
+ else if (name == "mmap")
+  backend = BlockDevice::Backend::Mmap;
+ else if (name == "pread")
+  backend = BlockDevice::Backend::Pread;
+ else if (name == "direct")
+  backend = BlockDevice::Backend::Direct;
+ else
+  return false;
+ return true;
+}
+
+int main(int argc, char *argv[])
+{
+ BlockDevice::Backend backend = BlockDevice::Backend::Pread;
+ if (argc < 3 || argc > 4 || (argc == 4 && !parseBackend(argv[3], backend)))
+ {
+  std::cerr << "Uso: " << argv[0] << " <imagen> <socket> [stream|mmap|pread|direct]\n";
+  return 2;
+ }
+
+ BlockDevice image;
+ if (!image.open(argv[1], backend))
+  return 1;
+
+ struct sigaction sa = {};
+ sa.sa_handler = onSignal;
+ ::sigaction(SIGINT, &sa, nullptr);
+ ::sigaction(SIGTERM, &sa, nullptr);
+ ::signal(SIGPIPE, SIG_IGN);
+
+ {
+  BlockServer server(image);
+  if (!server.listen(argv[2]))
+   return 1;
+  std::cout << "Sirviendo " << argv[1] << " (" << image.blockCount << " bloques de " << image.blockSize
+            << " bytes) en " << argv[2] << "\n";
+  server.run();
+  std::cout << "Conexiones atendidas: " << server.connectionsAccepted() << "  pedidos: " << server.requestsServed()
+            << "\n";
+ }
+
+ bool ok = image.flush();
+ image.close();
+ return ok ? 0 : 1;
+}
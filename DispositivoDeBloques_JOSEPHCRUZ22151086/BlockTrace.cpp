@@ -0,0 +1,175 @@
+#include "BlockTrace.h"
+#include <ctime>
+#include <iostream>
+
+TraceRecorder::~TraceRecorder()
+{
+ stop();
+}
+
+bool TraceRecorder::start(const std::string &filename, std::size_t blockSize, std::size_t blockCount)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (file.is_open())
+ {
+  std::cerr << "Ya se está grabando una traza.\n";
+  return false;
+ }
+ file.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+ if (!file)
+ {
+  std::cerr << "No se pudo crear el archivo de traza.\n";
+  return false;
+ }
+
+ TraceHeader header{};
+ header.magic = TRACE_MAGIC;
+ header.version = TRACE_VERSION;
+ header.blockSize = (uint32_t)blockSize;
+ header.blockCount = blockCount;
+ header.started = (int64_t)std::time(nullptr);
+ file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+ if (!file)
+ {
+  std::cerr << "Error escribiendo la cabecera de la traza.\n";
+  file.close();
+  return false;
+ }
+
+ pending.clear();
+ pending.reserve(trace_buffer_records);
+ written = 0;
+ origin = IoStats::now();
+ recording.store(true, std::memory_order_relaxed);
+ return true;
+}
+
+bool TraceRecorder::stop()
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ recording.store(false, std::memory_order_relaxed);
+ if (!file.is_open())
+  return false;
+ bool ok = writePending();
+ file.close();
+ return ok && !file.fail();
+}
+
+uint64_t TraceRecorder::recorded() const
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ return written + pending.size();
+}
+
+TraceRecord TraceRecorder::makeRecord(IoStats::Op op, bool ok, uint64_t startNanos, uint64_t endNanos) const
+{
+ TraceRecord r{};
+ r.time = startNanos > origin ? startNanos - origin : 0;
+ uint64_t duration = endNanos > startNanos ? endNanos - startNanos : 0;
+ r.duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+ r.op = (uint8_t)op;
+ r.flags = ok ? TRACE_OK : 0;
+ return r;
+}
+
+void TraceRecorder::append(IoStats::Op op, bool ok, std::size_t firstBlock, std::size_t count, std::size_t bytes,
+                           uint64_t startNanos)
+{
+ uint64_t end = IoStats::now();
+ std::lock_guard<std::mutex> lock(mutex);
+ // Se pudo detener entre la comprobacion de active() y el lock
+ if (!file.is_open())
+  return;
+ TraceRecord r = makeRecord(op, ok, startNanos, end);
+ r.block = firstBlock;
+ r.count = (uint32_t)count;
+ r.size = (uint32_t)bytes;
+ pending.push_back(r);
+ if (pending.size() >= trace_buffer_records)
+  writePending();
+}
+
+void TraceRecorder::appendBatch(IoStats::Op op, bool ok, const std::vector<std::size_t> &blockNumbers,
+                                std::size_t blockSize, uint64_t startNanos)
+{
+ uint64_t end = IoStats::now();
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!file.is_open())
+  return;
+ // Una racha por registro, en el orden de llegada, para que la reproduccion arme el mismo lote
+ TraceRecord r = makeRecord(op, ok, startNanos, end);
+ r.flags |= TRACE_BATCH;
+ std::size_t i = 0;
+ while (i < blockNumbers.size())
+ {
+  std::size_t run = 1;
+  while (i + run < blockNumbers.size() && blockNumbers[i + run] == blockNumbers[i] + run && run < UINT32_MAX)
+   run++;
+  r.block = blockNumbers[i];
+  r.count = (uint32_t)run;
+  r.size = (uint32_t)(run * blockSize);
+  pending.push_back(r);
+  r.flags |= TRACE_CONTINUES;
+  i += run;
+ }
+ if (pending.size() >= trace_buffer_records)
+  writePending();
+}
+
+bool TraceRecorder::writePending()
+{
+ if (pending.empty())
+  return true;
+ file.write(reinterpret_cast<const char *>(pending.data()), (std::streamsize)(pending.size() * sizeof(TraceRecord)));
+ if (!file)
+ {
+  // Sin espacio para la traza no tiene sentido seguir grabando
+  std::cerr << "Error escribiendo la traza, se detiene la grabación.\n";
+  recording.store(false, std::memory_order_relaxed);
+  pending.clear();
+  return false;
+ }
+ written += pending.size();
+ pending.clear();
+ return true;
+}
+
+bool loadTrace(const std::string &filename, TraceHeader &header, std::vector<TraceRecord> &records)
+{
+ std::ifstream in(filename, std::ios::binary | std::ios::ate);
+ if (!in)
+ {
+  std::cerr << "No se pudo abrir la traza.\n";
+  return false;
+ }
+ std::streamoff length = in.tellg();
+ in.seekg(0, std::ios::beg);
+ if (length < (std::streamoff)sizeof(TraceHeader) ||
+     !in.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != TRACE_MAGIC)
+ {
+  std::cerr << "El archivo no es una traza de E/S.\n";
+  return false;
+ }
+ if (header.version != TRACE_VERSION)
+ {
+  std::cerr << "Versión de traza no soportada: " << header.version << "\n";
+  return false;
+ }
+
+ std::size_t count = (std::size_t)(length - (std::streamoff)sizeof(TraceHeader)) / sizeof(TraceRecord);
+ records.resize(count);
+ if (count > 0 && !in.read(reinterpret_cast<char *>(records.data()), (std::streamsize)(count * sizeof(TraceRecord))))
+ {
+  std::cerr << "Error leyendo la traza.\n";
+  return false;
+ }
+ for (const TraceRecord &r : records)
+ {
+  if (r.op >= IoStats::op_count)
+  {
+   std::cerr << "Registro de traza con operación desconocida.\n";
+   return false;
+  }
+ }
+ return true;
+}
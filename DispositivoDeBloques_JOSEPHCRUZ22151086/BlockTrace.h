@@ -0,0 +1,96 @@
+#ifndef BLOCKTRACE_H
+#define BLOCKTRACE_H
+
+#include "IoStats.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Formato de las trazas de E/S: una cabecera y despues registros de 32 bytes, uno por
+// llamada (o por racha de bloques consecutivos en las llamadas por lotes), en el orden en
+// que terminaron. Los datos escritos no se guardan.
+constexpr uint64_t TRACE_MAGIC = 0x3145434152544442ULL; // "BDTRACE1"
+constexpr uint32_t TRACE_VERSION = 1;
+
+struct TraceHeader
+{
+ uint64_t magic;
+ uint32_t version;
+ uint32_t blockSize;
+ uint64_t blockCount;
+ int64_t started; // segundos desde epoch
+};
+static_assert(sizeof(TraceHeader) == 32, "La cabecera de la traza mide 32 bytes");
+
+// Bits de TraceRecord::flags
+constexpr uint8_t TRACE_OK = 1;         // la llamada original no fallo
+constexpr uint8_t TRACE_CONTINUES = 2;  // otra racha de la misma llamada por lotes que el registro anterior
+constexpr uint8_t TRACE_BATCH = 4;      // la llamada fue readBlocks/writeBlocks/discardBlocks
+
+struct TraceRecord
+{
+ uint64_t time;     // ns desde que empezo la traza hasta que empezo la llamada
+ uint64_t block;    // primer bloque
+ uint32_t count;    // bloques consecutivos
+ uint32_t size;     // bytes de datos (en writeBlock puede ser menos que el bloque)
+ uint32_t duration; // ns que tardo la llamada completa (satura en 2^32-1)
+ uint8_t op;        // IoStats::Op
+ uint8_t flags;
+ uint16_t reserved;
+};
+static_assert(sizeof(TraceRecord) == 32, "Cada registro de la traza mide 32 bytes");
+
+// Graba las llamadas de un dispositivo a un archivo de traza. Los registros se juntan en
+// memoria y se escriben de a trace_buffer_records; con la grabacion apagada record() es
+// solo la lectura de un atomico. Varios hilos pueden grabar a la vez.
+class TraceRecorder
+{
+public:
+ ~TraceRecorder();
+
+ bool start(const std::string &filename, std::size_t blockSize, std::size_t blockCount);
+ bool stop();
+ bool active() const { return recording.load(std::memory_order_relaxed); }
+ uint64_t recorded() const;
+
+ // Mismos argumentos que IoStats::record/recordBatch
+ void record(IoStats::Op op, bool ok, std::size_t firstBlock, std::size_t count, std::size_t bytes,
+             uint64_t startNanos)
+ {
+  if (active())
+   append(op, ok, firstBlock, count, bytes, startNanos);
+ }
+ void recordBatch(IoStats::Op op, bool ok, const std::vector<std::size_t> &blockNumbers, std::size_t blockSize,
+                  uint64_t startNanos)
+ {
+  if (active())
+   appendBatch(op, ok, blockNumbers, blockSize, startNanos);
+ }
+
+private:
+ static constexpr std::size_t trace_buffer_records = 4096;
+
+ std::atomic<bool> recording{false};
+ mutable std::mutex mutex;
+ std::ofstream file;
+ std::vector<TraceRecord> pending;
+ uint64_t origin = 0; // IoStats::now() al empezar
+ uint64_t written = 0;
+
+ void append(IoStats::Op op, bool ok, std::size_t firstBlock, std::size_t count, std::size_t bytes,
+             uint64_t startNanos);
+ void appendBatch(IoStats::Op op, bool ok, const std::vector<std::size_t> &blockNumbers, std::size_t blockSize,
+                  uint64_t startNanos);
+ TraceRecord makeRecord(IoStats::Op op, bool ok, uint64_t startNanos, uint64_t endNanos) const;
+ bool writePending();
+};
+
+// Lee una traza completa. Un registro cortado al final (la grabacion no se detuvo bien)
+// se descarta.
+bool loadTrace(const std::string &filename, TraceHeader &header, std::vector<TraceRecord> &records);
+
+#endif // BLOCKTRACE_H
@@ -0,0 +1,507 @@
+#include "CompressedBlockDevice.h"
+#include "Lz4Codec.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// Cabecera en el bloque 0 del dispositivo de abajo
+struct CompressionHeader
+{
+ uint64_t magic;
+ uint64_t logicalBlocks;
+ uint64_t blockSize;
+ uint64_t mapStart;
+ uint64_t mapBlocks;
+ uint64_t dataStart;
+};
+
+CompressedBlockDevice::CompressedBlockDevice(std::unique_ptr<IBlockDevice> innerDevice) : inner(std::move(innerDevice))
+{
+ blockSize = inner->blockSize;
+ fragmentSize = blockSize / fragments_per_block;
+}
+
+CompressedBlockDevice::~CompressedBlockDevice()
+{
+ if (opened)
+  flush();
+}
+
+bool CompressedBlockDevice::isCompressed(IBlockDevice &device)
+{
+ if (device.blockSize < sizeof(CompressionHeader) || device.blockCount == 0)
+  return false;
+ std::vector<char> raw(device.blockSize);
+ if (!device.readBlock(0, raw.data()))
+  return false;
+ CompressionHeader header;
+ std::memcpy(&header, raw.data(), sizeof(header));
+ return header.magic == header_magic;
+}
+
+// Cuantos bloques de mapa hacen falta y si todo cabe en el dispositivo de abajo
+bool CompressedBlockDevice::validBlocks(std::size_t logicalBlocks, std::size_t innerBlocks, std::size_t &mapBlockCount) const
+{
+ mapBlockCount = (logicalBlocks * sizeof(MapEntry) + blockSize - 1) / blockSize;
+ // Cabecera, mapa y al menos un bloque de datos; physical es de 32 bits
+ return logicalBlocks > 0 && mapStart + mapBlockCount < innerBlocks && innerBlocks <= UINT32_MAX;
+}
+
+bool CompressedBlockDevice::create(std::size_t logicalBlocks)
+{
+ // Con fragmentos de 1/16 de bloque y largos de 16 bits
+ if (blockSize < 256 || blockSize > 65536 || blockSize % fragments_per_block != 0)
+ {
+  std::cerr << "La compresión requiere bloques de 256 a 65536 bytes, múltiplos de " << fragments_per_block << ".\n";
+  return false;
+ }
+
+ std::size_t innerBlocks = inner->blockCount;
+ if (logicalBlocks == 0)
+ {
+  // Tantos bloques logicos como fisicos de datos: L + 1 + ceil(8L / blockSize) <= innerBlocks
+  logicalBlocks = innerBlocks > mapStart ? (innerBlocks - mapStart) * blockSize / (blockSize + sizeof(MapEntry)) : 0;
+ }
+
+ std::size_t mapBlockCount;
+ if (!validBlocks(logicalBlocks, innerBlocks, mapBlockCount))
+ {
+  std::cerr << "El dispositivo es demasiado chico para la capa de compresión.\n";
+  return false;
+ }
+
+ // Un mapa en cero marca todos los bloques logicos como bloques en cero
+ std::vector<char> block(blockSize, 0);
+ for (std::size_t i = 0; i < mapBlockCount; i++)
+ {
+  if (!inner->writeBlock(mapStart + i, block.data(), blockSize))
+   return false;
+ }
+
+ CompressionHeader header;
+ header.magic = header_magic;
+ header.logicalBlocks = logicalBlocks;
+ header.blockSize = blockSize;
+ header.mapStart = mapStart;
+ header.mapBlocks = mapBlockCount;
+ header.dataStart = mapStart + mapBlockCount;
+ std::memcpy(block.data(), &header, sizeof(header));
+ if (!inner->writeBlock(0, block.data(), blockSize) || !inner->flush())
+ {
+  std::cerr << "Error escribiendo la cabecera de compresión.\n";
+  return false;
+ }
+ return true;
+}
+
+bool CompressedBlockDevice::open()
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ std::vector<char> block(blockSize);
+ CompressionHeader header;
+ if (blockSize < sizeof(header) || !inner->readBlock(0, block.data()))
+  return false;
+ std::memcpy(&header, block.data(), sizeof(header));
+
+ std::size_t mapBlockCount;
+ if (header.magic != header_magic || header.blockSize != blockSize || header.mapStart != mapStart ||
+     !validBlocks(header.logicalBlocks, inner->blockCount, mapBlockCount) || header.mapBlocks != mapBlockCount ||
+     header.dataStart != mapStart + mapBlockCount)
+ {
+  std::cerr << "La cabecera de compresión no es válida.\n";
+  return false;
+ }
+
+ blockCount = header.logicalBlocks;
+ mapBlocks = header.mapBlocks;
+ dataStart = header.dataStart;
+
+ // El mapa se lee en un solo lote
+ std::vector<char> raw(mapBlocks * blockSize);
+ std::vector<std::size_t> numbers;
+ std::vector<char *> buffers;
+ for (std::size_t i = 0; i < mapBlocks; i++)
+ {
+  numbers.push_back(mapStart + i);
+  buffers.push_back(raw.data() + i * blockSize);
+ }
+ if (!inner->readBlocks(numbers, buffers))
+ {
+  std::cerr << "Error leyendo el mapa de compresión.\n";
+  return false;
+ }
+ map.resize(blockCount);
+ std::memcpy(map.data(), raw.data(), blockCount * sizeof(MapEntry));
+ mapDirty.assign(mapBlocks, 0);
+
+ // La ocupacion de los bloques fisicos no se guarda, se reconstruye desde el mapa
+ used.assign(inner->blockCount - dataStart, 0);
+ for (const MapEntry &entry : map)
+ {
+  if (entry.kind == kind_zero)
+   continue;
+  if (entry.physical < dataStart || entry.physical >= inner->blockCount || entry.kind > kind_raw ||
+      (entry.kind == kind_lz && (entry.length == 0 || entry.firstFragment >= fragments_per_block)))
+  {
+   std::cerr << "El mapa de compresión está corrupto.\n";
+   return false;
+  }
+  if (entry.kind == kind_raw)
+   usedMask(entry.physical) = full_mask;
+  else
+   usedMask(entry.physical) |= fragmentMask(entry.firstFragment, (unsigned)((entry.length + fragmentSize - 1) / fragmentSize));
+ }
+
+ pendingFree.clear();
+ cursor = 0;
+ openBlock = no_block;
+ openDirty = false;
+ lastRead = no_block;
+ openBuffer.assign(blockSize, 0);
+ lastReadBuffer.assign(blockSize, 0);
+ padded.assign(blockSize, 0);
+ compressed.assign(blockSize, 0);
+ counters = Stats();
+ opened = true;
+ return true;
+}
+
+uint16_t CompressedBlockDevice::fragmentMask(unsigned first, unsigned count)
+{
+ if (count >= fragments_per_block)
+  return full_mask;
+ return (uint16_t)(((1u << count) - 1) << first);
+}
+
+// Busca count fragmentos libres seguidos dentro de un bloque
+bool CompressedBlockDevice::findRun(uint16_t mask, unsigned count, unsigned &first)
+{
+ uint16_t want = fragmentMask(0, count);
+ for (unsigned i = 0; i + count <= fragments_per_block; i++)
+ {
+  if ((mask & (uint16_t)(want << i)) == 0)
+  {
+   first = i;
+   return true;
+  }
+ }
+ return false;
+}
+
+// Primer bloque fisico (desde el cursor, dando la vuelta) totalmente libre, o con count
+// fragmentos seguidos libres si allowPartial. Nunca devuelve el bloque abierto.
+std::size_t CompressedBlockDevice::findFreeBlock(bool allowPartial, unsigned count)
+{
+ std::size_t total = used.size();
+ std::size_t partial = no_block;
+ for (std::size_t step = 0; step < total; step++)
+ {
+  std::size_t index = (cursor + step) % total;
+  std::size_t physical = dataStart + index;
+  if (physical == openBlock)
+   continue;
+  if (used[index] == 0)
+  {
+   cursor = index;
+   return physical;
+  }
+  unsigned first;
+  if (allowPartial && partial == no_block && findRun(used[index], count, first))
+   partial = physical;
+ }
+ // Un bloque a medio llenar se reutiliza solo si no quedan bloques vacios
+ if (partial != no_block)
+  cursor = partial - dataStart;
+ return partial;
+}
+
+bool CompressedBlockDevice::sealOpenBlock()
+{
+ if (openBlock == no_block || !openDirty)
+  return true;
+ if (!inner->writeBlock(openBlock, openBuffer.data(), blockSize))
+  return false;
+ counters.physicalWrites++;
+ openDirty = false;
+ return true;
+}
+
+// Reserva count fragmentos en el bloque abierto; si no caben se cierra y se abre otro
+bool CompressedBlockDevice::placeFragments(unsigned count, std::size_t &physical, unsigned &first)
+{
+ if (openBlock == no_block || !findRun(usedMask(openBlock), count, first))
+ {
+  if (!sealOpenBlock())
+   return false;
+  std::size_t next = findFreeBlock(true, count);
+  if (next == no_block)
+  {
+   std::cerr << "No queda espacio físico en el dispositivo comprimido.\n";
+   return false;
+  }
+
+  // Un bloque con otros datos se carga para no perderlos al reescribirlo
+  if (usedMask(next) != 0)
+  {
+   if (!inner->readBlock(next, openBuffer.data()))
+    return false;
+   counters.physicalReads++;
+  }
+  else
+  {
+   std::fill(openBuffer.begin(), openBuffer.end(), 0);
+  }
+  openBlock = next;
+  if (lastRead == next)
+   lastRead = no_block;
+  findRun(usedMask(openBlock), count, first);
+ }
+
+ usedMask(openBlock) |= fragmentMask(first, count);
+ physical = openBlock;
+ return true;
+}
+
+// Los fragmentos viejos se liberan recien en el proximo flush (ver la descripcion de la clase)
+void CompressedBlockDevice::releaseEntry(const MapEntry &entry)
+{
+ if (entry.kind == kind_raw)
+  pendingFree.push_back({entry.physical, full_mask});
+ else if (entry.kind == kind_lz)
+  pendingFree.push_back({entry.physical, fragmentMask(entry.firstFragment, (unsigned)((entry.length + fragmentSize - 1) / fragmentSize))});
+}
+
+bool CompressedBlockDevice::writeBlock(std::size_t blockNumber, const char *data, std::size_t size)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!opened || blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque inválido.\n";
+  return false;
+ }
+ if (size > blockSize)
+ {
+  std::cerr << "Datos demasiado grandes para el bloque.\n";
+  return false;
+ }
+
+ const char *block = data;
+ if (size < blockSize)
+ {
+  std::memcpy(padded.data(), data, size);
+  std::memset(padded.data() + size, 0, blockSize - size);
+  block = padded.data();
+ }
+
+ MapEntry entry;
+ std::memset(&entry, 0, sizeof(entry));
+ counters.writes++;
+ counters.logicalBytes += size;
+
+ bool zero = std::all_of(block, block + blockSize, [](char c)
+                         { return c == 0; });
+ if (zero)
+ {
+  entry.kind = kind_zero;
+  counters.zeroBlocks++;
+ }
+ else
+ {
+  // Solo vale la pena si ahorra al menos un fragmento
+  std::size_t length = lz4Compress(block, blockSize, compressed.data(), blockSize - fragmentSize);
+  if (length > 0)
+  {
+   unsigned count = (unsigned)((length + fragmentSize - 1) / fragmentSize);
+   std::size_t physical;
+   unsigned first;
+   if (!placeFragments(count, physical, first))
+    return false;
+   std::memcpy(openBuffer.data() + first * fragmentSize, compressed.data(), length);
+   openDirty = true;
+   entry.kind = kind_lz;
+   entry.physical = (uint32_t)physical;
+   entry.length = (uint16_t)length;
+   entry.firstFragment = (uint8_t)first;
+   counters.compressedBlocks++;
+   counters.storedBytes += count * fragmentSize;
+  }
+  else
+  {
+   std::size_t physical = findFreeBlock(false, fragments_per_block);
+   if (physical == no_block)
+   {
+    std::cerr << "No queda espacio físico en el dispositivo comprimido.\n";
+    return false;
+   }
+   if (!inner->writeBlock(physical, block, blockSize))
+    return false;
+   usedMask(physical) = full_mask;
+   if (lastRead == physical)
+    lastRead = no_block;
+   counters.physicalWrites++;
+   entry.kind = kind_raw;
+   entry.physical = (uint32_t)physical;
+   counters.rawBlocks++;
+   counters.storedBytes += blockSize;
+  }
+ }
+
+ releaseEntry(map[blockNumber]);
+ map[blockNumber] = entry;
+ mapDirty[blockNumber * sizeof(MapEntry) / blockSize] = 1;
+ return true;
+}
+
+// Deja en data el contenido del bloque fisico: desde el bloque abierto, el ultimo leido, o
+// leyendolo del dispositivo de abajo
+bool CompressedBlockDevice::readPhysical(std::size_t physical, const char *&data)
+{
+ if (physical == openBlock)
+ {
+  data = openBuffer.data();
+  return true;
+ }
+ if (physical != lastRead)
+ {
+  if (!inner->readBlock(physical, lastReadBuffer.data()))
+  {
+   lastRead = no_block;
+   return false;
+  }
+  counters.physicalReads++;
+  lastRead = physical;
+ }
+ data = lastReadBuffer.data();
+ return true;
+}
+
+bool CompressedBlockDevice::readBlock(std::size_t blockNumber, char *buffer)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!opened || blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque inválido.\n";
+  return false;
+ }
+
+ const MapEntry &entry = map[blockNumber];
+ if (entry.kind == kind_zero)
+ {
+  std::memset(buffer, 0, blockSize);
+  return true;
+ }
+ if (entry.kind == kind_raw)
+ {
+  if (!inner->readBlock(entry.physical, buffer))
+   return false;
+  counters.physicalReads++;
+  return true;
+ }
+
+ const char *data;
+ if (!readPhysical(entry.physical, data))
+  return false;
+
+ auto start = std::chrono::steady_clock::now();
+ bool ok = lz4Decompress(data + entry.firstFragment * fragmentSize, entry.length, buffer, blockSize);
+ auto elapsed = std::chrono::steady_clock::now() - start;
+ counters.decompressNanos += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+ if (!ok)
+ {
+  std::cerr << "Los datos comprimidos del bloque " << blockNumber << " están corruptos.\n";
+  return false;
+ }
+ counters.decompressedBytes += blockSize;
+ return true;
+}
+
+bool CompressedBlockDevice::discardBlocks(const std::vector<std::size_t> &blockNumbers)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ for (std::size_t blockNumber : blockNumbers)
+ {
+  if (!opened || blockNumber >= blockCount)
+  {
+   std::cerr << "Número de bloque inválido.\n";
+   return false;
+  }
+  releaseEntry(map[blockNumber]);
+  std::memset(&map[blockNumber], 0, sizeof(MapEntry));
+  mapDirty[blockNumber * sizeof(MapEntry) / blockSize] = 1;
+ }
+ return true;
+}
+
+bool CompressedBlockDevice::saveMap()
+{
+ const char *raw = reinterpret_cast<const char *>(map.data());
+ std::size_t total = map.size() * sizeof(MapEntry);
+ for (std::size_t i = 0; i < mapBlocks; i++)
+ {
+  if (!mapDirty[i])
+   continue;
+  std::size_t offset = i * blockSize;
+  if (!inner->writeBlock(mapStart + i, raw + offset, std::min(blockSize, total - offset)))
+  {
+   std::cerr << "Error escribiendo el mapa de compresión.\n";
+   return false;
+  }
+  mapDirty[i] = 0;
+ }
+ return true;
+}
+
+// Orden: datos del bloque abierto, mapa, flush de abajo; recien entonces se liberan los
+// fragmentos viejos. Los bloques fisicos que quedan vacios se descartan abajo.
+bool CompressedBlockDevice::flush()
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!opened)
+  return false;
+ if (!sealOpenBlock() || !saveMap() || !inner->flush())
+  return false;
+
+ std::vector<std::size_t> emptied;
+ for (auto &pending : pendingFree)
+ {
+  uint16_t &mask = usedMask(pending.first);
+  mask &= (uint16_t)~pending.second;
+  if (mask == 0 && pending.first != openBlock)
+   emptied.push_back(pending.first);
+ }
+ pendingFree.clear();
+
+ std::sort(emptied.begin(), emptied.end());
+ emptied.erase(std::unique(emptied.begin(), emptied.end()), emptied.end());
+ if (std::find(emptied.begin(), emptied.end(), lastRead) != emptied.end())
+  lastRead = no_block;
+ if (!emptied.empty() && inner->supportsDiscard())
+  inner->discardBlocks(emptied);
+ return true;
+}
+
+bool CompressedBlockDevice::close()
+{
+ if (!opened)
+ {
+  std::cerr << "No hay dispositivo abierto.\n";
+  return false;
+ }
+ bool ok = flush();
+ opened = false;
+ return inner->close() && ok;
+}
+
+CompressedBlockDevice::Stats CompressedBlockDevice::stats() const
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ return counters;
+}
+
+std::size_t CompressedBlockDevice::physicalBlocksInUse() const
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ return (std::size_t)std::count_if(used.begin(), used.end(), [](uint16_t mask)
+                                   { return mask != 0; });
+}
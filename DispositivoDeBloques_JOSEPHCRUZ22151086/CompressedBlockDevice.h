@@ -0,0 +1,124 @@
+#ifndef COMPRESSEDBLOCKDEVICE_H
+#define COMPRESSEDBLOCKDEVICE_H
+
+#include "IBlockDevice.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Capa de compresion transparente sobre otro dispositivo.
+// Cada bloque logico se comprime con Lz4Codec y se guarda en fragmentos (1/16 de bloque)
+// dentro de un bloque fisico que comparte con otros bloques comprimidos; un mapa traduce
+// cada bloque logico a (bloque fisico, primer fragmento, largo). Los bloques en cero no
+// ocupan espacio y los que no se comprimen lo suficiente se guardan enteros.
+//
+// Disposicion en el dispositivo de abajo: bloque 0 cabecera, luego el mapa (8 bytes por
+// bloque logico) y despues los bloques fisicos de datos.
+// Los bloques comprimidos nuevos se van juntando en un bloque fisico "abierto" en memoria
+// que se escribe entero al llenarse o en flush(). Los fragmentos que quedan libres por una
+// sobrescritura no se reutilizan hasta que el mapa nuevo esta en disco, asi una caida entre
+// flushes nunca deja al mapa guardado apuntando a datos pisados.
+class CompressedBlockDevice : public IBlockDevice
+{
+public:
+ struct Stats
+ {
+  uint64_t writes = 0;            // bloques logicos escritos
+  uint64_t zeroBlocks = 0;        // escritos que eran todo ceros (no ocupan espacio)
+  uint64_t compressedBlocks = 0;  // guardados comprimidos
+  uint64_t rawBlocks = 0;         // guardados sin comprimir
+  uint64_t logicalBytes = 0;      // bytes escritos por el usuario
+  uint64_t storedBytes = 0;       // bytes que ocuparon (fragmentos completos)
+  uint64_t physicalReads = 0;     // lecturas al dispositivo de abajo
+  uint64_t physicalWrites = 0;    // escrituras al dispositivo de abajo (sin contar el mapa)
+  uint64_t decompressedBytes = 0;
+  uint64_t decompressNanos = 0;
+ };
+
+ explicit CompressedBlockDevice(std::unique_ptr<IBlockDevice> inner);
+ ~CompressedBlockDevice() override;
+
+ // Escribe la cabecera y un mapa vacio en el dispositivo de abajo.
+ // logicalBlocks = 0 ofrece tantos bloques logicos como bloques fisicos de datos haya;
+ // un valor mayor aprovecha la compresion para ofrecer mas capacidad que la fisica.
+ bool create(std::size_t logicalBlocks = 0);
+ bool open();
+ // true si el dispositivo tiene la cabecera de esta capa
+ static bool isCompressed(IBlockDevice &device);
+
+ bool readBlock(std::size_t blockNumber, char *buffer) override;
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) override;
+ bool flush() override;
+ bool close() override;
+
+ bool discardBlocks(const std::vector<std::size_t> &blockNumbers) override;
+ bool supportsDiscard() const override { return true; }
+
+ IBlockDevice *underlying() override { return inner.get(); }
+
+ Stats stats() const;
+ std::size_t physicalBlocks() const { return used.size(); }
+ std::size_t physicalBlocksInUse() const;
+
+private:
+ // Entrada del mapa tal como se guarda en disco
+ struct MapEntry
+ {
+  uint32_t physical;     // bloque del dispositivo de abajo
+  uint16_t length;       // bytes comprimidos (kind_lz)
+  uint8_t firstFragment; // primer fragmento dentro del bloque fisico
+  uint8_t kind;
+ };
+ static_assert(sizeof(MapEntry) == 8, "Cada entrada del mapa mide 8 bytes");
+
+ static constexpr uint8_t kind_zero = 0; // todo ceros, sin datos
+ static constexpr uint8_t kind_lz = 1;   // comprimido, ocupa fragmentos
+ static constexpr uint8_t kind_raw = 2;  // sin comprimir, ocupa el bloque fisico entero
+ static constexpr unsigned fragments_per_block = 16;
+ static constexpr uint16_t full_mask = 0xFFFF;
+ static constexpr std::size_t no_block = SIZE_MAX;
+ static constexpr uint64_t header_magic = 0x31504D4F43564544ULL; // "DEVCOMP1"
+
+ std::unique_ptr<IBlockDevice> inner;
+ mutable std::mutex mutex;
+ bool opened = false;
+
+ std::size_t mapStart = 1;
+ std::size_t mapBlocks = 0;
+ std::size_t dataStart = 0;
+ std::size_t fragmentSize = 0;
+
+ std::vector<MapEntry> map;
+ std::vector<uint8_t> mapDirty;   // un byte por bloque del mapa
+ std::vector<uint16_t> used;      // por bloque fisico de datos, un bit por fragmento ocupado
+ std::vector<std::pair<std::size_t, uint16_t>> pendingFree; // se liberan en el proximo flush
+ std::size_t cursor = 0;          // donde sigue la busqueda de bloques fisicos libres
+
+ std::size_t openBlock = no_block; // bloque fisico abierto (absoluto en el dispositivo de abajo)
+ std::vector<char> openBuffer;
+ bool openDirty = false;
+
+ std::size_t lastRead = no_block;  // ultimo bloque fisico leido, varios bloques logicos lo comparten
+ std::vector<char> lastReadBuffer;
+
+ std::vector<char> padded;      // bloque de entrada completado con ceros
+ std::vector<char> compressed;  // salida del compresor
+
+ Stats counters;
+
+ bool validBlocks(std::size_t logicalBlocks, std::size_t innerBlocks, std::size_t &mapBlockCount) const;
+ uint16_t &usedMask(std::size_t physical) { return used[physical - dataStart]; }
+ static uint16_t fragmentMask(unsigned first, unsigned count);
+ static bool findRun(uint16_t mask, unsigned count, unsigned &first);
+ bool placeFragments(unsigned count, std::size_t &physical, unsigned &first);
+ bool sealOpenBlock();
+ std::size_t findFreeBlock(bool allowPartial, unsigned count);
+ void releaseEntry(const MapEntry &entry);
+ bool readPhysical(std::size_t physical, const char *&data);
+ bool saveMap();
+};
+
+#endif // COMPRESSEDBLOCKDEVICE_H
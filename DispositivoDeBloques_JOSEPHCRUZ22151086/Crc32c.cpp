@@ -0,0 +1,215 @@
+#include "Crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define CRC32C_ARM 1
+#endif
+
+namespace
+{
+ constexpr uint32_t castagnoli = 0x82F63B78; // polinomio reflejado
+
+ using Impl = uint32_t (*)(uint32_t, const unsigned char *, std::size_t);
+
+ // tables[k][b]: CRC del byte b seguido de k bytes en cero
+ struct SlicingTables
+ {
+  uint32_t t[8][256];
+
+  SlicingTables()
+  {
+   for (uint32_t b = 0; b < 256; b++)
+   {
+    uint32_t crc = b;
+    for (int bit = 0; bit < 8; bit++)
+     crc = (crc >> 1) ^ ((crc & 1) ? castagnoli : 0);
+    t[0][b] = crc;
+   }
+   for (uint32_t b = 0; b < 256; b++)
+   {
+    for (int k = 1; k < 8; k++)
+     t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xFF];
+   }
+  }
+ };
+
+ uint32_t crcSlicing8(uint32_t crc, const unsigned char *p, std::size_t n)
+ {
+  static const SlicingTables tables;
+  const auto &t = tables.t;
+
+  // Ocho bytes por iteracion (asume little-endian, como las dos arquitecturas soportadas)
+  while (n >= 8)
+  {
+   uint32_t lo, hi;
+   std::memcpy(&lo, p, 4);
+   std::memcpy(&hi, p + 4, 4);
+   lo ^= crc;
+   crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+         t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+   p += 8;
+   n -= 8;
+  }
+  while (n--)
+   crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+  return crc;
+ }
+
+#if defined(CRC32C_X86)
+#if defined(__x86_64__)
+ // Registro del CRC despues de agregar lane_bytes bytes en cero, como tablas por byte:
+ // extender es lineal, alcanza con saber que pasa con cada bit del registro
+ constexpr std::size_t lane_bytes = 256;
+
+ struct ShiftTables
+ {
+  uint32_t t[4][256];
+
+  ShiftTables()
+  {
+   unsigned char zeros[lane_bytes] = {};
+   uint32_t bitShift[32];
+   for (int bit = 0; bit < 32; bit++)
+    bitShift[bit] = crcSlicing8(1u << bit, zeros, lane_bytes);
+   for (int k = 0; k < 4; k++)
+   {
+    for (uint32_t b = 0; b < 256; b++)
+    {
+     uint32_t value = 0;
+     for (int bit = 0; bit < 8; bit++)
+     {
+      if (b & (1u << bit))
+       value ^= bitShift[k * 8 + bit];
+     }
+     t[k][b] = value;
+    }
+   }
+  }
+ };
+
+ uint32_t shiftLane(const ShiftTables &tables, uint32_t crc)
+ {
+  const auto &t = tables.t;
+  return t[0][crc & 0xFF] ^ t[1][(crc >> 8) & 0xFF] ^ t[2][(crc >> 16) & 0xFF] ^ t[3][crc >> 24];
+ }
+#endif
+
+ __attribute__((target("sse4.2"))) uint32_t crcHardware(uint32_t crc, const unsigned char *p, std::size_t n)
+ {
+  while (n > 0 && (reinterpret_cast<std::uintptr_t>(p) & 7) != 0)
+  {
+   crc = _mm_crc32_u8(crc, *p++);
+   n--;
+  }
+#if defined(__x86_64__)
+  // crc32 tarda 3 ciclos pero acepta uno nuevo por ciclo: tres tramos de lane_bytes se
+  // calculan a la vez (los dos ultimos desde cero) y se juntan corriendo cada CRC parcial
+  // lane_bytes bytes con las tablas
+  static const ShiftTables shift;
+  uint64_t crc64 = crc;
+  while (n >= 3 * lane_bytes)
+  {
+   uint64_t crc1 = 0;
+   uint64_t crc2 = 0;
+   for (std::size_t k = 0; k < lane_bytes; k += 8)
+   {
+    uint64_t v0, v1, v2;
+    std::memcpy(&v0, p + k, 8);
+    std::memcpy(&v1, p + lane_bytes + k, 8);
+    std::memcpy(&v2, p + 2 * lane_bytes + k, 8);
+    crc64 = _mm_crc32_u64(crc64, v0);
+    crc1 = _mm_crc32_u64(crc1, v1);
+    crc2 = _mm_crc32_u64(crc2, v2);
+   }
+   crc64 = shiftLane(shift, (uint32_t)crc64) ^ crc1;
+   crc64 = shiftLane(shift, (uint32_t)crc64) ^ crc2;
+   p += 3 * lane_bytes;
+   n -= 3 * lane_bytes;
+  }
+  while (n >= 8)
+  {
+   uint64_t v;
+   std::memcpy(&v, p, 8);
+   crc64 = _mm_crc32_u64(crc64, v);
+   p += 8;
+   n -= 8;
+  }
+  crc = (uint32_t)crc64;
+#endif
+  while (n >= 4)
+  {
+   uint32_t v;
+   std::memcpy(&v, p, 4);
+   crc = _mm_crc32_u32(crc, v);
+   p += 4;
+   n -= 4;
+  }
+  while (n--)
+   crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+ }
+
+ bool hardwareAvailable() { return __builtin_cpu_supports("sse4.2"); }
+ constexpr const char *hardware_name = "sse4.2";
+#elif defined(CRC32C_ARM)
+ __attribute__((target("+crc"))) uint32_t crcHardware(uint32_t crc, const unsigned char *p, std::size_t n)
+ {
+  while (n > 0 && (reinterpret_cast<std::uintptr_t>(p) & 7) != 0)
+  {
+   crc = __crc32cb(crc, *p++);
+   n--;
+  }
+  while (n >= 8)
+  {
+   uint64_t v;
+   std::memcpy(&v, p, 8);
+   crc = __crc32cd(crc, v);
+   p += 8;
+   n -= 8;
+  }
+  while (n--)
+   crc = __crc32cb(crc, *p++);
+  return crc;
+ }
+
+ bool hardwareAvailable() { return (::getauxval(AT_HWCAP) & HWCAP_CRC32) != 0; }
+ constexpr const char *hardware_name = "armv8";
+#endif
+
+ struct Selected
+ {
+  Impl impl;
+  const char *name;
+ };
+
+ Selected select()
+ {
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+  if (hardwareAvailable())
+   return Selected{crcHardware, hardware_name};
+#endif
+  return Selected{crcSlicing8, "slicing-by-8"};
+ }
+
+ const Selected &selected()
+ {
+  static const Selected chosen = select();
+  return chosen;
+ }
+}
+
+uint32_t crc32c(const void *data, std::size_t length, uint32_t crc)
+{
+ return ~selected().impl(~crc, static_cast<const unsigned char *>(data), length);
+}
+
+const char *crc32cImplementation()
+{
+ return selected().name;
+}
@@ -0,0 +1,16 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (polinomio de Castagnoli, el mismo de iSCSI/ext4/btrfs).
+// Usa la instruccion crc32 del procesador (SSE4.2 en x86-64, extension CRC de ARMv8)
+// cuando esta disponible y si no una tabla slicing-by-8; se elige una vez en tiempo de ejecucion.
+// Se puede encadenar: crc32c(b, nb, crc32c(a, na)) == crc32c(a+b, na+nb).
+uint32_t crc32c(const void *data, std::size_t length, uint32_t crc = 0);
+
+// Nombre de la implementacion elegida ("sse4.2", "armv8" o "slicing-by-8")
+const char *crc32cImplementation();
+
+#endif // CRC32C_H
@@ -0,0 +1,303 @@
+#include "DirectoryTree.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+static DirEntry makeEntry(const std::string &name, uint64_t ref)
+{
+ DirEntry entry;
+ std::memset(&entry, 0, sizeof(entry));
+ std::memcpy(entry.name, name.data(), std::min(name.size(), DirectoryTree::max_name));
+ entry.ref = ref;
+ return entry;
+}
+
+static int compareName(const DirEntry &entry, const std::string &name)
+{
+ return std::strncmp(entry.name, name.c_str(), sizeof(entry.name));
+}
+
+DirectoryTree::DirectoryTree(std::size_t blockSize, Storage storage)
+    : blockSize(blockSize), storage(std::move(storage))
+{
+ maxEntries = blockSize > sizeof(DirNodeHeader) ? (blockSize - sizeof(DirNodeHeader)) / sizeof(DirEntry) : 0;
+}
+
+bool DirectoryTree::load(uint64_t block, Node &node)
+{
+ buffer.resize(blockSize);
+ if (!storage.read(block, buffer.data()))
+ {
+  std::cerr << "Error leyendo el directorio.\n";
+  return false;
+ }
+ DirNodeHeader header;
+ std::memcpy(&header, buffer.data(), sizeof(header));
+ if (header.magic != DIR_NODE_MAGIC || header.count > maxEntries || header.level >= max_depth)
+ {
+  std::cerr << "El bloque " << block << " no es un bloque de directorio válido.\n";
+  return false;
+ }
+ node.block = block;
+ node.level = header.level;
+ node.entries.resize(header.count);
+ std::memcpy(node.entries.data(), buffer.data() + sizeof(header), header.count * sizeof(DirEntry));
+ for (auto &entry : node.entries)
+  entry.name[max_name] = 0;
+ return true;
+}
+
+bool DirectoryTree::store(const Node &node)
+{
+ buffer.assign(blockSize, 0);
+ DirNodeHeader header{};
+ header.magic = DIR_NODE_MAGIC;
+ header.level = node.level;
+ header.count = (uint16_t)node.entries.size();
+ std::memcpy(buffer.data(), &header, sizeof(header));
+ std::memcpy(buffer.data() + sizeof(header), node.entries.data(), node.entries.size() * sizeof(DirEntry));
+ if (!storage.write(node.block, buffer.data()))
+ {
+  std::cerr << "Error escribiendo el directorio.\n";
+  return false;
+ }
+ return true;
+}
+
+// Ultimo hijo cuyo nombre es <= name; el primero cubre todo lo menor
+std::size_t DirectoryTree::childIndex(const Node &node, const std::string &name)
+{
+ auto first = node.entries.begin() + 1;
+ auto it = std::upper_bound(first, node.entries.end(), name,
+                            [](const std::string &n, const DirEntry &e)
+                            { return compareName(e, n) > 0; });
+ return (std::size_t)(it - node.entries.begin()) - 1;
+}
+
+std::vector<DirEntry>::iterator DirectoryTree::lowerBound(Node &node, const std::string &name)
+{
+ return std::lower_bound(node.entries.begin(), node.entries.end(), name,
+                         [](const DirEntry &e, const std::string &n)
+                         { return compareName(e, n) < 0; });
+}
+
+bool DirectoryTree::descend(uint64_t root, const std::string &name, std::vector<Node> &path,
+                            std::vector<std::size_t> &slots)
+{
+ path.clear();
+ slots.clear();
+ uint64_t block = root;
+ while (true)
+ {
+  path.emplace_back();
+  Node &node = path.back();
+  if (!load(block, node))
+   return false;
+  // Cada hijo esta exactamente un nivel mas abajo, asi un ciclo no puede colgar la busqueda
+  if (path.size() > 1 && node.level + 1 != path[path.size() - 2].level)
+  {
+   std::cerr << "El bloque " << block << " no es un bloque de directorio válido.\n";
+   return false;
+  }
+  if (node.level == 0)
+   return true;
+  if (node.entries.empty())
+  {
+   std::cerr << "El bloque " << block << " no es un bloque de directorio válido.\n";
+   return false;
+  }
+  std::size_t slot = childIndex(node, name);
+  slots.push_back(slot);
+  block = node.entries[slot].ref;
+ }
+}
+
+std::optional<uint64_t> DirectoryTree::find(uint64_t root, const std::string &name)
+{
+ if (root == 0 || name.size() > max_name)
+  return std::nullopt;
+ std::vector<Node> path;
+ std::vector<std::size_t> slots;
+ if (!descend(root, name, path, slots))
+  return std::nullopt;
+ Node &leaf = path.back();
+ auto it = lowerBound(leaf, name);
+ if (it == leaf.entries.end() || compareName(*it, name) != 0)
+  return std::nullopt;
+ return it->ref;
+}
+
+bool DirectoryTree::insert(uint64_t &root, const std::string &name, uint64_t inode)
+{
+ if (name.empty() || name.size() > max_name)
+ {
+  std::cerr << "Nombre inválido para una entrada de directorio.\n";
+  return false;
+ }
+ if (root == 0)
+ {
+  auto block = storage.allocate();
+  if (!block)
+  {
+   std::cerr << "No hay bloques libres para el directorio.\n";
+   return false;
+  }
+  Node leaf;
+  leaf.block = *block;
+  leaf.entries.push_back(makeEntry(name, inode));
+  if (!store(leaf))
+  {
+   storage.release(*block);
+   return false;
+  }
+  root = *block;
+  return true;
+ }
+
+ std::vector<Node> path;
+ std::vector<std::size_t> slots;
+ if (!descend(root, name, path, slots))
+  return false;
+ Node &leaf = path.back();
+ auto pos = lowerBound(leaf, name);
+ if (pos != leaf.entries.end() && compareName(*pos, name) == 0)
+ {
+  std::cerr << "Ya existe una entrada con ese nombre.\n";
+  return false;
+ }
+ leaf.entries.insert(pos, makeEntry(name, inode));
+
+ // Los bloques de todas las particiones se reservan antes de escribir nada, asi quedarse
+ // sin espacio a mitad de camino no deja entradas fuera del arbol
+ std::size_t splits = 0;
+ while (splits < path.size() && path[path.size() - 1 - splits].entries.size() + (splits > 0 ? 1 : 0) > maxEntries)
+  splits++;
+ std::vector<uint64_t> fresh;
+ for (std::size_t k = 0; k < splits + (splits == path.size() ? 1 : 0); k++)
+ {
+  auto block = storage.allocate();
+  if (!block)
+  {
+   for (uint64_t b : fresh)
+    storage.release(b);
+   std::cerr << "No hay bloques libres para el directorio.\n";
+   return false;
+  }
+  fresh.push_back(*block);
+ }
+
+ // De la hoja hacia arriba: un nodo que se pasa de capacidad se parte en dos y la mitad
+ // derecha se agrega al padre
+ for (std::size_t k = path.size(); k-- > 0;)
+ {
+  Node &node = path[k];
+  if (node.entries.size() <= maxEntries)
+   return store(node);
+
+  Node right;
+  right.block = fresh.back();
+  fresh.pop_back();
+  right.level = node.level;
+  std::size_t half = node.entries.size() / 2;
+  right.entries.assign(node.entries.begin() + half, node.entries.end());
+  node.entries.resize(half);
+  if (!store(right) || !store(node))
+   return false;
+  DirEntry separator = right.entries[0];
+  separator.ref = right.block;
+
+  if (k == 0)
+  {
+   // Se partio la raiz: el arbol crece un nivel
+   Node top;
+   top.block = fresh.back();
+   fresh.pop_back();
+   top.level = node.level + 1;
+   DirEntry left = node.entries[0];
+   left.ref = node.block;
+   top.entries.push_back(left);
+   top.entries.push_back(separator);
+   if (!store(top))
+    return false;
+   root = top.block;
+   return true;
+  }
+  Node &parent = path[k - 1];
+  parent.entries.insert(parent.entries.begin() + slots[k - 1] + 1, separator);
+ }
+ return true;
+}
+
+bool DirectoryTree::remove(uint64_t &root, const std::string &name)
+{
+ std::vector<Node> path;
+ std::vector<std::size_t> slots;
+ if (root == 0 || !descend(root, name, path, slots))
+  return false;
+ Node &leaf = path.back();
+ auto it = lowerBound(leaf, name);
+ if (it == leaf.entries.end() || compareName(*it, name) != 0)
+  return false;
+ leaf.entries.erase(it);
+
+ // Los nodos que quedan vacios se liberan y salen de su padre
+ std::size_t k = path.size() - 1;
+ while (k > 0 && path[k].entries.empty())
+ {
+  storage.release(path[k].block);
+  path[k - 1].entries.erase(path[k - 1].entries.begin() + slots[k - 1]);
+  k--;
+ }
+ if (k > 0)
+  return store(path[k]);
+
+ Node &top = path[0];
+ if (top.entries.empty())
+ {
+  storage.release(top.block);
+  root = 0;
+  return true;
+ }
+ // Una raiz interna con un solo hijo sobra: el hijo pasa a ser la raiz
+ bool changed = true;
+ while (top.level > 0 && top.entries.size() == 1)
+ {
+  uint64_t child = top.entries[0].ref;
+  storage.release(top.block);
+  root = child;
+  if (!load(child, top))
+   return false;
+  changed = false;
+ }
+ return !changed || store(top);
+}
+
+bool DirectoryTree::forEach(uint64_t root, const Visitor &visit)
+{
+ if (root == 0)
+  return true;
+ bool stopped = false;
+ return walk(root, -1, visit, stopped);
+}
+
+bool DirectoryTree::walk(uint64_t block, int level, const Visitor &visit, bool &stopped)
+{
+ Node node;
+ if (!load(block, node))
+  return false;
+ if (level >= 0 && node.level != level)
+ {
+  std::cerr << "El bloque " << block << " no es un bloque de directorio válido.\n";
+  return false;
+ }
+ for (const auto &entry : node.entries)
+ {
+  if (node.level == 0)
+   stopped = !visit(entry.name, entry.ref);
+  else if (!walk(entry.ref, node.level - 1, visit, stopped))
+   return false;
+  if (stopped)
+   return true;
+ }
+ return true;
+}
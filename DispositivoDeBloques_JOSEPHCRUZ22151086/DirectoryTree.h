@@ -0,0 +1,90 @@
+#ifndef DIRECTORYTREE_H
+#define DIRECTORYTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Cabecera de cada bloque del arbol
+struct DirNodeHeader
+{
+ uint32_t magic;
+ uint16_t level; // 0 = hoja
+ uint16_t count; // entradas usadas
+ uint64_t reserved;
+};
+static_assert(sizeof(DirNodeHeader) == 16, "La cabecera de un nodo de directorio mide 16 bytes");
+
+// En una hoja ref es el inodo; en un nodo interno, el bloque hijo
+struct DirEntry
+{
+ char name[64]; // terminado en cero, 63 caracteres como maximo
+ uint64_t ref;
+};
+static_assert(sizeof(DirEntry) == 72, "La entrada de directorio mide 72 bytes");
+
+constexpr uint32_t DIR_NODE_MAGIC = 0x4E524944; // "DIRN"
+
+// Entradas de un directorio en disco: un arbol B+ de bloques ordenado por nombre. Las hojas
+// guardan nombre -> inodo y los nodos internos nombre -> hijo, donde el nombre es el menor
+// que puede aparecer en ese hijo (el del primer hijo no se compara). Buscar, agregar o borrar
+// un nombre lee un bloque por nivel: con bloques de 1024 bytes entran 14 entradas por nodo y
+// 5 niveles alcanzan para mas de 100000 entradas.
+// Al borrar no se redistribuyen entradas entre hermanos: un nodo que queda vacio se libera y
+// una raiz interna con un solo hijo se reemplaza por ese hijo.
+// La raiz 0 es un directorio vacio, sin bloques.
+class DirectoryTree
+{
+public:
+ // Como el FS lee, escribe, reserva y libera sus bloques
+ struct Storage
+ {
+  std::function<bool(uint64_t, char *)> read;
+  std::function<bool(uint64_t, const char *)> write;
+  std::function<std::optional<uint64_t>()> allocate;
+  std::function<void(uint64_t)> release;
+ };
+ using Visitor = std::function<bool(const std::string &name, uint64_t inode)>;
+
+ DirectoryTree(std::size_t blockSize, Storage storage);
+
+ static constexpr std::size_t max_name = sizeof(DirEntry::name) - 1;
+ std::size_t capacity() const { return maxEntries; }
+
+ // nullopt si no esta o no se pudo leer el arbol (con mensaje)
+ std::optional<uint64_t> find(uint64_t root, const std::string &name);
+ // root cambia cuando la raiz se parte o se achica
+ bool insert(uint64_t &root, const std::string &name, uint64_t inode);
+ bool remove(uint64_t &root, const std::string &name);
+ // Entradas en orden de nombre; si visit devuelve false se corta el recorrido
+ bool forEach(uint64_t root, const Visitor &visit);
+
+private:
+ struct Node
+ {
+  uint64_t block = 0;
+  uint16_t level = 0;
+  std::vector<DirEntry> entries;
+ };
+
+ static constexpr std::size_t max_depth = 32; // un arbol mas alto esta dañado
+
+ std::size_t blockSize;
+ std::size_t maxEntries;
+ Storage storage;
+ std::vector<char> buffer;
+
+ bool load(uint64_t block, Node &node);
+ bool store(const Node &node);
+ // Baja desde root hasta la hoja donde va name, guardando el camino y el hijo elegido en cada nivel
+ bool descend(uint64_t root, const std::string &name, std::vector<Node> &path, std::vector<std::size_t> &slots);
+ // level: el que tiene que tener el bloque (-1 en la raiz, que puede tener cualquiera)
+ bool walk(uint64_t block, int level, const Visitor &visit, bool &stopped);
+ static std::size_t childIndex(const Node &node, const std::string &name);
+ static std::vector<DirEntry>::iterator lowerBound(Node &node, const std::string &name);
+};
+
+#endif // DIRECTORYTREE_H
@@ -1,54 +1,181 @@
 #include "FileSystem.h"
+#include "Crc32c.h"
+#include "IoStats.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include <algorithm>
 #include <cstdio>
+#include <set>
 
-FileSystem::FileSystem(BlockDevice &device) : device(device)
+// Agrega un rango a una lista; si sigue al ultimo, lo extiende
+static void appendExtent(std::vector<Extent> &extents, Extent extent)
 {
- inodesPerBlock = device.blockSize / 136; // Debe ser 7 con 1024 y 136
- // Suponiendo blockSize=1024, inodesPerBlock=7
- // Para 256 inodos -> 256/7=36.57 => 37 bloques
- blocksForInodes = 37;
- inodes.resize(256);
- freeBlockMap.resize(256, 0);
+ if (!extents.empty() && extents.back().start + extents.back().count == extent.start)
+  extents.back().count += extent.count;
+ else
+  extents.push_back(extent);
 }
 
-bool FileSystem::format()
+// Nombre guardado en el inodo (sin los ceros del final)
+static std::string inodeName(const Inode &inode)
+{
+ return std::string(inode.fileName, strnlen(inode.fileName, sizeof(inode.fileName)));
+}
+
+// Componentes de una ruta; las barras repetidas, la inicial y la final no cuentan
+static std::vector<std::string> splitPath(const std::string &path)
+{
+ std::vector<std::string> parts;
+ std::size_t start = 0;
+ while (start <= path.size())
+ {
+  std::size_t end = path.find('/', start);
+  if (end == std::string::npos)
+   end = path.size();
+  if (end > start)
+   parts.push_back(path.substr(start, end - start));
+  start = end + 1;
+ }
+ return parts;
+}
+
+FileSystem::FileSystem(IBlockDevice &device, std::size_t cacheBlocks)
+    : device(device),
+      dirTree(device.blockSize, {[this](uint64_t blk, char *buffer)
+                                 { return readBlock(blk, buffer); },
+                                 [this](uint64_t blk, const char *data)
+                                 { return writeBlock(blk, data, this->device.blockSize); },
+                                 [this]()
+                                 { return allocateBlock(); },
+                                 [this](uint64_t blk)
+                                 { releaseBlocks(std::vector<std::size_t>{blk}); }})
+{
+ // El tamaño del mapa y de la tabla de inodos depende del formato, se fija en format/load
+ setCacheCapacity(cacheBlocks);
+}
+
+FileSystem::~FileSystem()
+{
+ // La cache escribe sus bloques sucios al destruirse, antes de que se cierre el dispositivo
+ readahead.reset();
+ cache.reset();
+}
+
+// 0 desactiva la cache (cada escritura va directo al dispositivo)
+void FileSystem::setCacheCapacity(std::size_t blocks)
+{
+ if (cache)
+  cache->flush();
+ cache.reset();
+ if (blocks > 0 && device.blockSize > 0)
+  cache = std::make_unique<BlockCache>(device, blocks);
+}
+
+void FileSystem::setReadAhead(std::size_t maxWindow)
+{
+ readahead.reset();
+ if (maxWindow == 0 || device.blockSize == 0)
+  return;
+
+ readahead = std::make_unique<ReadAhead>(device, maxWindow);
+ // Lo que ya esta en la cache (quizas sucio) no se precarga desde el dispositivo
+ readahead->setPrefetchFilter([this](std::size_t blockNumber)
+                              { return !cache || !cache->contains(blockNumber); });
+}
+
+bool FileSystem::sync()
+{
+ if (cache && !cache->flush())
+  return false;
+ return device.flush();
+}
+
+void FileSystem::invalidateCachedBlock(uint64_t blockNumber)
+{
+ if (cache)
+  cache->invalidate(blockNumber);
+}
+
+bool FileSystem::format(uint32_t version)
 {
  if (device.blockCount == 0 || device.blockSize == 0)
  {
   std::cerr << "El dispositivo no está inicializado.\n";
   return false;
  }
+ if (version != 1 && version != 2)
+ {
+  std::cerr << "Versión de formato desconocida (1 o 2).\n";
+  return false;
+ }
+ std::size_t entrySize = version == 1 ? sizeof(InodeV1) : sizeof(Inode);
+ std::size_t headerSize = version == 1 ? sizeof(SuperBlockV1) : sizeof(SuperBlockV2);
+ std::size_t perBlock = device.blockSize / entrySize;
+ if (device.blockSize < headerSize || perBlock == 0)
+ {
+  std::cerr << "El tamaño de bloque es demasiado chico para el formato " << version << ".\n";
+  return false;
+ }
 
- // Definir layout:
- // Bloque 0: SuperBlock
- // Bloque 1: FreeBlockMap (256 bytes)
- // Bloques 2..(2+37-1)=2..38: Inodos
- // Bloque 39 en adelante: Datos
+ SuperBlock sb;
+ sb.version = version;
+ sb.blockSize = (uint32_t)device.blockSize;
+ sb.blockCount = device.blockCount;
+ std::size_t bitsPerBlock = device.blockSize * 8;
+ uint64_t bitmapBlocks = (device.blockCount + bitsPerBlock - 1) / bitsPerBlock;
+ if (version == 1)
+ {
+  // Definir layout:
+  // Bloque 0: SuperBlock
+  // Bloque 1: FreeBlockMap (un bit por bloque, cubre blockSize*8 bloques)
+  // Bloques 2..(2+37-1)=2..38: Inodos
+  // Si el dispositivo tiene mas bloques de los que cubre el bloque 1, el resto del mapa
+  // va a partir del 39
+  // Despues: Datos
+  uint64_t inodeBlocks = (V1_INODES + perBlock - 1) / perBlock; // 256/7=36.57 => 37 con bloques de 1024
+  sb.inodeCount = V1_INODES;
+  sb.bitmapExtents.push_back({FREEBLOCKMAP_BLOCK, 1});
+  sb.inodeExtents.push_back({2, inodeBlocks});
+  if (bitmapBlocks > 1)
+   sb.bitmapExtents.push_back({2 + inodeBlocks, bitmapBlocks - 1});
+  sb.dataStart = 2 + inodeBlocks + bitmapBlocks - 1; // 2+37=39
+ }
+ else
+ {
+  // Bloque 0: SuperBlock, desde el 1 todo el mapa, despues la tabla de inodos (un inodo
+  // cada 8 bloques, como el formato 1) y los datos
+  uint64_t wanted = std::min<uint64_t>(std::max<uint64_t>(device.blockCount / 8, perBlock), max_default_inodes);
+  uint64_t inodeBlocks = (wanted + perBlock - 1) / perBlock;
+  sb.inodeCount = inodeBlocks * perBlock;
+  sb.bitmapExtents.push_back({1, bitmapBlocks});
+  sb.inodeExtents.push_back({1 + bitmapBlocks, inodeBlocks});
+  sb.dataStart = 1 + bitmapBlocks + inodeBlocks;
+ }
+ if (!fitsFormat(sb))
+ {
+  std::cerr << "El dispositivo es demasiado grande para el formato " << version << ".\n";
+  return false;
+ }
+ if (sb.dataStart >= sb.blockCount)
+ {
+  std::cerr << "El dispositivo es demasiado chico para el FS.\n";
+  return false;
+ }
 
- superBlock.blockSize = (uint32_t)device.blockSize;
- superBlock.blockCount = (uint32_t)device.blockCount;
- superBlock.inodeStart = 2;
- superBlock.inodeBlocks = blocksForInodes;
- superBlock.inodeCount = (uint32_t)inodes.size();                       // 256
- superBlock.dataStart = superBlock.inodeStart + superBlock.inodeBlocks; // 2+37=39
+ mounted = false;
+ setGeometry(sb);
 
  // Inicializar mapa de bloques libres
  std::fill(freeBlockMap.begin(), freeBlockMap.end(), 0);
 
- // Marcar bloques usados: superblock(0), freeBlockMap(1), inodos(2..38)
- // total 1 (sb) +1(map) +37(inodos) = 39 bloques usados
- for (uint32_t i = 0; i < superBlock.dataStart; i++)
- {
-  uint32_t byteIndex = i / 8;
-  uint8_t bitIndex = i % 8;
-  freeBlockMap[byteIndex] |= (1 << bitIndex);
- }
+ // Marcar bloques usados: superblock, mapa e inodos
+ for (uint64_t i = 0; i < superBlock.dataStart; i++)
+  markUsed(i);
+ allocHint = superBlock.dataStart;
 
  // Inicializar inodos y se asegura que esten parcados como libres para futuros archivos
+ inodes.assign(superBlock.inodeCount, Inode());
  for (auto &inode : inodes)
  {
   inode.free = 1; // libre
@@ -56,19 +183,28 @@ bool FileSystem::format()
   std::memset(inode.fileName, 0, 64);
   std::fill(std::begin(inode.dataBlocks), std::end(inode.dataBlocks), 0);
   inode.crc = 0;
-  std::memset(inode.reserved, 0, 28);
+  std::memset(inode.reserved, 0, sizeof(inode.reserved));
  }
-
- // Guardar superblock
+ if (version == 2)
  {
-  std::vector<char> sbData(device.blockSize, 0);
-  std::memcpy(sbData.data(), &superBlock, sizeof(SuperBlock));
-  if (!device.writeBlock(0, sbData))
-  {
-   std::cerr << "Error escribiendo el SuperBlock.\n";
-   return false;
-  }
+  // El inodo 0 es el directorio raiz
+  Inode &root = inodes[0];
+  root.free = 0;
+  root.type = INODE_DIRECTORY;
+  root.parent = 0;
+  std::strcpy(root.fileName, "/");
+  superBlock.features = SUPERBLOCK_FEATURE_DIRECTORIES;
+  superBlock.rootInode = 0;
  }
+ std::fill(inodeBlockDirty.begin(), inodeBlockDirty.end(), 1);
+ rebuildNameIndex();
+ sharedRefs.clear();
+ dedupIndex.clear();
+ blockHashes.clear();
+
+ // Guardar superblock
+ if (!saveSuperBlock())
+  return false;
 
  // Guardar mapa de bloques libres
  if (!saveFreeBlockMap())
@@ -78,6 +214,7 @@ bool FileSystem::format()
  if (!saveInodes())
   return false;
 
+ mounted = true;
  return true;
 }
 
@@ -90,17 +227,21 @@ bool FileSystem::load()
  }
 
  // Leer superblock
+ mounted = false;
  {
-  auto sbData = device.readBlock(0);
-  if (sbData.size() < sizeof(SuperBlock))
+  ioBuffer.resize(device.blockSize);
+  if (!readBlock(0, ioBuffer.data()))
   {
    std::cerr << "Error leyendo SuperBlock.\n";
    return false;
   }
-  std::memcpy(&superBlock, sbData.data(), sizeof(SuperBlock));
+  if (!decodeSuperBlock(ioBuffer.data()))
+   return false;
  }
 
  inodes.resize(superBlock.inodeCount, Inode());
+ std::fill(inodeBlockDirty.begin(), inodeBlockDirty.end(), 0);
+ allocHint = superBlock.dataStart;
 
  if (!loadFreeBlockMap())
  {
@@ -113,210 +254,431 @@ bool FileSystem::load()
   std::cerr << "Error leyendo inodos.\n";
   return false;
  }
+ if (hasDirectories() && (superBlock.rootInode >= inodes.size() || inodes[superBlock.rootInode].free != 0 ||
+                          inodes[superBlock.rootInode].type != INODE_DIRECTORY))
+ {
+  std::cerr << "El directorio raíz no es válido.\n";
+  return false;
+ }
+ rebuildNameIndex();
+
+ rebuildBlockRefs();
+ if (dedup && !rebuildDedupIndex())
+ {
+  std::cerr << "Error leyendo bloques para la deduplicación.\n";
+  return false;
+ }
 
+ mounted = true;
  return true;
 }
 
-bool FileSystem::save()
+// Traduce el bloque 0 a superBlock. false sin mensaje si no hay FS (disco en ceros) o es de
+// otro tamaño de bloque
+bool FileSystem::decodeSuperBlock(const char *raw)
 {
- // Guardar superblock
+ SuperBlock sb;
+ uint64_t magic;
+ std::memcpy(&magic, raw, sizeof(magic));
+ if (magic == SUPERBLOCK_V2_MAGIC && device.blockSize >= sizeof(SuperBlockV2))
  {
-  std::vector<char> sbData(device.blockSize, 0);
-  std::memcpy(sbData.data(), &superBlock, sizeof(SuperBlock));
-  if (!device.writeBlock(0, sbData))
+  SuperBlockV2 v2;
+  std::memcpy(&v2, raw, sizeof(v2));
+  if (v2.version != 2 || v2.inodeSize != sizeof(Inode) || v2.bitmapExtentCount > MAX_BITMAP_EXTENTS ||
+      v2.inodeExtentCount > MAX_INODE_EXTENTS)
   {
-   std::cerr << "Error escribiendo el SuperBlock.\n";
+   std::cerr << "El SuperBlock no es válido.\n";
    return false;
   }
+  if (v2.features & ~SUPERBLOCK_FEATURE_DIRECTORIES)
+  {
+   std::cerr << "El FS usa funciones que esta versión del programa no conoce.\n";
+   return false;
+  }
+  sb.version = 2;
+  sb.blockSize = v2.blockSize;
+  sb.blockCount = v2.blockCount;
+  sb.inodeCount = v2.inodeCount;
+  sb.dataStart = v2.dataStart;
+  sb.features = v2.features;
+  sb.rootInode = v2.rootInode;
+  sb.bitmapExtents.assign(v2.bitmapExtents, v2.bitmapExtents + v2.bitmapExtentCount);
+  sb.inodeExtents.assign(v2.inodeExtents, v2.inodeExtents + v2.inodeExtentCount);
  }
-
- if (!saveFreeBlockMap())
-  return false;
- if (!saveInodes())
+ else
+ {
+  if (device.blockSize < sizeof(SuperBlockV1))
+   return false;
+  SuperBlockV1 v1;
+  std::memcpy(&v1, raw, sizeof(v1));
+  // Un disco recien creado tiene el superblock en ceros, no hay FS que cargar
+  if (v1.inodeCount == 0)
+   return false;
+  if (v1.bitmapCount > MAX_BITMAP_BLOCKS || v1.inodeGroupCount > MAX_INODE_GROUPS)
+  {
+   std::cerr << "El SuperBlock no es válido.\n";
+   return false;
+  }
+  sb.version = 1;
+  sb.blockSize = v1.blockSize;
+  sb.blockCount = v1.blockCount;
+  sb.inodeCount = v1.inodeCount;
+  sb.dataStart = v1.dataStart;
+  // FS formateado antes del crecimiento en linea: un solo bloque de mapa
+  if (v1.bitmapCount == 0)
+   sb.bitmapExtents.push_back({FREEBLOCKMAP_BLOCK, 1});
+  for (uint32_t k = 0; k < v1.bitmapCount; k++)
+   appendExtent(sb.bitmapExtents, {v1.bitmapLocations[k], 1});
+  sb.inodeExtents.push_back({v1.inodeStart, v1.inodeBlocks});
+  for (uint32_t g = 0; g < v1.inodeGroupCount; g++)
+   sb.inodeExtents.push_back({v1.inodeGroupStart[g], v1.inodeGroupBlocks[g]});
+ }
+ if (sb.blockSize != device.blockSize)
   return false;
 
+ setGeometry(sb);
+ if (inodesPerBlock == 0 || bitmapTable.size() * device.blockSize * 8 < sb.blockCount ||
+     inodeTable.size() * inodesPerBlock < sb.inodeCount || sb.blockCount > device.blockCount)
+ {
+  std::cerr << "El SuperBlock no es válido.\n";
+  return false;
+ }
  return true;
 }
 
-bool FileSystem::ls()
+// Escribe superBlock en la version de su formato
+bool FileSystem::saveSuperBlock()
 {
- std::cout << "Archivos en el sistema:\n";
- for (auto &inode : inodes)
+ // El resto del bloque lo rellena el dispositivo con ceros
+ bool ok;
+ if (superBlock.version == 1)
  {
-  if (inode.free == 0)
+  SuperBlockV1 v1;
+  std::memset(&v1, 0, sizeof(v1));
+  v1.blockSize = superBlock.blockSize;
+  v1.blockCount = (uint32_t)superBlock.blockCount;
+  v1.inodeStart = (uint32_t)superBlock.inodeExtents[0].start;
+  v1.inodeBlocks = (uint32_t)superBlock.inodeExtents[0].count;
+  v1.inodeCount = (uint32_t)superBlock.inodeCount;
+  v1.dataStart = (uint32_t)superBlock.dataStart;
+  v1.bitmapCount = (uint32_t)bitmapTable.size();
+  for (std::size_t k = 0; k < bitmapTable.size(); k++)
+   v1.bitmapLocations[k] = (uint32_t)bitmapTable[k];
+  v1.inodeGroupCount = (uint32_t)superBlock.inodeExtents.size() - 1;
+  for (uint32_t g = 0; g < v1.inodeGroupCount; g++)
   {
-   std::cout << inode.fileName << " (" << inode.fileSize << " bytes)\n";
+   v1.inodeGroupStart[g] = (uint32_t)superBlock.inodeExtents[g + 1].start;
+   v1.inodeGroupBlocks[g] = (uint32_t)superBlock.inodeExtents[g + 1].count;
   }
+  ok = writeBlock(0, reinterpret_cast<const char *>(&v1), sizeof(v1));
  }
- return true;
+ else
+ {
+  SuperBlockV2 v2;
+  std::memset(&v2, 0, sizeof(v2));
+  v2.magic = SUPERBLOCK_V2_MAGIC;
+  v2.version = 2;
+  v2.blockSize = superBlock.blockSize;
+  v2.blockCount = superBlock.blockCount;
+  v2.inodeCount = superBlock.inodeCount;
+  v2.dataStart = superBlock.dataStart;
+  v2.inodeSize = sizeof(Inode);
+  v2.bitmapExtentCount = (uint16_t)superBlock.bitmapExtents.size();
+  v2.inodeExtentCount = (uint16_t)superBlock.inodeExtents.size();
+  std::copy(superBlock.bitmapExtents.begin(), superBlock.bitmapExtents.end(), v2.bitmapExtents);
+  std::copy(superBlock.inodeExtents.begin(), superBlock.inodeExtents.end(), v2.inodeExtents);
+  v2.features = superBlock.features;
+  v2.rootInode = superBlock.rootInode;
+  ok = writeBlock(0, reinterpret_cast<const char *>(&v2), sizeof(v2));
+ }
+ if (!ok)
+  std::cerr << "Error escribiendo el SuperBlock.\n";
+ return ok;
 }
 
-bool FileSystem::cat(const std::string &filename)
+// Limites de cada version: el formato 1 guarda numeros de bloque de 32 bits y el mapa
+// bloque por bloque; el 2, una cantidad fija de rangos
+bool FileSystem::fitsFormat(const SuperBlock &sb) const
 {
- auto idx = findInodeByName(filename);
- if (!idx)
+ if (sb.version == 1)
  {
-  std::cerr << "Archivo no encontrado.\n";
-  return false;
+  uint64_t bitmapBlocks = 0;
+  for (const auto &e : sb.bitmapExtents)
+   bitmapBlocks += e.count;
+  return sb.blockCount <= UINT32_MAX && sb.inodeCount <= UINT32_MAX && bitmapBlocks <= MAX_BITMAP_BLOCKS &&
+         sb.inodeExtents.size() <= 1 + MAX_INODE_GROUPS;
  }
- Inode &inode = inodes[*idx];
+ return sb.bitmapExtents.size() <= MAX_BITMAP_EXTENTS && sb.inodeExtents.size() <= MAX_INODE_EXTENTS;
+}
 
- // Leer datos
- std::size_t remaining = inode.fileSize;
- for (auto blockNum : inode.dataBlocks)
+// Adopta la geometria: listas de bloques del mapa y de inodos y el tamaño de los inodos en
+// disco. El mapa en memoria conserva lo que tenia (crece con ceros)
+void FileSystem::setGeometry(const SuperBlock &sb)
+{
+ superBlock = sb;
+ inodeSize = sb.version == 1 ? sizeof(InodeV1) : sizeof(Inode);
+ inodesPerBlock = device.blockSize / inodeSize;
+ bitmapTable.clear();
+ for (const auto &e : sb.bitmapExtents)
  {
-  if (blockNum == 0)
-   break;
-  if (remaining == 0)
-   break;
-
-  auto data = device.readBlock(blockNum);
-  std::size_t toPrint = std::min((std::size_t)device.blockSize, remaining);
-  std::cout.write(data.data(), toPrint);
-  remaining -= toPrint;
+  for (uint64_t blk = 0; blk < e.count; blk++)
+   bitmapTable.push_back(e.start + blk);
  }
- std::cout << "\n";
+ inodeTable.clear();
+ for (const auto &e : sb.inodeExtents)
+ {
+  for (uint64_t blk = 0; blk < e.count; blk++)
+   inodeTable.push_back(e.start + blk);
+ }
+ freeBlockMap.resize(bitmapTable.size() * device.blockSize, 0);
+ inodeBlockDirty.resize(inodeTable.size(), 0);
+}
+
+bool FileSystem::save()
+{
+ // Guardar superblock
+ if (!saveSuperBlock())
+  return false;
+
+ // El mapa se guarda en cada asignacion y liberacion; de los inodos, los bloques modificados
+ if (!saveInodes())
+  return false;
+
  return true;
 }
 
-bool FileSystem::writeFile(const std::string &filename, const std::string &data)
+bool FileSystem::grow(std::size_t newBlockCount)
 {
- auto idx = findInodeByName(filename);
- if (!idx)
+ if (!device.supportsGrow())
  {
-  // Crear nuevo archivo
-  idx = findFreeInode();
-  if (!idx)
+  std::cerr << "El dispositivo no puede crecer.\n";
+  return false;
+ }
+
+ // Los inodos nuevos guardan la proporcion de bloques por inodo que ya tenia el FS
+ SuperBlock sb = superBlock;
+ uint64_t oldCount = superBlock.blockCount;
+ uint64_t newBitmaps = 0;
+ uint64_t newInodeBlocks = 0;
+ std::size_t bitsPerBlock = device.blockSize * 8;
+ if (mounted)
+ {
+  if (newBlockCount <= oldCount)
   {
-   std::cerr << "No hay espacio para nuevos archivos.\n";
+   std::cerr << "La nueva cantidad de bloques debe ser mayor a la actual.\n";
    return false;
   }
-  Inode &inode = inodes[*idx];
-  inode.free = 0; // ocupado
-  std::strncpy(inode.fileName, filename.c_str(), 63);
-  inode.fileSize = 0;
-  std::fill(std::begin(inode.dataBlocks), std::end(inode.dataBlocks), 0);
+  uint64_t added = newBlockCount - oldCount;
+  newBitmaps = (newBlockCount + bitsPerBlock - 1) / bitsPerBlock - bitmapTable.size();
+  uint64_t blocksPerInode = std::max<uint64_t>(1, oldCount / superBlock.inodeCount);
+  newInodeBlocks = (added / blocksPerInode + inodesPerBlock - 1) / inodesPerBlock;
+  if (newBitmaps >= added)
+  {
+   std::cerr << "El espacio agregado no alcanza para el mapa de bloques libres.\n";
+   return false;
+  }
+  if (newBitmaps + newInodeBlocks >= added)
+   newInodeBlocks = 0;
+
+  sb.blockCount = newBlockCount;
+  if (newBitmaps > 0)
+   appendExtent(sb.bitmapExtents, {oldCount, newBitmaps});
+  if (!fitsFormat(sb))
+  {
+   std::cerr << "El formato " << sb.version << " no admite ese tamaño (use un FS en formato 2).\n";
+   return false;
+  }
+  if (newInodeBlocks > 0)
+  {
+   SuperBlock withInodes = sb;
+   withInodes.inodeExtents.push_back({oldCount + newBitmaps, newInodeBlocks});
+   withInodes.inodeCount += newInodeBlocks * inodesPerBlock;
+   if (fitsFormat(withInodes))
+    sb = withInodes;
+   else
+   {
+    std::cout << "No se agregan inodos: se alcanzó el máximo de tablas de inodos.\n";
+    newInodeBlocks = 0;
+   }
+  }
  }
 
- Inode &inode = inodes[*idx];
- // Escribir datos en bloques
- std::size_t offset = 0;
- std::size_t total = data.size();
+ // Todo lo pendiente llega al dispositivo antes de tocarlo, y no queda ninguna lectura
+ // anticipada en vuelo mientras crece (con Mmap el mapeo se mueve)
+ if (!sync())
+  return false;
+ std::size_t window = readahead ? readahead->maxWindow() : 0;
+ readahead.reset();
+ // Si un intento anterior agrando el dispositivo pero no el FS, alcanza con lo que ya tiene
+ bool grown = (mounted && newBlockCount <= device.blockCount) || device.grow(newBlockCount);
+ setReadAhead(window);
+ if (!grown)
+  return false;
+ if (!mounted)
+  return true;
 
- // Calcular cuántos bloques necesitamos
- std::size_t neededBlocks = (total + device.blockSize - 1) / device.blockSize;
- if (neededBlocks > 8)
+ // El espacio nuevo empieza libre (el mapa podia tener bits de un intento anterior que no
+ // llego a escribir el superblock) salvo sus primeros bloques: mapa y despues inodos
+ std::size_t oldInodes = inodes.size();
+ setGeometry(sb);
+ for (uint64_t blk = oldCount; blk < newBlockCount; blk++)
+  freeBlockMap[blk / 8] &= ~(1 << (blk % 8));
+ for (uint64_t blk = oldCount; blk < oldCount + newBitmaps + newInodeBlocks; blk++)
+  markUsed(blk);
+ if (newInodeBlocks > 0)
+ {
+  Inode freeInode{};
+  freeInode.free = 1;
+  inodes.resize(superBlock.inodeCount, freeInode);
+  // Los primeros pueden caer en el ultimo bloque de la tabla anterior
+  for (std::size_t b = oldInodes / inodesPerBlock; b < inodeTable.size(); b++)
+   inodeBlockDirty[b] = 1;
+ }
+
+ // Mapa e inodos primero; el superblock que los hace visibles va despues de sincronizarlos
+ bool ok = true;
+ for (std::size_t k = oldCount / bitsPerBlock; k < bitmapTable.size(); k++)
+  ok = saveBitmapBlock(k * bitsPerBlock) && ok;
+ if (!ok || !saveInodes() || !sync())
  {
-  std::cerr << "El archivo excede el límite de bloques (8).\n";
+  std::cerr << "Error escribiendo los metadatos del espacio nuevo.\n";
   return false;
  }
+ return saveSuperBlock() && sync();
+}
 
- for (std::size_t i = 0; i < neededBlocks; i++)
+bool FileSystem::ls(const std::string &dirname)
+{
+ if (!hasDirectories())
  {
-  if (inode.dataBlocks[i] == 0)
+  if (!dirname.empty())
   {
-   auto blk = allocateBlock();
-   if (!blk)
-   {
-    std::cerr << "No hay bloques libres.\n";
-    return false;
-   }
-   inode.dataBlocks[i] = *blk;
+   std::cerr << "El FS no tiene directorios.\n";
+   return false;
   }
-
-  std::size_t toWrite = std::min((std::size_t)device.blockSize, total - offset);
-  std::vector<char> blockData(data.begin() + offset, data.begin() + offset + toWrite);
-  if (!device.writeBlock(inode.dataBlocks[i], blockData))
+  std::cout << "Archivos en el sistema:\n";
+  for (auto &inode : inodes)
   {
-   std::cerr << "Error escribiendo datos.\n";
-   return false;
+   if (inode.free == 0)
+   {
+    std::cout << inode.fileName << " (" << inode.fileSize << " bytes)\n";
+   }
   }
-  offset += toWrite;
+  return true;
  }
 
- inode.fileSize = (uint32_t)total;
- return save();
+ auto dir = findInodeByName(dirname);
+ if (!dir)
+ {
+  std::cerr << "Directorio no encontrado.\n";
+  return false;
+ }
+ if (inodes[*dir].type != INODE_DIRECTORY)
+ {
+  std::cerr << "No es un directorio.\n";
+  return false;
+ }
+ if (*dir == superBlock.rootInode)
+  std::cout << "Archivos en el sistema:\n";
+ else
+  std::cout << "Archivos en " << dirname << ":\n";
+ // Las entradas salen del arbol ya ordenadas por nombre
+ return dirTree.forEach(inodes[*dir].dataBlocks[0], [this](const std::string &name, uint64_t i)
+                        {
+                         if (i >= inodes.size())
+                          std::cout << name << " (inodo inválido)\n";
+                         else if (inodes[i].type == INODE_DIRECTORY)
+                          std::cout << name << "/ (" << inodes[i].fileSize << " entradas)\n";
+                         else
+                          std::cout << name << " (" << inodes[i].fileSize << " bytes)\n";
+                         return true; });
 }
 
-bool FileSystem::hexdump(const std::string &filename)
+bool FileSystem::mkdir(const std::string &dirname)
 {
- auto idx = findInodeByName(filename);
+ if (superBlock.version == 1)
+ {
+  std::cerr << "El formato 1 no admite directorios.\n";
+  return false;
+ }
+ if (!hasDirectories() && !enableDirectories())
+  return false;
+
+ uint32_t parent;
+ std::string leaf;
+ if (!resolveParent(dirname, parent, leaf))
+  return false;
+ if (dirTree.find(inodes[parent].dataBlocks[0], leaf))
+ {
+  std::cerr << "Ya existe un archivo o directorio con ese nombre.\n";
+  return false;
+ }
+ auto idx = findFreeInode();
  if (!idx)
  {
-  std::cerr << "Archivo no encontrado.\n";
+  std::cerr << "No hay espacio para nuevos archivos.\n";
   return false;
  }
  Inode &inode = inodes[*idx];
-
- std::size_t remaining = inode.fileSize;
- for (auto blockNum : inode.dataBlocks)
+ inode = Inode();
+ inode.type = INODE_DIRECTORY;
+ inode.parent = parent;
+ std::strncpy(inode.fileName, leaf.c_str(), 63);
+ if (!linkEntry(parent, leaf, *idx))
  {
-  if (blockNum == 0)
-   break;
-  if (remaining == 0)
-   break;
-  auto data = device.readBlock(blockNum);
-  std::size_t toPrint = std::min((std::size_t)device.blockSize, remaining);
-
-  for (std::size_t i = 0; i < toPrint; i++)
-  {
-   printf("%02X ", (unsigned char)data[i]);
-  }
-  remaining -= toPrint;
+  inode.free = 1;
+  return false;
  }
- printf("\n");
+ markInodeDirty(*idx);
+ if (!save())
+  return false;
+ std::cout << "Directorio creado.\n";
  return true;
 }
 
-bool FileSystem::copyOut(const std::string &fsFilename, const std::string &hostFilename)
+bool FileSystem::rmdir(const std::string &dirname)
 {
- auto idx = findInodeByName(fsFilename);
+ if (!hasDirectories())
+ {
+  std::cerr << "El FS no tiene directorios.\n";
+  return false;
+ }
+ auto idx = findInodeByName(dirname);
  if (!idx)
  {
-  std::cerr << "Archivo no encontrado.\n";
+  std::cerr << "Directorio no encontrado.\n";
   return false;
  }
  Inode &inode = inodes[*idx];
-
- std::ofstream ofs(hostFilename, std::ios::binary);
- if (!ofs)
+ if (inode.type != INODE_DIRECTORY)
  {
-  std::cerr << "Error abriendo archivo en host.\n";
+  std::cerr << "No es un directorio.\n";
   return false;
  }
-
- std::size_t remaining = inode.fileSize;
- for (auto blockNum : inode.dataBlocks)
+ if (*idx == superBlock.rootInode)
  {
-  if (blockNum == 0 || remaining == 0)
-   break;
-  auto data = device.readBlock(blockNum);
-  std::size_t toWrite = std::min((std::size_t)device.blockSize, remaining);
-  ofs.write(data.data(), toWrite);
-  remaining -= toWrite;
+  std::cerr << "No se puede eliminar el directorio raíz.\n";
+  return false;
  }
-
- ofs.close();
- std::cout << "Archivo copiado al host exitosamente.\n";
- return true;
-}
-
-bool FileSystem::copyIn(const std::string &hostFilename, const std::string &fsFilename)
-{
- std::ifstream ifs(hostFilename, std::ios::binary);
- if (!ifs)
+ if (inode.fileSize != 0 || inode.dataBlocks[0] != 0)
  {
-  std::cerr << "Error abriendo archivo en host.\n";
+  std::cerr << "El directorio no está vacío.\n";
   return false;
  }
+ if (!unlinkEntry((uint32_t)inode.parent, inodeName(inode)))
+  return false;
 
- std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
- ifs.close();
-
- return writeFile(fsFilename, data);
+ freeInodeHint = std::min(freeInodeHint, *idx);
+ markInodeDirty(*idx);
+ inode = Inode();
+ inode.free = 1;
+ if (!save())
+  return false;
+ std::cout << "Directorio eliminado.\n";
+ return true;
 }
 
-bool FileSystem::rm(const std::string &filename)
+bool FileSystem::cat(const std::string &filename)
 {
  auto idx = findInodeByName(filename);
  if (!idx)
@@ -324,156 +686,1277 @@ bool FileSystem::rm(const std::string &filename)
   std::cerr << "Archivo no encontrado.\n";
   return false;
  }
-
  Inode &inode = inodes[*idx];
-
- // Liberar bloques de datos
- std::size_t remaining = inode.fileSize;
- for (auto blk : inode.dataBlocks)
+ if (inode.type == INODE_DIRECTORY)
  {
-  if (blk == 0)
-   break;
-  freeBlock(blk);
+  std::cerr << "Es un directorio.\n";
+  return false;
  }
 
- // Resetear inodo
- inode.free = 1;
- inode.fileSize = 0;
- std::memset(inode.fileName, 0, 64);
- std::fill(std::begin(inode.dataBlocks), std::end(inode.dataBlocks), 0);
-
- save();
- std::cout << "Archivo eliminado.\n";
- return true;
+ // Leer datos
+ bool ok = readFileData(*idx, [](const char *data, std::size_t size)
+                        {
+                         std::cout.write(data, size);
+                         return true;
+                        });
+ std::cout << "\n";
+ return ok;
 }
 
-std::optional<uint32_t> FileSystem::allocateBlock()
+bool FileSystem::writeFile(const std::string &filename, const std::string &data)
 {
- for (uint32_t i = superBlock.dataStart; i < superBlock.blockCount; i++)
+ // Escribir datos en bloques
+ std::size_t offset = 0;
+ std::size_t total = data.size();
+
+ // Calcular cuántos bloques necesitamos
+ std::size_t neededBlocks = (total + device.blockSize - 1) / device.blockSize;
+ if (superBlock.version == 1 && neededBlocks > 8)
  {
-  uint32_t byteIndex = i / 8;
-  uint8_t bitIndex = i % 8;
-  if ((freeBlockMap[byteIndex] & (1 << bitIndex)) == 0)
-  {
-   // Bloque libre
-   freeBlockMap[byteIndex] |= (1 << bitIndex);
-   saveFreeBlockMap();
-   return i;
-  }
+  std::cerr << "El archivo excede el límite de bloques del formato 1 (8).\n";
+  return false;
  }
- return std::nullopt;
-}
-
-void FileSystem::freeBlock(uint32_t blockNumber)
-{
- if (blockNumber < superBlock.blockCount)
+ if (neededBlocks > UINT32_MAX)
  {
-  uint32_t byteIndex = blockNumber / 8;
-  uint8_t bitIndex = blockNumber % 8;
-  freeBlockMap[byteIndex] &= ~(1 << bitIndex);
-  saveFreeBlockMap();
+  std::cerr << "El archivo es demasiado grande.\n";
+  return false;
  }
-}
 
-std::optional<uint32_t> FileSystem::findInodeByName(const std::string &filename)
-{
- for (uint32_t i = 0; i < inodes.size(); i++)
+ auto idx = findInodeByName(filename);
+ if (idx && inodes[*idx].type == INODE_DIRECTORY)
  {
-  if (inodes[i].free == 0 && std::strncmp(inodes[i].fileName, filename.c_str(), 64) == 0)
+  std::cerr << "Es un directorio.\n";
+  return false;
+ }
+ if (!idx)
+ {
+  // Crear nuevo archivo, con directorios en el directorio de la ruta
+  uint32_t parent = 0;
+  std::string leaf = filename;
+  if (hasDirectories() && !resolveParent(filename, parent, leaf))
+   return false;
+  idx = findFreeInode();
+  if (!idx)
+  {
+   std::cerr << "No hay espacio para nuevos archivos.\n";
+   return false;
+  }
+  Inode &inode = inodes[*idx];
+  inode.free = 0; // ocupado
+  inode.type = INODE_FILE;
+  inode.parent = parent;
+  std::strncpy(inode.fileName, leaf.c_str(), 63);
+  inode.fileSize = 0;
+  std::fill(std::begin(inode.dataBlocks), std::end(inode.dataBlocks), 0);
+  if (!hasDirectories())
+   indexName(*idx);
+  else if (!linkEntry(parent, leaf, *idx))
+  {
+   inode.free = 1;
+   return false;
+  }
+ }
+
+ Inode &inode = inodes[*idx];
+ markInodeDirty(*idx);
+ std::vector<uint64_t> oldBlocks;
+ std::vector<uint64_t> oldTree;
+ if (!fileBlocks(inode, oldBlocks, &oldTree))
+  return false;
+
+ // Los bloques completos se escriben directo desde el string, solo el ultimo
+ // bloque parcial se copia a un buffer con relleno de ceros
+ ioBlocks.clear();
+ ioWritePtrs.clear();
+ std::vector<uint64_t> blocks(neededBlocks, 0);
+ std::vector<std::size_t> released; // referencias que el archivo deja de usar
+ std::vector<std::size_t> acquired; // referencias nuevas, se devuelven si algo falla
+ Extent run{0, 0};                  // bloques contiguos reservados que todavia no se usaron
+ for (std::size_t i = 0; i < neededBlocks; i++)
+ {
+  std::size_t toWrite = std::min((std::size_t)device.blockSize, total - offset);
+  const char *payload = data.data() + offset;
+  if (toWrite < device.blockSize)
+  {
+   ioBuffer.assign(device.blockSize, 0);
+   std::memcpy(ioBuffer.data(), data.data() + offset, toWrite);
+   payload = ioBuffer.data();
+  }
+  offset += toWrite;
+
+  uint64_t current = i < oldBlocks.size() ? oldBlocks[i] : 0;
+  uint32_t hash = 0;
+  if (dedup)
+  {
+   hash = crc32c(payload, device.blockSize);
+   auto existing = findDuplicate(hash, payload);
+   if (existing)
+   {
+    // El contenido ya esta en disco: no se escribe nada
+    blocks[i] = *existing;
+    if (*existing == current)
+    {
+     dedupCounters.unchanged++;
+     continue;
+    }
+    dedupCounters.hits++;
+    auto shared = sharedRefs.find(*existing);
+    if (shared == sharedRefs.end())
+     sharedRefs.emplace(*existing, 2);
+    else
+     shared->second++;
+    acquired.push_back(*existing);
+    if (current != 0)
+     released.push_back(current);
+    continue;
+   }
+  }
+
+  // Un bloque compartido no se modifica en su lugar, el archivo pasa a tener su copia
+  if (current != 0 && sharedRefs.count(current))
+  {
+   dedupCounters.copies++;
+   released.push_back(current);
+   current = 0;
+  }
+  if (current == 0)
+  {
+   // Los bloques nuevos salen de rachas contiguas del tamaño de lo que falta escribir,
+   // asi el archivo queda en pocos rangos
+   if (run.count == 0)
+   {
+    auto reserved = allocateRun(neededBlocks - i);
+    if (!reserved)
+    {
+     std::cerr << "No hay bloques libres.\n";
+     releaseBlocks(acquired);
+     return false;
+    }
+    run = *reserved;
+   }
+   current = run.start++;
+   run.count--;
+   acquired.push_back(current);
+  }
+  else
+  {
+   forgetBlock(current);
+  }
+  blocks[i] = current;
+
+  ioBlocks.push_back(current);
+  ioWritePtrs.push_back(payload);
+  if (dedup)
+   indexBlock(current, hash);
+ }
+ // Lo reservado que sobro porque habia bloques iguales
+ if (run.count > 0)
+ {
+  std::vector<std::size_t> unused;
+  for (uint64_t k = 0; k < run.count; k++)
+   unused.push_back(run.start + k);
+  releaseBlocks(unused);
+ }
+
+ if (!writeBlocks(ioBlocks, ioWritePtrs))
+ {
+  // No se sabe que quedo en disco, esos bloques no pueden servir de original
+  for (auto blk : ioBlocks)
+   forgetBlock(blk);
+  std::cerr << "Error escribiendo datos.\n";
+  releaseBlocks(acquired);
+  return false;
+ }
+
+ // Si el archivo se achico, los bloques que sobran se liberan, y tambien el arbol de rangos anterior
+ for (std::size_t i = neededBlocks; i < oldBlocks.size(); i++)
+  released.push_back(oldBlocks[i]);
+ if (!setFileBlocks(*idx, blocks))
+ {
+  releaseBlocks(acquired);
+  return false;
+ }
+ released.insert(released.end(), oldTree.begin(), oldTree.end());
+ releaseBlocks(released);
+
+ inode.fileSize = total;
+ return save();
+}
+
+bool FileSystem::hexdump(const std::string &filename)
+{
+ auto idx = findInodeByName(filename);
+ if (!idx)
+ {
+  std::cerr << "Archivo no encontrado.\n";
+  return false;
+ }
+ Inode &inode = inodes[*idx];
+ if (inode.type == INODE_DIRECTORY)
+ {
+  std::cerr << "Es un directorio.\n";
+  return false;
+ }
+
+ bool ok = readFileData(*idx, [](const char *data, std::size_t size)
+                        {
+                         for (std::size_t i = 0; i < size; i++)
+                         {
+                          printf("%02X ", (unsigned char)data[i]);
+                         }
+                         return true;
+                        });
+ printf("\n");
+ return ok;
+}
+
+bool FileSystem::copyOut(const std::string &fsFilename, const std::string &hostFilename)
+{
+ auto idx = findInodeByName(fsFilename);
+ if (!idx)
+ {
+  std::cerr << "Archivo no encontrado.\n";
+  return false;
+ }
+ Inode &inode = inodes[*idx];
+ if (inode.type == INODE_DIRECTORY)
+ {
+  std::cerr << "Es un directorio.\n";
+  return false;
+ }
+
+ std::ofstream ofs(hostFilename, std::ios::binary);
+ if (!ofs)
+ {
+  std::cerr << "Error abriendo archivo en host.\n";
+  return false;
+ }
+
+ // Se escribe en el host cada tramo apenas se lee
+ bool written = readFileData(*idx, [&ofs](const char *data, std::size_t size)
+                             {
+                              ofs.write(data, size);
+                              return (bool)ofs;
+                             });
+ if (!ofs)
+  std::cerr << "Error escribiendo archivo en host.\n";
+ if (!written || !ofs)
+  return false;
+
+ ofs.close();
+ std::cout << "Archivo copiado al host exitosamente.\n";
+ return true;
+}
+
+bool FileSystem::copyIn(const std::string &hostFilename, const std::string &fsFilename)
+{
+ std::ifstream ifs(hostFilename, std::ios::binary);
+ if (!ifs)
+ {
+  std::cerr << "Error abriendo archivo en host.\n";
+  return false;
+ }
+
+ std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+ ifs.close();
+
+ return writeFile(fsFilename, data);
+}
+
+bool FileSystem::rm(const std::string &filename)
+{
+ auto idx = findInodeByName(filename);
+ if (!idx)
+ {
+  std::cerr << "Archivo no encontrado.\n";
+  return false;
+ }
+
+ Inode &inode = inodes[*idx];
+ if (inode.type == INODE_DIRECTORY)
+ {
+  std::cerr << "Es un directorio (use rmdir).\n";
+  return false;
+ }
+ std::vector<uint64_t> blocks;
+ std::vector<uint64_t> tree;
+ if (!fileBlocks(inode, blocks, &tree))
+  return false;
+ if (hasDirectories() && !unlinkEntry((uint32_t)inode.parent, inodeName(inode)))
+  return false;
+
+ // Liberar bloques de datos y los nodos del arbol de rangos
+ std::vector<std::size_t> released(blocks.begin(), blocks.end());
+ released.insert(released.end(), tree.begin(), tree.end());
+ releaseBlocks(released);
+
+ if (readahead)
+  readahead->forgetStream(*idx);
+
+ // Resetear inodo
+ if (!hasDirectories())
+  unindexName(*idx);
+ freeInodeHint = std::min(freeInodeHint, *idx);
+ markInodeDirty(*idx);
+ inode.free = 1;
+ inode.fileSize = 0;
+ inode.parent = 0;
+ inode.flags = 0;
+ inode.extentDepth = 0;
+ std::memset(inode.fileName, 0, 64);
+ std::fill(std::begin(inode.dataBlocks), std::end(inode.dataBlocks), 0);
+
+ save();
+ std::cout << "Archivo eliminado.\n";
+ return true;
+}
+
+// Primer bloque libre; allocHint evita recorrer desde dataStart los bloques que se sabe que
+// estan ocupados y los bytes llenos del mapa se saltan de a 8 bloques
+std::optional<uint64_t> FileSystem::allocateBlock()
+{
+ for (uint64_t i = std::max(allocHint, superBlock.dataStart); i < superBlock.blockCount; i++)
+ {
+  if (i % 8 == 0 && freeBlockMap[i / 8] == 0xFF)
   {
+   i += 7;
+   continue;
+  }
+  if (!isUsed(i))
+  {
+   // Bloque libre
+   markUsed(i);
+   allocHint = i + 1;
+   saveBitmapBlock(i);
    return i;
   }
  }
+ allocHint = superBlock.blockCount;
  return std::nullopt;
 }
 
+std::optional<Extent> FileSystem::allocateRun(uint64_t wanted)
+{
+ if (wanted == 0)
+  return std::nullopt;
+ // Un solo recorrido del mapa desde allocHint: se corta en el primer hueco suficiente y
+ // si no aparece queda el mas grande. Los bytes llenos o vacios se saltan de a 8 bloques
+ uint64_t firstFree = superBlock.blockCount;
+ Extent best{0, 0};
+ uint64_t runStart = 0;
+ uint64_t runLength = 0;
+ uint64_t i = std::max(allocHint, superBlock.dataStart);
+ while (i < superBlock.blockCount && best.count < wanted)
+ {
+  uint8_t byte = freeBlockMap[i / 8];
+  uint64_t step = (i % 8 == 0 && (byte == 0xFF || byte == 0) && i + 8 <= superBlock.blockCount) ? 8 : 1;
+  if (step == 8 ? byte == 0xFF : isUsed(i))
+  {
+   runLength = 0;
+   i += step;
+   continue;
+  }
+  if (runLength == 0)
+   runStart = i;
+  firstFree = std::min(firstFree, runStart);
+  runLength += step;
+  if (runLength > best.count)
+   best = {runStart, std::min(runLength, wanted)};
+  i += step;
+ }
+ if (best.count == 0)
+ {
+  allocHint = superBlock.blockCount;
+  return std::nullopt;
+ }
+
+ for (uint64_t blk = best.start; blk < best.start + best.count; blk++)
+  markUsed(blk);
+ // Un bloque del mapa por cada uno que toca la racha
+ std::size_t bitsPerBlock = device.blockSize * 8;
+ for (uint64_t k = best.start / bitsPerBlock; k <= (best.start + best.count - 1) / bitsPerBlock; k++)
+  saveBitmapBlock(k * bitsPerBlock);
+ allocHint = best.start == firstFree ? best.start + best.count : firstFree;
+ return best;
+}
+
+void FileSystem::freeBlock(uint64_t blockNumber)
+{
+ releaseBlocks(std::vector<std::size_t>{blockNumber});
+}
+
+// Quita una referencia a cada bloque; los que quedan sin referencias se marcan como libres,
+// se guarda el mapa una sola vez y se descartan los de datos.
+// Las copias en cache o precargadas se tiran sin escribirlas: su contenido ya no importa.
+void FileSystem::releaseBlocks(const std::vector<std::size_t> &blockNumbers)
+{
+ std::vector<std::size_t> discard;
+ std::vector<std::size_t> changed; // bloques del mapa a guardar, uno por cada bloque del mapa tocado
+ for (std::size_t blockNumber : blockNumbers)
+ {
+  if (blockNumber >= superBlock.blockCount)
+   continue;
+  // Un bloque compartido sigue en uso por otro archivo
+  auto shared = sharedRefs.find(blockNumber);
+  if (shared != sharedRefs.end())
+  {
+   if (--shared->second <= 1)
+    sharedRefs.erase(shared);
+   continue;
+  }
+  forgetBlock(blockNumber);
+
+  std::size_t byteIndex = blockNumber / 8;
+  uint8_t bitIndex = blockNumber % 8;
+  freeBlockMap[byteIndex] &= ~(1 << bitIndex);
+  std::size_t bitmapIndex = byteIndex / device.blockSize;
+  if (std::find(changed.begin(), changed.end(), bitmapIndex) == changed.end())
+   changed.push_back(bitmapIndex);
+  if (blockNumber >= superBlock.dataStart)
+   allocHint = std::min<uint64_t>(allocHint, blockNumber);
+
+  if (cache)
+   cache->invalidate(blockNumber);
+  if (readahead)
+   readahead->invalidate(blockNumber);
+  if (blockNumber >= superBlock.dataStart)
+   discard.push_back(blockNumber);
+ }
+ if (changed.empty())
+  return;
+
+ for (std::size_t bitmapIndex : changed)
+  saveBitmapBlock(bitmapIndex * device.blockSize * 8);
+ // Solo es una optimizacion de espacio en el host, si falla los bloques quedan libres igual
+ if (discardFreed && device.supportsDiscard())
+  device.discardBlocks(discard);
+}
+
+void FileSystem::setDedup(bool enabled)
+{
+ dedup = enabled;
+ // Con la deduplicacion apagada las escrituras no mantienen el indice, se arma de nuevo al activarla
+ dedupIndex.clear();
+ blockHashes.clear();
+ if (dedup && mounted && !rebuildDedupIndex())
+  std::cerr << "Error leyendo bloques para la deduplicación.\n";
+}
+
+FileSystem::DedupStats FileSystem::dedupStats() const
+{
+ DedupStats st = dedupCounters;
+ st.sharedBlocks = sharedRefs.size();
+ for (const auto &entry : sharedRefs)
+  st.savedBlocks += entry.second - 1;
+ return st;
+}
+
+// Cuenta cuantas entradas de inodos apuntan a cada bloque; solo se guardan los compartidos,
+// un bloque ocupado que no esta en sharedRefs tiene una sola referencia
+void FileSystem::rebuildBlockRefs()
+{
+ sharedRefs.clear();
+ std::vector<uint64_t> blocks = referencedBlocks();
+ for (std::size_t i = 0; i < blocks.size();)
+ {
+  std::size_t j = i;
+  while (j < blocks.size() && blocks[j] == blocks[i])
+   j++;
+  if (j - i > 1)
+   sharedRefs[blocks[i]] = (uint32_t)(j - i);
+  i = j;
+ }
+}
+
+std::vector<uint64_t> FileSystem::referencedBlocks()
+{
+ std::vector<uint64_t> blocks;
+ std::vector<uint64_t> fileList;
+ for (const auto &inode : inodes)
+ {
+  // Los bloques de los directorios y de los arboles de rangos no se comparten ni se deduplican
+  if (inode.free != 0 || inode.type == INODE_DIRECTORY || !fileBlocks(inode, fileList))
+   continue;
+  for (auto blk : fileList)
+  {
+   if (blk < superBlock.blockCount)
+    blocks.push_back(blk);
+  }
+ }
+ std::sort(blocks.begin(), blocks.end());
+ return blocks;
+}
+
+// Lee todos los bloques de datos en uso y los indexa por contenido, de a lotes
+bool FileSystem::rebuildDedupIndex()
+{
+ dedupIndex.clear();
+ blockHashes.clear();
+
+ std::vector<uint64_t> used = referencedBlocks();
+ used.erase(std::unique(used.begin(), used.end()), used.end());
+
+ constexpr std::size_t batch = 64;
+ std::vector<std::size_t> blocks;
+ std::vector<char *> buffers;
+ std::vector<char> data(batch * device.blockSize);
+ for (std::size_t first = 0; first < used.size(); first += batch)
+ {
+  blocks.clear();
+  buffers.clear();
+  for (std::size_t i = first; i < std::min(first + batch, used.size()); i++)
+  {
+   buffers.push_back(data.data() + blocks.size() * device.blockSize);
+   blocks.push_back(used[i]);
+  }
+  if (!readBlocks(blocks, buffers))
+   return false;
+  for (std::size_t i = 0; i < blocks.size(); i++)
+  {
+   uint32_t hash = crc32c(buffers[i], device.blockSize);
+   // Si dos bloques ya tenian el mismo contenido queda indexado el primero
+   if (dedupIndex.find(hash) == dedupIndex.end())
+    indexBlock(blocks[i], hash);
+  }
+ }
+ return true;
+}
+
+// Bloque con exactamente este contenido, si lo hay. El CRC solo elige el candidato, el
+// contenido se compara completo (los que estan en el lote de escritura en curso se comparan
+// contra lo que se va a escribir, en disco todavia esta lo anterior)
+std::optional<uint64_t> FileSystem::findDuplicate(uint32_t hash, const char *data)
+{
+ auto it = dedupIndex.find(hash);
+ if (it == dedupIndex.end())
+  return std::nullopt;
+
+ uint64_t candidate = it->second;
+ const char *content = nullptr;
+ for (std::size_t i = 0; i < ioBlocks.size(); i++)
+ {
+  if (ioBlocks[i] == candidate)
+   content = ioWritePtrs[i];
+ }
+ if (!content)
+ {
+  dedupBuffer.resize(device.blockSize);
+  if (!readBlock(candidate, dedupBuffer.data()))
+   return std::nullopt;
+  content = dedupBuffer.data();
+ }
+ if (std::memcmp(content, data, device.blockSize) != 0)
+  return std::nullopt;
+ return candidate;
+}
+
+void FileSystem::indexBlock(uint64_t blockNumber, uint32_t hash)
+{
+ // Ante una colision de CRC con otro contenido se mantiene el bloque ya indexado
+ if (!dedupIndex.emplace(hash, blockNumber).second)
+  return;
+ blockHashes[blockNumber] = hash;
+}
+
+// El contenido del bloque va a cambiar o el bloque se libera: deja de servir de original
+void FileSystem::forgetBlock(uint64_t blockNumber)
+{
+ auto it = blockHashes.find(blockNumber);
+ if (it == blockHashes.end())
+  return;
+ dedupIndex.erase(it->second);
+ blockHashes.erase(it);
+}
+
+bool FileSystem::fileBlocks(const Inode &inode, std::vector<uint64_t> &blocks, std::vector<uint64_t> *treeBlocks)
+{
+ blocks.clear();
+ std::vector<Extent> runs;
+ if (!fileRuns(inode, runs, treeBlocks))
+  return false;
+ for (const auto &run : runs)
+ {
+  for (uint64_t b = 0; b < run.count; b++)
+   blocks.push_back(run.start + b);
+ }
+ return true;
+}
+
+bool FileSystem::fileRuns(const Inode &inode, std::vector<Extent> &runs, std::vector<uint64_t> *treeBlocks)
+{
+ runs.clear();
+ if (treeBlocks)
+  treeBlocks->clear();
+ if (!(inode.flags & INODE_EXTENTS))
+ {
+  for (auto blk : inode.dataBlocks)
+  {
+   if (blk == 0)
+    break;
+   if (!runs.empty() && runs.back().start + runs.back().count == blk)
+    runs.back().count++;
+   else
+    runs.push_back(Extent{blk, 1});
+  }
+  return true;
+ }
+ // En el inodo las entradas sin usar quedan al final
+ std::size_t used = 0;
+ while (used < INODE_EXTENTS_INLINE &&
+        (inode.extentDepth == 0 ? inode.extents[used].count != 0 : inode.extents[used].start != 0))
+  used++;
+ uint64_t logical = 0;
+ return collectExtents(inode.extents, used, inode.extentDepth, runs, logical, treeBlocks);
+}
+
+// logical: bloques del archivo que ya estan en runs, cada rango debe empezar ahi
+bool FileSystem::collectExtents(const FileExtent *entries, std::size_t count, unsigned depth,
+                                std::vector<Extent> &runs, uint64_t &logical, std::vector<uint64_t> *treeBlocks)
+{
+ // Un arbol mas alto que esto no lo arma setFileBlocks ni con todos los bloques posibles
+ constexpr unsigned max_depth = 8;
+ if (depth > max_depth)
+ {
+  std::cerr << "El árbol de rangos del archivo no es válido.\n";
+  return false;
+ }
+ for (std::size_t k = 0; k < count; k++)
+ {
+  const FileExtent &e = entries[k];
+  if (e.start < superBlock.dataStart || e.start >= superBlock.blockCount ||
+      (depth == 0 && e.count > superBlock.blockCount - e.start) || e.logical != logical)
+  {
+   std::cerr << "El mapa de bloques del archivo no es válido.\n";
+   return false;
+  }
+  if (depth == 0)
+  {
+   runs.push_back(Extent{e.start, e.count});
+   logical += e.count;
+   continue;
+  }
+
+  if (treeBlocks)
+   treeBlocks->push_back(e.start);
+  std::vector<char> node(device.blockSize);
+  if (!readBlock(e.start, node.data()))
+  {
+   std::cerr << "Error leyendo el árbol de rangos del archivo.\n";
+   return false;
+  }
+  ExtentNodeHeader header;
+  std::memcpy(&header, node.data(), sizeof(header));
+  if (header.magic != EXTENT_NODE_MAGIC || header.level != depth - 1 ||
+      header.count > (device.blockSize - sizeof(header)) / sizeof(FileExtent))
+  {
+   std::cerr << "El árbol de rangos del archivo no es válido.\n";
+   return false;
+  }
+  if (!collectExtents(reinterpret_cast<const FileExtent *>(node.data() + sizeof(header)), header.count, depth - 1,
+                      runs, logical, treeBlocks))
+   return false;
+ }
+ return true;
+}
+
+bool FileSystem::setFileBlocks(uint32_t i, const std::vector<uint64_t> &blocks)
+{
+ Inode &inode = inodes[i];
+ markInodeDirty(i);
+ if (superBlock.version == 1)
+ {
+  // El formato 1 solo tiene los 8 bloques sueltos (writeFile no deja pasar mas)
+  std::fill(std::begin(inode.dataBlocks), std::end(inode.dataBlocks), 0);
+  std::copy(blocks.begin(), blocks.end(), inode.dataBlocks);
+  return true;
+ }
+
+ // Un rango por cada racha de bloques consecutivos
+ std::vector<FileExtent> entries;
+ for (std::size_t k = 0; k < blocks.size(); k++)
+ {
+  FileExtent *last = entries.empty() ? nullptr : &entries.back();
+  if (last && last->start + last->count == blocks[k] && last->count < UINT32_MAX)
+   last->count++;
+  else
+   entries.push_back({blocks[k], (uint32_t)k, 1});
+ }
+
+ // Si no entran en el inodo se arman los niveles del arbol de abajo hacia arriba, con los
+ // nodos llenos, hasta que el de arriba entra en el inodo
+ std::size_t perNode = (device.blockSize - sizeof(ExtentNodeHeader)) / sizeof(FileExtent);
+ std::vector<uint64_t> nodes; // para devolverlos si algo falla
+ std::vector<char> buffer(device.blockSize);
+ unsigned depth = 0;
+ while (entries.size() > INODE_EXTENTS_INLINE)
+ {
+  std::vector<FileExtent> parents;
+  for (std::size_t first = 0; first < entries.size(); first += perNode)
+  {
+   std::size_t count = std::min(perNode, entries.size() - first);
+   auto blk = allocateBlock();
+   if (!blk)
+   {
+    std::cerr << "No hay bloques libres para el mapa del archivo.\n";
+    releaseBlocks(std::vector<std::size_t>(nodes.begin(), nodes.end()));
+    return false;
+   }
+   nodes.push_back(*blk);
+   ExtentNodeHeader header{};
+   header.magic = EXTENT_NODE_MAGIC;
+   header.level = (uint16_t)depth;
+   header.count = (uint16_t)count;
+   std::fill(buffer.begin(), buffer.end(), 0);
+   std::memcpy(buffer.data(), &header, sizeof(header));
+   std::memcpy(buffer.data() + sizeof(header), entries.data() + first, count * sizeof(FileExtent));
+   if (!writeBlock(*blk, buffer.data(), device.blockSize))
+   {
+    std::cerr << "Error escribiendo el mapa del archivo.\n";
+    releaseBlocks(std::vector<std::size_t>(nodes.begin(), nodes.end()));
+    return false;
+   }
+   uint64_t covered = 0;
+   for (std::size_t k = first; k < first + count; k++)
+    covered += entries[k].count;
+   parents.push_back({*blk, entries[first].logical, (uint32_t)std::min<uint64_t>(covered, UINT32_MAX)});
+  }
+  entries.swap(parents);
+  depth++;
+ }
+
+ std::fill(std::begin(inode.dataBlocks), std::end(inode.dataBlocks), 0);
+ std::copy(entries.begin(), entries.end(), inode.extents);
+ inode.flags |= INODE_EXTENTS;
+ inode.extentDepth = (uint8_t)depth;
+ return true;
+}
+
+// Entrega el archivo a sink tramo por tramo. Cada tramo es parte de un solo rango (bloques
+// consecutivos) y tiene hasta read_chunk_bytes: con el backend mmap se entregan vistas
+// directas al mapeo, si no el tramo se lee en un solo lote dentro de ioBuffer
+bool FileSystem::readFileData(uint32_t inodeIndex, const DataSink &sink)
+{
+ const Inode &inode = inodes[inodeIndex];
+ std::vector<Extent> runs;
+ if (!fileRuns(inode, runs))
+  return false;
+
+ // Primer bloque logico de cada rango, para que la lectura anticipada traduzca posiciones
+ std::vector<uint64_t> runLogical;
+ uint64_t total = 0;
+ for (const auto &run : runs)
+ {
+  runLogical.push_back(total);
+  total += run.count;
+ }
+ uint64_t used = std::min<uint64_t>(total, (inode.fileSize + device.blockSize - 1) / device.blockSize);
+ ReadAhead::BlockMap map = [&](std::size_t index, std::size_t &blockNumber)
+ {
+  if (index >= used)
+   return false;
+  std::size_t k = (std::size_t)(std::upper_bound(runLogical.begin(), runLogical.end(), index) - runLogical.begin()) - 1;
+  blockNumber = runs[k].start + (index - runLogical[k]);
+  return true;
+ };
+
+ std::size_t chunkBlocks = std::max<std::size_t>(1, read_chunk_bytes / device.blockSize);
+ uint64_t remaining = inode.fileSize;
+ for (std::size_t k = 0; k < runs.size() && remaining > 0; k++)
+ {
+  for (uint64_t done = 0; done < runs[k].count && remaining > 0;)
+  {
+   std::size_t count = (std::size_t)std::min<uint64_t>(
+       {runs[k].count - done, chunkBlocks, (remaining + device.blockSize - 1) / device.blockSize});
+   uint64_t first = runs[k].start + done;
+   uint64_t logical = runLogical[k] + done;
+   done += count;
+
+   // Con cache activa el mapeo puede estar desactualizado respecto a los bloques sucios
+   if (device.providesViews() && !cache)
+   {
+    // Las vistas no pasan por readBlock: el tramo se anota en el dispositivo como una lectura
+    uint64_t start = IoStats::now();
+    ioViews.clear();
+    for (std::size_t b = 0; b < count; b++)
+    {
+     ioViews.push_back(device.blockView(first + b));
+     if (ioViews.back().empty())
+     {
+      device.recordRead(first + b, 1, false, start);
+      std::cerr << "Error leyendo datos del archivo.\n";
+      return false;
+     }
+    }
+    device.recordRead(first, count, true, start);
+    for (const auto &view : ioViews)
+    {
+     std::size_t size = (std::size_t)std::min<uint64_t>(view.size, remaining);
+     if (!sink(view.data, size))
+      return false;
+     remaining -= size;
+    }
+    continue;
+   }
+
+   ioBuffer.resize(count * device.blockSize);
+   ioBlocks.clear();
+   ioReadPtrs.clear();
+   for (std::size_t b = 0; b < count; b++)
+   {
+    ioBlocks.push_back(first + b);
+    ioReadPtrs.push_back(ioBuffer.data() + b * device.blockSize);
+   }
+
+   bool ok = true;
+   if (readahead)
+   {
+    // Bloque por bloque a traves de la lectura anticipada: la primera lectura ya deja
+    // pedidos los siguientes y el resto se atiende desde memoria
+    for (std::size_t b = 0; b < count && ok; b++)
+     ok = (cache && cache->contains(ioBlocks[b])) ? cache->readBlock(ioBlocks[b], ioReadPtrs[b])
+                                                  : readahead->read(inodeIndex, logical + b, map, ioReadPtrs[b]);
+   }
+   else
+   {
+    ok = readBlocks(ioBlocks, ioReadPtrs);
+   }
+   if (!ok)
+   {
+    std::cerr << "Error leyendo datos del archivo.\n";
+    return false;
+   }
+
+   std::size_t size = (std::size_t)std::min<uint64_t>(ioBuffer.size(), remaining);
+   if (!sink(ioBuffer.data(), size))
+    return false;
+   remaining -= size;
+  }
+ }
+ return true;
+}
+
+std::optional<uint32_t> FileSystem::findInodeByName(const std::string &filename)
+{
+ if (hasDirectories())
+  return resolvePath(splitPath(filename));
+ // Los nombres se guardan con 63 caracteres como maximo, uno mas largo nunca coincide
+ if (filename.size() >= sizeof(Inode::fileName))
+  return std::nullopt;
+ auto it = nameIndex.find(filename);
+ if (it == nameIndex.end())
+  return std::nullopt;
+ return it->second;
+}
+
 std::optional<uint32_t> FileSystem::findFreeInode()
 {
- for (uint32_t i = 0; i < inodes.size(); i++)
+ for (uint32_t i = freeInodeHint; i < inodes.size(); i++)
  {
   if (inodes[i].free == 1)
   {
+   freeInodeHint = i;
    return i;
   }
  }
+ freeInodeHint = (uint32_t)inodes.size();
  return std::nullopt;
 }
 
-bool FileSystem::loadFreeBlockMap()
+void FileSystem::rebuildNameIndex()
+{
+ nameIndex.clear();
+ duplicateNames = false;
+ freeInodeHint = 0;
+ // Con directorios cada uno tiene su indice en disco
+ if (hasDirectories())
+  return;
+ nameIndex.reserve(inodes.size());
+ for (uint32_t i = 0; i < inodes.size(); i++)
+ {
+  if (inodes[i].free == 0)
+   indexName(i);
+ }
+}
+
+void FileSystem::indexName(uint32_t i)
+{
+ if (!nameIndex.emplace(inodeName(inodes[i]), i).second)
+  duplicateNames = true;
+}
+
+// Se llama antes de borrar el nombre del inodo i
+void FileSystem::unindexName(uint32_t i)
+{
+ std::string name = inodeName(inodes[i]);
+ auto it = nameIndex.find(name);
+ if (it == nameIndex.end() || it->second != i)
+  return;
+ nameIndex.erase(it);
+ if (!duplicateNames)
+  return;
+ // Otro inodo con el mismo nombre pasa a ser el que se encuentra
+ for (uint32_t k = 0; k < inodes.size(); k++)
+ {
+  if (k != i && inodes[k].free == 0 && inodeName(inodes[k]) == name)
+  {
+   nameIndex.emplace(name, k);
+   return;
+  }
+ }
+}
+
+// Baja desde la raiz por las entradas de cada directorio, un arbol por componente
+std::optional<uint32_t> FileSystem::resolvePath(const std::vector<std::string> &parts)
 {
- auto data = device.readBlock(FREEBLOCKMAP_BLOCK);
- if (data.size() != device.blockSize)
+ uint32_t current = (uint32_t)superBlock.rootInode;
+ for (const auto &part : parts)
  {
+  if (part == ".")
+   continue;
+  if (part == "..")
+  {
+   current = (uint32_t)inodes[current].parent;
+   continue;
+  }
+  if (inodes[current].type != INODE_DIRECTORY)
+   return std::nullopt;
+  auto next = dirTree.find(inodes[current].dataBlocks[0], part);
+  if (!next || *next >= inodes.size() || inodes[*next].free != 0)
+   return std::nullopt;
+  current = (uint32_t)*next;
+ }
+ return current;
+}
+
+bool FileSystem::resolveParent(const std::string &path, uint32_t &parent, std::string &leaf)
+{
+ std::vector<std::string> parts = splitPath(path);
+ if (parts.empty() || parts.back() == "." || parts.back() == "..")
+ {
+  std::cerr << "Ruta inválida.\n";
   return false;
  }
- // Solo necesitamos los primeros 256 bytes
- std::memcpy(freeBlockMap.data(), data.data(), 256);
+ leaf = parts.back();
+ if (leaf.size() > DirectoryTree::max_name)
+ {
+  std::cerr << "Nombre demasiado largo (máximo " << DirectoryTree::max_name << " caracteres).\n";
+  return false;
+ }
+ parts.pop_back();
+ auto dir = resolvePath(parts);
+ if (!dir || inodes[*dir].type != INODE_DIRECTORY)
+ {
+  std::cerr << "No existe el directorio donde va " << leaf << ".\n";
+  return false;
+ }
+ parent = *dir;
  return true;
 }
 
-bool FileSystem::saveFreeBlockMap()
+// La raiz del arbol puede cambiar: el inodo del directorio queda para guardar
+bool FileSystem::linkEntry(uint32_t dir, const std::string &name, uint32_t inode)
 {
- std::vector<char> data(device.blockSize, 0);
- std::memcpy(data.data(), freeBlockMap.data(), 256);
- return device.writeBlock(FREEBLOCKMAP_BLOCK, data);
+ if (!dirTree.insert(inodes[dir].dataBlocks[0], name, inode))
+  return false;
+ inodes[dir].fileSize++;
+ markInodeDirty(dir);
+ return true;
 }
 
-bool FileSystem::loadInodes()
+bool FileSystem::unlinkEntry(uint32_t dir, const std::string &name)
 {
- // Leer todos los inodos desde los bloques 2..(2+37-1)
- uint32_t startBlock = superBlock.inodeStart;
- uint32_t endBlock = startBlock + superBlock.inodeBlocks;
- uint32_t inodesRead = 0;
+ if (!dirTree.remove(inodes[dir].dataBlocks[0], name))
+ {
+  std::cerr << "No se pudo quitar " << name << " de su directorio.\n";
+  return false;
+ }
+ inodes[dir].fileSize--;
+ markInodeDirty(dir);
+ return true;
+}
 
- for (uint32_t blk = startBlock; blk < endBlock; blk++)
+// Pasa un FS en formato 2 de antes de los directorios a tener un directorio raiz. Los nombres
+// con '/' eran la forma de simular directorios: cada prefijo pasa a ser un directorio y el
+// archivo queda en el ultimo con el resto del nombre. Si algun nombre no se puede ubicar
+// (vacio, "." o "..", repetido, o un archivo que tambien es prefijo de otro) no se cambia nada.
+// Tampoco si falla a mitad de camino (sin bloques libres para los arboles, error de E/S):
+// se vuelve a los inodos y al superbloque de antes y se liberan los bloques reservados
+bool FileSystem::enableDirectories()
+{
+ std::set<std::string> files;
+ std::set<std::string> dirs;
+ for (const auto &inode : inodes)
  {
-  auto blockData = device.readBlock(blk);
-  if (blockData.size() != device.blockSize)
+  if (inode.free != 0)
+   continue;
+  std::string name = inodeName(inode);
+  std::vector<std::string> parts = splitPath(name);
+  std::string path;
+  bool valid = !parts.empty();
+  for (const auto &part : parts)
+  {
+   valid = valid && part != "." && part != "..";
+   if (!path.empty())
+    dirs.insert(path);
+   path += (path.empty() ? "" : "/") + part;
+  }
+  if (!valid || !files.insert(path).second)
   {
+   std::cerr << "No se pueden activar los directorios: el nombre '" << name << "' no se puede convertir en una ruta.\n";
    return false;
   }
+ }
+ for (const auto &dir : dirs)
+ {
+  if (files.count(dir))
+  {
+   std::cerr << "No se pueden activar los directorios: '" << dir << "' es un archivo y también un prefijo.\n";
+   return false;
+  }
+ }
+ std::size_t freeInodes = std::count_if(inodes.begin(), inodes.end(), [](const Inode &inode)
+                                        { return inode.free != 0; });
+ if (freeInodes < dirs.size() + 1)
+ {
+  std::cerr << "No hay inodos libres para los directorios.\n";
+  return false;
+ }
 
-  // En cada bloque hay up to inodesPerBlock inodos
-  for (uint32_t i = 0; i < inodesPerBlock && inodesRead < inodes.size(); i++)
+ std::vector<Inode> savedInodes = inodes;
+ SuperBlock savedSuperBlock = superBlock;
+ std::vector<uint8_t> savedBlockMap = freeBlockMap;
+ std::vector<uint8_t> savedDirty = inodeBlockDirty;
+ auto rollback = [&]()
+ {
+  // Los bloques marcados desde la copia del mapa son los de los arboles de directorio
+  std::vector<std::size_t> reserved;
+  for (std::size_t k = 0; k < freeBlockMap.size(); k++)
   {
-   std::memcpy(&inodes[inodesRead], blockData.data() + i * 136, 136);
-   inodesRead++;
+   uint8_t added = freeBlockMap[k] & ~savedBlockMap[k];
+   for (unsigned bit = 0; added != 0 && bit < 8; bit++)
+   {
+    if (added & (1 << bit))
+     reserved.push_back(k * 8 + bit);
+   }
   }
+  releaseBlocks(reserved);
+  inodes = std::move(savedInodes);
+  superBlock = savedSuperBlock;
+  // Los bloques de inodos tocados quedan sucios para que el proximo save() escriba lo de antes
+  for (std::size_t b = 0; b < inodeBlockDirty.size(); b++)
+   inodeBlockDirty[b] |= savedDirty[b];
+  rebuildNameIndex();
+  std::cerr << "No se pudieron activar los directorios, el FS queda como estaba.\n";
+  return false;
+ };
+
+ uint32_t root = *findFreeInode();
+ inodes[root] = Inode();
+ inodes[root].type = INODE_DIRECTORY;
+ inodes[root].parent = root;
+ std::strcpy(inodes[root].fileName, "/");
+ markInodeDirty(root);
+ superBlock.features |= SUPERBLOCK_FEATURE_DIRECTORIES;
+ superBlock.rootInode = root;
+ rebuildNameIndex();
+
+ // Un prefijo va antes que sus extensiones en el set: cada padre se crea antes que sus hijos
+ std::unordered_map<std::string, uint32_t> dirInodes;
+ dirInodes[""] = root;
+ auto place = [&](uint32_t i, const std::string &path)
+ {
+  std::size_t slash = path.rfind('/');
+  std::string parentPath = slash == std::string::npos ? "" : path.substr(0, slash);
+  std::string leaf = slash == std::string::npos ? path : path.substr(slash + 1);
+  uint32_t parent = dirInodes[parentPath];
+  inodes[i].parent = parent;
+  std::memset(inodes[i].fileName, 0, sizeof(inodes[i].fileName));
+  std::strncpy(inodes[i].fileName, leaf.c_str(), 63);
+  markInodeDirty(i);
+  return linkEntry(parent, leaf, i);
+ };
+ for (const auto &dir : dirs)
+ {
+  uint32_t i = *findFreeInode();
+  inodes[i] = Inode();
+  inodes[i].type = INODE_DIRECTORY;
+  dirInodes[dir] = i;
+  if (!place(i, dir))
+   return rollback();
  }
+ for (uint32_t i = 0; i < inodes.size(); i++)
+ {
+  if (inodes[i].free != 0 || inodes[i].type == INODE_DIRECTORY)
+   continue;
+  std::string path;
+  for (const auto &part : splitPath(inodeName(inodes[i])))
+   path += (path.empty() ? "" : "/") + part;
+  if (!place(i, path))
+   return rollback();
+ }
+ if (!save())
+  return rollback();
+ std::cout << "Directorios activados";
+ if (!dirs.empty())
+  std::cout << " (" << dirs.size() << " creados a partir de los nombres con '/')";
+ std::cout << ".\n";
  return true;
 }
 
-bool FileSystem::saveInodes()
+bool FileSystem::loadFreeBlockMap()
 {
- uint32_t startBlock = superBlock.inodeStart;
- uint32_t endBlock = startBlock + superBlock.inodeBlocks;
+ // Los bloques del mapa se leen en un solo lote directo al vector
+ freeBlockMap.assign(bitmapTable.size() * device.blockSize, 0);
+ ioBlocks = bitmapTable;
+ ioReadPtrs.clear();
+ for (std::size_t k = 0; k < bitmapTable.size(); k++)
+  ioReadPtrs.push_back(reinterpret_cast<char *>(freeBlockMap.data()) + k * device.blockSize);
+ return readBlocks(ioBlocks, ioReadPtrs);
+}
 
- uint32_t inodesWritten = 0;
+bool FileSystem::saveFreeBlockMap()
+{
+ ioBlocks = bitmapTable;
+ ioWritePtrs.clear();
+ for (std::size_t k = 0; k < bitmapTable.size(); k++)
+  ioWritePtrs.push_back(reinterpret_cast<const char *>(freeBlockMap.data()) + k * device.blockSize);
+ return writeBlocks(ioBlocks, ioWritePtrs);
+}
+
+// Se llama en cada allocateBlock/freeBlock, se escribe directo desde el mapa
+bool FileSystem::saveBitmapBlock(uint64_t blockNumber)
+{
+ std::size_t k = blockNumber / (device.blockSize * 8);
+ return writeBlock(bitmapTable[k], reinterpret_cast<const char *>(freeBlockMap.data()) + k * device.blockSize,
+                   device.blockSize);
+}
 
- for (uint32_t blk = startBlock; blk < endBlock; blk++)
+void FileSystem::markUsed(uint64_t blockNumber)
+{
+ freeBlockMap[blockNumber / 8] |= (1 << (blockNumber % 8));
+}
+
+bool FileSystem::loadInodes()
+{
+ // Leer todos los inodos de la tabla del formato y de las agregadas al crecer
+ uint32_t inodesRead = 0;
+
+ // Los bloques de inodos se leen en un solo lote (los de cada tabla son contiguos)
+ ioBuffer.resize(inodeTable.size() * device.blockSize);
+ ioBlocks = inodeTable;
+ ioReadPtrs.clear();
+ for (std::size_t b = 0; b < inodeTable.size(); b++)
+  ioReadPtrs.push_back(ioBuffer.data() + b * device.blockSize);
+ if (!readBlocks(ioBlocks, ioReadPtrs))
  {
-  std::vector<char> blockData(device.blockSize, 0);
-  for (uint32_t i = 0; i < inodesPerBlock && inodesWritten < inodes.size(); i++)
+  return false;
+ }
+
+ for (std::size_t b = 0; b < ioReadPtrs.size(); b++)
+ {
+  // En cada bloque hay up to inodesPerBlock inodos
+  for (std::size_t i = 0; i < inodesPerBlock && inodesRead < inodes.size(); i++)
   {
-   std::memcpy(blockData.data() + i * 136, &inodes[inodesWritten], 136);
-   inodesWritten++;
+   const char *raw = ioReadPtrs[b] + i * inodeSize;
+   Inode &inode = inodes[inodesRead++];
+   if (superBlock.version != 1)
+   {
+    std::memcpy(&inode, raw, sizeof(Inode));
+    continue;
+   }
+   // Formato 1: mismos campos con numeros de 32 bits
+   InodeV1 old;
+   std::memcpy(&old, raw, sizeof(old));
+   inode = Inode();
+   std::memcpy(inode.fileName, old.fileName, sizeof(inode.fileName));
+   inode.fileSize = old.fileSize;
+   std::copy(std::begin(old.dataBlocks), std::end(old.dataBlocks), inode.dataBlocks);
+   inode.free = old.free;
+   inode.crc = old.crc;
   }
-  if (!device.writeBlock(blk, blockData))
+ }
+ return true;
+}
+
+bool FileSystem::saveInodes()
+{
+ std::size_t dirty = std::count(inodeBlockDirty.begin(), inodeBlockDirty.end(), 1);
+ if (dirty == 0)
+  return true;
+
+ // Los bloques modificados se arman en memoria y se escriben en un solo lote
+ ioBuffer.assign(dirty * device.blockSize, 0);
+ ioBlocks.clear();
+ ioWritePtrs.clear();
+ for (std::size_t b = 0; b < inodeTable.size(); b++)
+ {
+  if (!inodeBlockDirty[b])
+   continue;
+  char *blockData = ioBuffer.data() + ioBlocks.size() * device.blockSize;
+  for (std::size_t i = 0; i < inodesPerBlock && b * inodesPerBlock + i < inodes.size(); i++)
   {
-   return false;
+   const Inode &inode = inodes[b * inodesPerBlock + i];
+   char *raw = blockData + i * inodeSize;
+   if (superBlock.version != 1)
+   {
+    std::memcpy(raw, &inode, sizeof(Inode));
+    continue;
+   }
+   InodeV1 old;
+   std::memset(&old, 0, sizeof(old));
+   std::memcpy(old.fileName, inode.fileName, sizeof(old.fileName));
+   old.fileSize = (uint32_t)inode.fileSize;
+   for (int k = 0; k < 8; k++)
+    old.dataBlocks[k] = (uint32_t)inode.dataBlocks[k];
+   old.free = inode.free;
+   old.crc = inode.crc;
+   std::memcpy(raw, &old, sizeof(old));
   }
+  ioBlocks.push_back(inodeTable[b]);
+  ioWritePtrs.push_back(blockData);
  }
+ if (!writeBlocks(ioBlocks, ioWritePtrs))
+  return false;
+ std::fill(inodeBlockDirty.begin(), inodeBlockDirty.end(), 0);
  return true;
 }
 
-uint32_t FileSystem::inodeBlockIndex(uint32_t i)
+// Toda la E/S del FS pasa por aqui: por la cache si esta activa, si no directo al dispositivo
+bool FileSystem::readBlock(std::size_t blockNumber, char *buffer)
+{
+ return cache ? cache->readBlock(blockNumber, buffer) : device.readBlock(blockNumber, buffer);
+}
+
+bool FileSystem::writeBlock(std::size_t blockNumber, const char *data, std::size_t size)
+{
+ if (readahead)
+  readahead->invalidate(blockNumber);
+ return cache ? cache->writeBlock(blockNumber, data, size) : device.writeBlock(blockNumber, data, size);
+}
+
+bool FileSystem::readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers)
+{
+ return cache ? cache->readBlocks(blockNumbers, buffers) : device.readBlocks(blockNumbers, buffers);
+}
+
+bool FileSystem::writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers)
+{
+ if (readahead)
+ {
+  for (auto blk : blockNumbers)
+   readahead->invalidate(blk);
+ }
+ return cache ? cache->writeBlocks(blockNumbers, buffers) : device.writeBlocks(blockNumbers, buffers);
+}
+
+std::size_t FileSystem::inodeBlockIndex(uint32_t i)
 {
- // i-th inode está en el bloque: inodeStart + (i/inodesPerBlock)
- return superBlock.inodeStart + (i / inodesPerBlock);
+ // i-th inode está en el bloque: inodeStart + (i/inodesPerBlock), o en una tabla agregada
+ return inodeTable[i / inodesPerBlock];
 }
 
-uint32_t FileSystem::inodeOffsetInBlock(uint32_t i)
+std::size_t FileSystem::inodeOffsetInBlock(uint32_t i)
 {
  // offset del inodo en el bloque
- return (i % inodesPerBlock) * 136;
+ return (i % inodesPerBlock) * inodeSize;
 }
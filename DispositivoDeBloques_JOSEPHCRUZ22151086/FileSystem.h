@@ -1,24 +1,81 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
-#include "BlockDevice.h"
+#include "IBlockDevice.h"
+#include "BlockCache.h"
+#include "ReadAhead.h"
 #include "SuperBlock.h"
 #include "Inode.h"
+#include "DirectoryTree.h"
 #include <vector>
+#include <functional>
 #include <string>
 #include <optional>
 #include <iostream>
+#include <memory>
+#include <unordered_map>
 
 class FileSystem
 {
 public:
- FileSystem(BlockDevice &device);
- bool format();
+ // cacheBlocks > 0 pone una cache write-back de ese tamaño entre el FS y el dispositivo
+ FileSystem(IBlockDevice &device, std::size_t cacheBlocks = 0);
+ ~FileSystem();
+ // version 2 (la predeterminada): bloques de 64 bits, mapa e inodos en rangos y tantos
+ // inodos como bloques/8 (hasta max_default_inodes); los archivos se guardan como rangos de
+ // bloques y no tienen limite de tamaño. version 1: el formato original (archivos de hasta 8
+ // bloques), para imagenes que tambien tiene que leer una version anterior del programa
+ bool format(uint32_t version = 2);
  bool load();
  bool save();
+ uint32_t formatVersion() const { return mounted ? superBlock.version : 0; }
+ bool hasDirectories() const { return (superBlock.features & SUPERBLOCK_FEATURE_DIRECTORIES) != 0; }
+ IBlockDevice &blockDevice() { return device; }
 
- // Comandos FS
- bool ls();
+ // Agranda el dispositivo y el FS montado hasta newBlockCount bloques. El mapa de bloques
+ // libres suma los bloques que necesite y se agrega una tabla de inodos en la misma proporcion
+ // de bloques por inodo que ya tenia el FS; ambos van al comienzo del espacio nuevo. El
+ // superblock se escribe al final, si algo falla antes el FS queda como estaba.
+ // Sin FS cargado solo crece el dispositivo.
+ bool grow(std::size_t newBlockCount);
+ std::size_t inodeCount() const { return inodes.size(); }
+
+ // Cache de bloques
+ void setCacheCapacity(std::size_t blocks);
+ const BlockCache *blockCache() const { return cache.get(); }
+ bool sync(); // escribe los bloques sucios y sincroniza el dispositivo
+ void invalidateCachedBlock(uint64_t blockNumber);
+
+ // Lectura anticipada de datos de archivos (0 la desactiva)
+ void setReadAhead(std::size_t maxWindow);
+ ReadAhead *readAhead() { return readahead.get(); }
+
+ // Los bloques de datos liberados se descartan en el dispositivo (hueco en el archivo del host)
+ void setDiscard(bool enabled) { discardFreed = enabled; }
+ bool discardEnabled() const { return discardFreed; }
+
+ // Deduplicacion: cada bloque de datos que se escribe se busca por su contenido (CRC32C y
+ // comparacion completa) y si ya existe el archivo apunta al bloque existente. Los bloques
+ // compartidos llevan un contador de referencias (se reconstruye desde los inodos al cargar)
+ // y se copian antes de sobrescribirlos, este o no activa la deduplicacion.
+ struct DedupStats
+ {
+  uint64_t hits = 0;        // bloques escritos que ya existian en otro bloque
+  uint64_t unchanged = 0;   // bloques que se iban a reescribir con el mismo contenido
+  uint64_t copies = 0;      // bloques compartidos que se copiaron para modificarlos
+  std::size_t sharedBlocks = 0; // bloques con mas de una referencia
+  std::size_t savedBlocks = 0;  // referencias que no ocupan un bloque propio
+ };
+ void setDedup(bool enabled);
+ bool dedupEnabled() const { return dedup; }
+ DedupStats dedupStats() const;
+
+ // Comandos FS. Con directorios los nombres son rutas separadas por '/' desde la raiz
+ // ("." y ".." incluidos); sin directorios, nombres planos de hasta 63 caracteres
+ bool ls(const std::string &dirname = "");
+ // Un FS en formato 2 de antes de los directorios los activa con el primer mkdir
+ bool mkdir(const std::string &dirname);
+ bool rmdir(const std::string &dirname); // solo vacios
  bool cat(const std::string &filename);
  bool writeFile(const std::string &filename, const std::string &data);
  bool hexdump(const std::string &filename);
@@ -27,33 +84,118 @@ public:
  bool rm(const std::string &filename);
 
  // Manejo directo del mapa
- std::optional<uint32_t> allocateBlock();
- void freeBlock(uint32_t blockNumber);
+ std::optional<uint64_t> allocateBlock();
+ // Hasta wanted bloques contiguos: el primer hueco donde entran todos, o si no hay, el mas
+ // grande que haya
+ std::optional<Extent> allocateRun(uint64_t wanted);
+ void freeBlock(uint64_t blockNumber);
 
 private:
- BlockDevice &device;
+ IBlockDevice &device;
+ std::unique_ptr<BlockCache> cache;
+ std::unique_ptr<ReadAhead> readahead;
+ bool discardFreed = true;
+ bool dedup = false;
+ bool mounted = false; // hay un FS formateado o cargado
  SuperBlock superBlock;
  std::vector<Inode> inodes;
- std::vector<uint8_t> freeBlockMap; // 256 bytes => 2048 bits = 2048 bloques
+ std::vector<uint8_t> freeBlockMap;   // todos los bloques del mapa seguidos, un bit por bloque
+ std::vector<std::size_t> bitmapTable; // bloque del dispositivo de cada bloque del mapa
+ std::vector<std::size_t> inodeTable;  // bloques de inodos en orden
+ std::vector<uint8_t> inodeBlockDirty; // por bloque de inodeTable, se escriben en save()
+ uint64_t allocHint = 0;               // no hay bloques de datos libres antes de este
 
- static constexpr uint32_t FREEBLOCKMAP_BLOCK = 1;
- // Inodos a partir del bloque 2
- // 37 bloques de inodos para 256 inodos a 7 inodos/bloque
+ // Indice de nombres: nombre -> inodo ocupado, se arma en load() y se mantiene al crear y
+ // borrar. Si la tabla tiene nombres repetidos (imagenes viejas, nombres de mas de 63
+ // caracteres que se truncan igual) el indice apunta al de menor numero, como la busqueda
+ // lineal que reemplaza.
+ std::unordered_map<std::string, uint32_t> nameIndex;
+ bool duplicateNames = false;
+ uint32_t freeInodeHint = 0; // no hay inodos libres antes de este
+
+ // Entradas de los directorios, con la E/S del FS
+ DirectoryTree dirTree;
+
+ // Formato 1:
+ // Bloque 0: SuperBlock, bloque 1: mapa, inodos a partir del bloque 2
+ // 37 bloques de inodos para 256 inodos a 7 inodos/bloque (con bloques de 1024)
  // inodos: 2..(2+37-1)=2..38
- // datos a partir de 39
+ // datos a partir de 39 (si el mapa necesita mas de un bloque, los demas van primero)
+ // Formato 2:
+ // Bloque 0: SuperBlock, luego todo el mapa, luego la tabla de inodos y los datos
+ static constexpr uint32_t FREEBLOCKMAP_BLOCK = 1;
+ static constexpr uint32_t V1_INODES = 256;
+ static constexpr uint64_t max_default_inodes = 1u << 20;
+
+ std::size_t inodeSize = sizeof(Inode); // en disco: sizeof(InodeV1) en el formato 1
+ std::size_t inodesPerBlock = 0;
+
+ // Buffers de E/S reutilizables para no reservar memoria en cada operacion
+ std::vector<char> ioBuffer;
+ std::vector<std::size_t> ioBlocks;
+ std::vector<char *> ioReadPtrs;
+ std::vector<const char *> ioWritePtrs;
+ std::vector<BlockView> ioViews;
 
- uint32_t inodesPerBlock;
- uint32_t blocksForInodes;
+ // Deduplicacion
+ std::unordered_map<uint64_t, uint32_t> sharedRefs;    // bloques con mas de una referencia -> referencias
+ std::unordered_map<uint32_t, uint64_t> dedupIndex;    // CRC32C del contenido -> bloque
+ std::unordered_map<uint64_t, uint32_t> blockHashes;   // bloque -> CRC32C con el que esta indexado
+ std::vector<char> dedupBuffer;
+ DedupStats dedupCounters;
 
  std::optional<uint32_t> findInodeByName(const std::string &filename);
+ std::optional<uint32_t> resolvePath(const std::vector<std::string> &parts);
+ // Directorio donde va la ruta y el nombre de la entrada; false con mensaje si no existe
+ bool resolveParent(const std::string &path, uint32_t &parent, std::string &leaf);
+ bool linkEntry(uint32_t dir, const std::string &name, uint32_t inode);
+ bool unlinkEntry(uint32_t dir, const std::string &name);
+ bool enableDirectories();
  std::optional<uint32_t> findFreeInode();
+ void rebuildNameIndex();
+ void indexName(uint32_t i);
+ void unindexName(uint32_t i);
+ // Recibe el contenido del archivo en orden, size bytes por llamada; false corta la lectura
+ using DataSink = std::function<bool(const char *data, std::size_t size)>;
+ // Lee el archivo rango por rango en tramos de hasta read_chunk_bytes, la memoria no depende
+ // del tamaño del archivo
+ bool readFileData(uint32_t inodeIndex, const DataSink &sink);
+ static constexpr std::size_t read_chunk_bytes = 1 << 20;
+ // Bloques de datos del archivo en orden logico; treeBlocks recibe los nodos de su arbol de rangos
+ bool fileBlocks(const Inode &inode, std::vector<uint64_t> &blocks, std::vector<uint64_t> *treeBlocks = nullptr);
+ // Lo mismo como rachas de bloques consecutivos, una por rango
+ bool fileRuns(const Inode &inode, std::vector<Extent> &runs, std::vector<uint64_t> *treeBlocks = nullptr);
+ bool collectExtents(const FileExtent *entries, std::size_t count, unsigned depth, std::vector<Extent> &runs,
+                     uint64_t &logical, std::vector<uint64_t> *treeBlocks);
+ // Guarda el mapa del archivo: en dataBlocks (formato 1) o como rangos, en el inodo si entran
+ // y si no en un arbol nuevo (los nodos del anterior los libera el que llama)
+ bool setFileBlocks(uint32_t i, const std::vector<uint64_t> &blocks);
+ bool readBlock(std::size_t blockNumber, char *buffer);
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size);
+ bool readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers);
+ bool writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers);
+ void releaseBlocks(const std::vector<std::size_t> &blockNumbers);
+ bool decodeSuperBlock(const char *raw);
+ bool saveSuperBlock();
+ bool fitsFormat(const SuperBlock &sb) const; // la geometria se puede guardar en su version
+ void setGeometry(const SuperBlock &sb);       // arma bitmapTable, inodeTable y los tamaños
  bool loadFreeBlockMap();
  bool saveFreeBlockMap();
+ bool saveBitmapBlock(uint64_t blockNumber); // solo el bloque del mapa con el bit de blockNumber
+ void markUsed(uint64_t blockNumber);
+ bool isUsed(uint64_t blockNumber) const { return freeBlockMap[blockNumber / 8] & (1 << (blockNumber % 8)); }
  bool loadInodes();
- bool saveInodes();
+ bool saveInodes(); // solo los bloques marcados en inodeBlockDirty
+ void markInodeDirty(uint32_t i) { inodeBlockDirty[i / inodesPerBlock] = 1; }
+ void rebuildBlockRefs();
+ bool rebuildDedupIndex();
+ std::vector<uint64_t> referencedBlocks(); // ordenados, con repetidos si son compartidos
+ std::optional<uint64_t> findDuplicate(uint32_t hash, const char *data);
+ void indexBlock(uint64_t blockNumber, uint32_t hash);
+ void forgetBlock(uint64_t blockNumber);
 
- uint32_t inodeBlockIndex(uint32_t i);
- uint32_t inodeOffsetInBlock(uint32_t i);
+ std::size_t inodeBlockIndex(uint32_t i);
+ std::size_t inodeOffsetInBlock(uint32_t i);
 };
 
 #endif // FILESYSTEM_H
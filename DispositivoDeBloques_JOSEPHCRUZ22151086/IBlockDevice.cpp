@@ -0,0 +1,32 @@
+#include "IBlockDevice.h"
+#include <iostream>
+
+bool IBlockDevice::readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+ {
+  std::cerr << "La cantidad de bloques y de buffers no coincide.\n";
+  return false;
+ }
+ for (std::size_t i = 0; i < blockNumbers.size(); i++)
+ {
+  if (!readBlock(blockNumbers[i], buffers[i]))
+   return false;
+ }
+ return true;
+}
+
+bool IBlockDevice::writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+ {
+  std::cerr << "La cantidad de bloques y de buffers no coincide.\n";
+  return false;
+ }
+ for (std::size_t i = 0; i < blockNumbers.size(); i++)
+ {
+  if (!writeBlock(blockNumbers[i], buffers[i], blockSize))
+   return false;
+ }
+ return true;
+}
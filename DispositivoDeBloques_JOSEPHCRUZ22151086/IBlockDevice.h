@@ -0,0 +1,80 @@
+#ifndef IBLOCKDEVICE_H
+#define IBLOCKDEVICE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Vista no propietaria de un bloque (equivalente minimo a std::span en C++17).
+// Solo es valida mientras el dispositivo siga abierto.
+struct BlockView
+{
+ const char *data = nullptr;
+ std::size_t size = 0;
+
+ bool empty() const { return data == nullptr || size == 0; }
+};
+
+// Interfaz comun de los dispositivos de bloques. FileSystem, BlockCache, ReadAhead y
+// AsyncBlockIO solo dependen de esta interfaz, asi el FS puede montarse sobre una imagen
+// en archivo (BlockDevice) o sobre memoria (RamBlockDevice) sin cambios.
+// Los metodos opcionales tienen una implementacion por defecto para dispositivos que no
+// los soportan.
+class IBlockDevice
+{
+public:
+ IBlockDevice() : blockCount(0), blockSize(0) {}
+ IBlockDevice(std::size_t blockCount, std::size_t blockSize) : blockCount(blockCount), blockSize(blockSize) {}
+ virtual ~IBlockDevice() = default;
+
+ IBlockDevice(const IBlockDevice &) = delete;
+ IBlockDevice &operator=(const IBlockDevice &) = delete;
+
+ // buffer de blockSize bytes; writeBlock acepta size <= blockSize y rellena con ceros
+ virtual bool readBlock(std::size_t blockNumber, char *buffer) = 0;
+ virtual bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) = 0;
+
+ // Por lotes: buffers[i] corresponde a blockNumbers[i]. Por defecto bloque por bloque
+ virtual bool readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers);
+ virtual bool writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers);
+
+ virtual bool flush() = 0;
+ virtual bool close() = 0;
+
+ // Descarte de bloques cuyo contenido ya no importa (se leen como ceros despues)
+ virtual bool discardBlocks(const std::vector<std::size_t> &) { return false; }
+ virtual bool supportsDiscard() const { return false; }
+
+ // Crecimiento en linea: agrega bloques al final, que se leen como ceros. Quien lo llama
+ // se asegura de que no haya E/S en curso
+ virtual bool grow(std::size_t) { return false; }
+ virtual bool supportsGrow() const { return false; }
+
+ // Acceso sin copia al contenido de un bloque; vacia si el dispositivo no lo permite
+ virtual BlockView blockView(std::size_t) const { return BlockView(); }
+ virtual bool providesViews() const { return false; }
+
+ // Para quien emite su propia E/S sobre el descriptor (AsyncBlockIO): -1 si no hay
+ // descriptor, y en ese caso se usan readBlock/writeBlock
+ virtual int nativeHandle() const { return -1; }
+ virtual std::size_t blockOffset(std::size_t blockNumber) const { return blockNumber * blockSize; }
+ // Alineacion que deben tener los buffers de E/S (1 = cualquiera)
+ virtual bool requiresAlignment() const { return false; }
+ virtual std::size_t bufferAlignment() const { return 1; }
+ // Quien hace E/S por el descriptor avisa al dispositivo para que mantenga sus sumas de
+ // verificacion: verifyBlock tras leer un bloque completo, blockWritten tras escribirlo
+ virtual bool verifyBlock(std::size_t, const char *) { return true; }
+ virtual void blockWritten(std::size_t, const char *) {}
+ // Y para que la cuente en sus estadisticas y su traza: count bloques desde first,
+ // startNanos es IoStats::now() al empezar. Tambien las lecturas hechas con blockView
+ virtual void recordRead(std::size_t, std::size_t, bool, uint64_t) {}
+ virtual void recordWrite(std::size_t, std::size_t, bool, uint64_t) {}
+
+ // Las capas que se montan sobre otro dispositivo (compresion, etc.) devuelven el de abajo
+ virtual IBlockDevice *underlying() { return nullptr; }
+
+ std::size_t blockCount;
+ std::size_t blockSize;
+};
+
+#endif // IBLOCKDEVICE_H
@@ -1,9 +1,56 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <cstddef>
 #include <cstdint>
 
+// Tipos de inodo. Un directorio guarda en fileSize la cantidad de entradas y en dataBlocks[0]
+// la raiz de su arbol de entradas (ver DirectoryTree.h), 0 si esta vacio. En las imagenes
+// anteriores a los directorios el campo estaba en cero: todos son archivos
+constexpr uint8_t INODE_FILE = 0;
+constexpr uint8_t INODE_DIRECTORY = 1;
+
+// Rango de bloques de un archivo: los bloques logicos logical..logical+count-1 estan en
+// start..start+count-1 del dispositivo y se leen con una sola operacion.
+// En los nodos internos del arbol de rangos start es el bloque hijo, logical el primer
+// bloque logico que cubre y count cuantos cubre.
+struct FileExtent
+{
+ uint64_t start;
+ uint32_t logical;
+ uint32_t count;
+};
+static_assert(sizeof(FileExtent) == 16, "El rango de un archivo mide 16 bytes");
+
+constexpr std::size_t INODE_EXTENTS_INLINE = 4;
+
+// Valores de Inode::flags
+constexpr uint8_t INODE_EXTENTS = 1; // el archivo usa extents en lugar de dataBlocks
+
+// Inodo en memoria, y tal cual en la tabla del formato 2
 struct Inode
+{
+ char fileName[64]; // 64 bytes
+ uint64_t fileSize; // 8 bytes
+ union              // 64 bytes
+ {
+  uint64_t dataBlocks[8];                     // bloques sueltos, 0 termina la lista
+  FileExtent extents[INODE_EXTENTS_INLINE];   // con INODE_EXTENTS, ver extentDepth
+ };
+ uint8_t free;        // 1 byte (1=libre,0=ocupado)
+ uint8_t type;        // 1 byte, INODE_FILE o INODE_DIRECTORY
+ uint8_t flags;       // 1 byte, INODE_EXTENTS
+ uint8_t extentDepth; // 1 byte: 0, extents son los rangos del archivo (count 0 = sin usar);
+                      // n > 0, apuntan a nodos de nivel n-1 del arbol (start 0 = sin usar)
+ uint32_t crc;        // 4 bytes
+ uint64_t parent;     // 8 bytes, directorio que lo contiene (la raiz es su propio padre)
+ char reserved[8];    // relleno hasta 160 bytes
+ // Total:64+8+64+1+1+1+1+4+8+8=160
+};
+static_assert(sizeof(Inode) == 160, "El inodo del formato 2 mide 160 bytes");
+
+// Inodo del formato 1 (el original), se traduce a Inode al cargar y guardar
+struct InodeV1
 {
  char fileName[64];      // 64 bytes
  uint32_t fileSize;      // 4 bytes
@@ -16,5 +63,19 @@ struct Inode
  // profesional y realista
  // Total:64+4+32+1+3+4+28=136
 };
+static_assert(sizeof(InodeV1) == 136, "El inodo del formato 1 mide 136 bytes");
+
+// Nodo del arbol de rangos de un archivo que no entra en el inodo: la cabecera y despues
+// count rangos ordenados por logical (hojas, nivel 0) o entradas hacia los hijos
+struct ExtentNodeHeader
+{
+ uint32_t magic;
+ uint16_t level;
+ uint16_t count;
+ uint64_t reserved;
+};
+static_assert(sizeof(ExtentNodeHeader) == 16, "La cabecera de un nodo de rangos mide 16 bytes");
+
+constexpr uint32_t EXTENT_NODE_MAGIC = 0x4E545845; // "EXTN"
 
 #endif // INODE_H
@@ -0,0 +1,197 @@
+#include "IoStats.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+std::size_t Histogram::bucketIndex(uint64_t value)
+{
+ if (value < sub_buckets)
+  return (std::size_t)value;
+ unsigned magnitude = 63 - (unsigned)__builtin_clzll(value);
+ if (magnitude >= max_magnitude)
+  return bucket_count - 1;
+ // Dentro de [2^magnitude, 2^(magnitude+1)) cuentan los sub_bits bits siguientes al mas alto
+ unsigned shift = magnitude - sub_bits;
+ return (std::size_t)((shift + 1) * sub_buckets + ((value >> shift) - sub_buckets));
+}
+
+uint64_t Histogram::bucketLow(std::size_t index)
+{
+ if (index < sub_buckets)
+  return index;
+ unsigned shift = (unsigned)(index / sub_buckets) - 1;
+ return (sub_buckets + index % sub_buckets) << shift;
+}
+
+uint64_t Histogram::bucketHigh(std::size_t index)
+{
+ if (index == bucket_count - 1)
+  return UINT64_MAX;
+ return bucketLow(index + 1) - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+ counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+ sum.fetch_add(value, std::memory_order_relaxed);
+
+ uint64_t seen = minimum.load(std::memory_order_relaxed);
+ while (value < seen && !minimum.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+  ;
+ seen = maximum.load(std::memory_order_relaxed);
+ while (value > seen && !maximum.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+  ;
+}
+
+Histogram::Summary Histogram::summary() const
+{
+ Summary s;
+ for (std::size_t i = 0; i < bucket_count; i++)
+ {
+  uint64_t n = counts[i].load(std::memory_order_relaxed);
+  if (n == 0)
+   continue;
+  s.buckets.push_back(Bucket{bucketLow(i), bucketHigh(i), n});
+  s.count += n;
+ }
+ if (s.count == 0)
+  return s;
+ s.sum = sum.load(std::memory_order_relaxed);
+ s.min = minimum.load(std::memory_order_relaxed);
+ s.max = maximum.load(std::memory_order_relaxed);
+ return s;
+}
+
+void Histogram::reset()
+{
+ for (auto &n : counts)
+  n.store(0, std::memory_order_relaxed);
+ sum.store(0, std::memory_order_relaxed);
+ minimum.store(UINT64_MAX, std::memory_order_relaxed);
+ maximum.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::Summary::percentile(double p) const
+{
+ if (count == 0)
+  return 0;
+ p = std::min(std::max(p, 0.0), 1.0);
+ uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(p * (double)count));
+ uint64_t seen = 0;
+ for (const Bucket &b : buckets)
+ {
+  seen += b.count;
+  // Se informa el tope de la cubeta, pero nunca mas que el maximo observado
+  if (seen >= target)
+   return std::max(min, std::min(b.high, max));
+ }
+ return max;
+}
+
+uint64_t IoStats::now()
+{
+ return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+     .count();
+}
+
+void IoStats::access(std::size_t firstBlock, std::size_t count)
+{
+ uint64_t previous = nextBlock.exchange(firstBlock + count, std::memory_order_relaxed);
+ if (previous == no_position)
+  return;
+ if (previous == firstBlock)
+ {
+  sequential.fetch_add(1, std::memory_order_relaxed);
+  return;
+ }
+ seeks.fetch_add(1, std::memory_order_relaxed);
+ seekDistance.record(previous > firstBlock ? previous - firstBlock : firstBlock - previous);
+}
+
+void IoStats::finish(Op op, bool ok, std::size_t blocks, std::size_t bytes, uint64_t startNanos)
+{
+ uint64_t end = now();
+ Counters &c = counters[(std::size_t)op];
+ c.calls.fetch_add(1, std::memory_order_relaxed);
+ if (!ok)
+  c.errors.fetch_add(1, std::memory_order_relaxed);
+ c.blocks.fetch_add(blocks, std::memory_order_relaxed);
+ c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+ c.latency.record(end > startNanos ? end - startNanos : 0);
+}
+
+void IoStats::record(Op op, bool ok, std::size_t firstBlock, std::size_t count, std::size_t bytes, uint64_t startNanos)
+{
+ if (count > 0 && (op == Op::Read || op == Op::Write))
+  access(firstBlock, count);
+ finish(op, ok, count, bytes, startNanos);
+}
+
+void IoStats::recordBatch(Op op, bool ok, const std::vector<std::size_t> &blockNumbers, std::size_t blockSize,
+                          uint64_t startNanos)
+{
+ if (op == Op::Read || op == Op::Write)
+ {
+  std::size_t i = 0;
+  while (i < blockNumbers.size())
+  {
+   std::size_t run = 1;
+   while (i + run < blockNumbers.size() && blockNumbers[i + run] == blockNumbers[i] + run)
+    run++;
+   access(blockNumbers[i], run);
+   i += run;
+  }
+ }
+ finish(op, ok, blockNumbers.size(), blockNumbers.size() * blockSize, startNanos);
+}
+
+IoStats::Summary IoStats::summary() const
+{
+ Summary s;
+ for (std::size_t i = 0; i < op_count; i++)
+ {
+  const Counters &c = counters[i];
+  s.ops[i].calls = c.calls.load(std::memory_order_relaxed);
+  s.ops[i].errors = c.errors.load(std::memory_order_relaxed);
+  s.ops[i].blocks = c.blocks.load(std::memory_order_relaxed);
+  s.ops[i].bytes = c.bytes.load(std::memory_order_relaxed);
+  s.ops[i].latency = c.latency.summary();
+ }
+ s.sequential = sequential.load(std::memory_order_relaxed);
+ s.seeks = seeks.load(std::memory_order_relaxed);
+ s.seekDistance = seekDistance.summary();
+ return s;
+}
+
+void IoStats::reset()
+{
+ for (Counters &c : counters)
+ {
+  c.calls.store(0, std::memory_order_relaxed);
+  c.errors.store(0, std::memory_order_relaxed);
+  c.blocks.store(0, std::memory_order_relaxed);
+  c.bytes.store(0, std::memory_order_relaxed);
+  c.latency.reset();
+ }
+ nextBlock.store(no_position, std::memory_order_relaxed);
+ sequential.store(0, std::memory_order_relaxed);
+ seeks.store(0, std::memory_order_relaxed);
+ seekDistance.reset();
+}
+
+const char *IoStats::opName(Op op)
+{
+ switch (op)
+ {
+ case Op::Read:
+  return "lecturas";
+ case Op::Write:
+  return "escrituras";
+ case Op::Flush:
+  return "flush";
+ case Op::Discard:
+  return "descartes";
+ }
+ return "";
+}
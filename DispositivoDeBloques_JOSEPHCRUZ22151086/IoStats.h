@@ -0,0 +1,134 @@
+#ifndef IOSTATS_H
+#define IOSTATS_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Histograma de valores enteros con cubetas al estilo HDR: los valores menores a
+// sub_buckets van uno por cubeta y cada potencia de dos siguiente se parte en sub_buckets
+// cubetas iguales, asi el error relativo queda por debajo de 1/sub_buckets (6%) en todo el
+// rango. Registrar es un calculo de indice y un par de sumas atomicas relajadas, varios
+// hilos pueden registrar a la vez sin lock.
+class Histogram
+{
+public:
+ // Los valores desde 2^max_magnitude caen en la ultima cubeta
+ static constexpr unsigned sub_bits = 4;
+ static constexpr uint64_t sub_buckets = 1u << sub_bits;
+ static constexpr unsigned max_magnitude = 40;
+ static constexpr std::size_t bucket_count = (max_magnitude - sub_bits + 1) * sub_buckets;
+
+ struct Bucket
+ {
+  uint64_t low = 0;  // rango de valores que cubre, inclusivo
+  uint64_t high = 0;
+  uint64_t count = 0;
+ };
+
+ // Copia para consultas (percentiles, cubetas no vacias). Si se registra mientras se copia
+ // puede no incluir las ultimas muestras, pero count siempre es la suma de las cubetas
+ struct Summary
+ {
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t min = 0;
+  uint64_t max = 0;
+  std::vector<Bucket> buckets; // solo las no vacias, en orden
+
+  uint64_t mean() const { return count ? sum / count : 0; }
+  // Valor bajo el cual queda la fraccion p (0..1) de las muestras, con la precision de la cubeta
+  uint64_t percentile(double p) const;
+ };
+
+ void record(uint64_t value);
+ Summary summary() const;
+ void reset();
+
+ static std::size_t bucketIndex(uint64_t value);
+ static uint64_t bucketLow(std::size_t index);
+ static uint64_t bucketHigh(std::size_t index);
+
+private:
+ std::array<std::atomic<uint64_t>, bucket_count> counts{};
+ std::atomic<uint64_t> sum{0};
+ std::atomic<uint64_t> minimum{UINT64_MAX};
+ std::atomic<uint64_t> maximum{0};
+};
+
+// Instrumentacion de un dispositivo: cantidad de operaciones, bloques y bytes por tipo,
+// latencia de cada llamada en nanosegundos y distancia de busqueda (en bloques) entre el
+// final de un acceso y el principio del siguiente. Con varios hilos la distancia se mide
+// contra el ultimo acceso que termino, es una aproximacion del patron que ve el host.
+class IoStats
+{
+public:
+ enum class Op
+ {
+  Read,
+  Write,
+  Flush,
+  Discard
+ };
+ static constexpr std::size_t op_count = 4;
+
+ struct OpSummary
+ {
+  uint64_t calls = 0;
+  uint64_t errors = 0;
+  uint64_t blocks = 0;
+  uint64_t bytes = 0;
+  Histogram::Summary latency; // ns por llamada
+ };
+
+ struct Summary
+ {
+  OpSummary ops[op_count];
+  uint64_t sequential = 0;   // accesos que empiezan donde termino el anterior
+  uint64_t seeks = 0;        // accesos que no
+  Histogram::Summary seekDistance; // solo los que no son secuenciales
+
+  const OpSummary &op(Op which) const { return ops[(std::size_t)which]; }
+ };
+
+ // Reloj de las mediciones, en ns
+ static uint64_t now();
+
+ // Llamada completa de tipo op sobre count bloques; startNanos es lo que devolvio now()
+ // antes de empezar. Read y Write anotan la busqueda desde el ultimo acceso.
+ void record(Op op, bool ok, std::size_t firstBlock, std::size_t count, std::size_t bytes, uint64_t startNanos);
+ // Lotes: una sola llamada con varias rachas de bloques consecutivos, se anota la busqueda
+ // al principio de cada racha en el orden en que llegan los bloques
+ void recordBatch(Op op, bool ok, const std::vector<std::size_t> &blockNumbers, std::size_t blockSize,
+                  uint64_t startNanos);
+
+ Summary summary() const;
+ void reset();
+
+ static const char *opName(Op op);
+
+private:
+ struct Counters
+ {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> errors{0};
+  std::atomic<uint64_t> blocks{0};
+  std::atomic<uint64_t> bytes{0};
+  Histogram latency;
+ };
+
+ static constexpr uint64_t no_position = UINT64_MAX;
+
+ Counters counters[op_count];
+ std::atomic<uint64_t> nextBlock{no_position}; // bloque siguiente al ultimo acceso
+ std::atomic<uint64_t> sequential{0};
+ std::atomic<uint64_t> seeks{0};
+ Histogram seekDistance;
+
+ void access(std::size_t firstBlock, std::size_t count);
+ void finish(Op op, bool ok, std::size_t blocks, std::size_t bytes, uint64_t startNanos);
+};
+
+#endif // IOSTATS_H
@@ -0,0 +1,230 @@
+#include "Lz4Codec.h"
+#include <cstdint>
+#include <cstring>
+
+namespace
+{
+ constexpr std::size_t min_match = 4;
+ constexpr std::size_t last_literals = 5; // los ultimos bytes siempre van como literales
+ constexpr std::size_t mf_limit = 12;     // un match no puede empezar en los ultimos 12 bytes
+ constexpr std::size_t max_distance = 65535;
+ constexpr unsigned max_hash_bits = 12;
+
+ inline uint32_t read32(const unsigned char *p)
+ {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+ }
+
+ inline uint32_t hashOf(uint32_t v, unsigned bits)
+ {
+  return (v * 2654435761u) >> (32 - bits);
+ }
+
+ // Largo extendido: bytes de 255 y un ultimo byte con el resto
+ inline bool writeLength(unsigned char *&op, const unsigned char *oend, std::size_t len)
+ {
+  while (len >= 255)
+  {
+   if (op >= oend)
+    return false;
+   *op++ = 255;
+   len -= 255;
+  }
+  if (op >= oend)
+   return false;
+  *op++ = (unsigned char)len;
+  return true;
+ }
+
+ inline bool readLength(const unsigned char *&ip, const unsigned char *iend, std::size_t &len)
+ {
+  unsigned char b;
+  do
+  {
+   if (ip >= iend)
+    return false;
+   b = *ip++;
+   len += b;
+  } while (b == 255);
+  return true;
+ }
+
+ // Secuencia: token, largo extra de literales, literales y (si matchLength > 0) offset y largo extra del match
+ bool emit(unsigned char *&op, const unsigned char *oend, const unsigned char *literals, std::size_t literalLength,
+           std::size_t offset, std::size_t matchLength)
+ {
+  if (op >= oend)
+   return false;
+  unsigned char *token = op++;
+  *token = (unsigned char)((literalLength >= 15 ? 15 : literalLength) << 4);
+  if (literalLength >= 15 && !writeLength(op, oend, literalLength - 15))
+   return false;
+  if ((std::size_t)(oend - op) < literalLength)
+   return false;
+  if (literalLength > 0)
+   std::memcpy(op, literals, literalLength);
+  op += literalLength;
+
+  if (matchLength == 0)
+   return true;
+
+  if (oend - op < 2)
+   return false;
+  *op++ = (unsigned char)(offset & 0xFF);
+  *op++ = (unsigned char)(offset >> 8);
+  std::size_t ml = matchLength - min_match;
+  *token |= (unsigned char)(ml >= 15 ? 15 : ml);
+  if (ml >= 15 && !writeLength(op, oend, ml - 15))
+   return false;
+  return true;
+ }
+}
+
+std::size_t lz4Compress(const char *source, std::size_t length, char *dest, std::size_t capacity)
+{
+ const unsigned char *src = reinterpret_cast<const unsigned char *>(source);
+ unsigned char *op = reinterpret_cast<unsigned char *>(dest);
+ const unsigned char *oend = op + capacity;
+ std::size_t anchor = 0;
+
+ if (length > mf_limit)
+ {
+  // Tabla mas chica para bloques chicos: limpiarla cuesta mas que comprimir
+  unsigned bits = length <= 4096 ? 10 : max_hash_bits;
+  uint32_t table[1u << max_hash_bits];
+  std::memset(table, 0, sizeof(uint32_t) << bits);
+
+  const std::size_t limit = length - mf_limit;
+  const std::size_t matchEnd = length - last_literals;
+  std::size_t ip = 1;
+  table[hashOf(read32(src), bits)] = 0;
+
+  while (ip < limit)
+  {
+   uint32_t seq = read32(src + ip);
+   uint32_t h = hashOf(seq, bits);
+   std::size_t ref = table[h];
+   table[h] = (uint32_t)ip;
+   if (ip - ref > max_distance || read32(src + ref) != seq)
+   {
+    // Cuanto mas tiempo sin encontrar coincidencias, mas rapido se avanza
+    ip += 1 + ((ip - anchor) >> 6);
+    continue;
+   }
+
+   while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+   {
+    ip--;
+    ref--;
+   }
+
+   std::size_t len = min_match;
+   while (ip + len + 8 <= matchEnd)
+   {
+    uint64_t a, b;
+    std::memcpy(&a, src + ip + len, 8);
+    std::memcpy(&b, src + ref + len, 8);
+    if (a != b)
+    {
+     len += (std::size_t)__builtin_ctzll(a ^ b) / 8;
+     goto matched;
+    }
+    len += 8;
+   }
+   while (ip + len < matchEnd && src[ip + len] == src[ref + len])
+    len++;
+  matched:
+   if (!emit(op, oend, src + anchor, ip - anchor, ip - ref, len))
+    return 0;
+   ip += len;
+   anchor = ip;
+   if (ip < limit)
+    table[hashOf(read32(src + ip - 2), bits)] = (uint32_t)(ip - 2);
+  }
+ }
+
+ if (!emit(op, oend, src + anchor, length - anchor, 0, 0))
+  return 0;
+ return (std::size_t)(op - reinterpret_cast<unsigned char *>(dest));
+}
+
+bool lz4Decompress(const char *source, std::size_t length, char *dest, std::size_t size)
+{
+ const unsigned char *ip = reinterpret_cast<const unsigned char *>(source);
+ const unsigned char *iend = ip + length;
+ unsigned char *op = reinterpret_cast<unsigned char *>(dest);
+ unsigned char *const ostart = op;
+ unsigned char *const oend = op + size;
+
+ while (true)
+ {
+  if (ip >= iend)
+   return false;
+  unsigned token = *ip++;
+
+  std::size_t literalLength = token >> 4;
+  if (literalLength == 15 && !readLength(ip, iend, literalLength))
+   return false;
+  if (literalLength > (std::size_t)(iend - ip) || literalLength > (std::size_t)(oend - op))
+   return false;
+  // Literales cortos con margen en ambos buffers: una copia fija de 16 bytes
+  if (literalLength <= 16 && iend - ip >= 16 && oend - op >= 16)
+   std::memcpy(op, ip, 16);
+  else if (literalLength > 0)
+   std::memcpy(op, ip, literalLength);
+  op += literalLength;
+  ip += literalLength;
+
+  // La ultima secuencia solo tiene literales
+  if (ip == iend)
+   break;
+
+  if (iend - ip < 2)
+   return false;
+  std::size_t offset = (std::size_t)ip[0] | ((std::size_t)ip[1] << 8);
+  ip += 2;
+  if (offset == 0 || offset > (std::size_t)(op - ostart))
+   return false;
+
+  std::size_t matchLength = token & 15;
+  if (matchLength == 15 && !readLength(ip, iend, matchLength))
+   return false;
+  matchLength += min_match;
+  if (matchLength > (std::size_t)(oend - op))
+   return false;
+
+  const unsigned char *match = op - offset;
+  unsigned char *copyEnd = op + matchLength;
+  if ((std::size_t)(oend - copyEnd) < 8)
+  {
+   // Cerca del final no se puede escribir de mas
+   while (op < copyEnd)
+    *op++ = *match++;
+   continue;
+  }
+
+  if (offset < 8)
+  {
+   // Patron corto: se replica byte a byte hasta que la distancia sea de al menos 8
+   // (un multiplo del periodo) y desde ahi se copia de a 8 bytes
+   std::size_t period = offset * ((8 + offset - 1) / offset);
+   std::size_t k = 0;
+   for (; k < period && op < copyEnd; k++)
+    *op++ = *match++;
+   if (k == period)
+    match = op - period;
+  }
+  // Cada copia de 8 bytes lee datos ya escritos; puede pasarse de copyEnd, esos bytes
+  // se sobrescriben despues (hay al menos 8 de margen)
+  while (op < copyEnd)
+  {
+   std::memcpy(op, match, 8);
+   op += 8;
+   match += 8;
+  }
+  op = copyEnd;
+ }
+ return op == oend;
+}
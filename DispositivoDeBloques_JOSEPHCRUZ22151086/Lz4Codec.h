@@ -0,0 +1,16 @@
+#ifndef LZ4CODEC_H
+#define LZ4CODEC_H
+
+#include <cstddef>
+
+// Compresor LZ77 con el formato de bloque de LZ4 (token, literales, offset de 2 bytes).
+// Pensado para bloques chicos: una sola pasada con tabla hash, sin diccionario entre bloques.
+
+// Devuelve el tamaño comprimido, o 0 si el resultado no cabe en capacity bytes
+std::size_t lz4Compress(const char *source, std::size_t length, char *dest, std::size_t capacity);
+
+// Descomprime exactamente size bytes en dest. Devuelve false si los datos estan corruptos
+// (nunca lee ni escribe fuera de los buffers)
+bool lz4Decompress(const char *source, std::size_t length, char *dest, std::size_t size);
+
+#endif // LZ4CODEC_H
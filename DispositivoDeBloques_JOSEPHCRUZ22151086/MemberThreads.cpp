@@ -0,0 +1,100 @@
+#include "MemberThreads.h"
+
+MemberThreads::~MemberThreads()
+{
+ stop();
+}
+
+void MemberThreads::start(std::size_t members)
+{
+ stop();
+ stopping = false;
+ workers = std::vector<Worker>(members);
+ for (std::size_t i = 0; i < workers.size(); i++)
+  workers[i].thread = std::thread(&MemberThreads::workerLoop, this, i);
+}
+
+void MemberThreads::stop()
+{
+ {
+  std::lock_guard<std::mutex> lock(workMutex);
+  stopping = true;
+ }
+ workReady.notify_all();
+ for (auto &w : workers)
+ {
+  if (w.thread.joinable())
+   w.thread.join();
+ }
+ workers.clear();
+}
+
+void MemberThreads::workerLoop(std::size_t index)
+{
+ std::unique_lock<std::mutex> lock(workMutex);
+ while (true)
+ {
+  workReady.wait(lock, [&]
+                 { return stopping || workers[index].pending; });
+  if (!workers[index].pending)
+   return;
+
+  const Job &job = *current;
+  lock.unlock();
+  bool ok = job(index);
+  lock.lock();
+  workers[index].result = ok;
+  workers[index].pending = false;
+  if (--outstanding == 0)
+   workDone.notify_all();
+ }
+}
+
+bool MemberThreads::run(const std::vector<std::size_t> &involved, const Job &job, std::vector<bool> *results)
+{
+ std::lock_guard<std::mutex> runLock(runMutex);
+ if (results)
+  results->assign(involved.size(), true);
+ if (involved.empty())
+  return true;
+
+ // Sin hilos (o con un solo miembro) no vale la pena despertar a nadie
+ if (involved.size() == 1 || workers.empty())
+ {
+  bool ok = true;
+  for (std::size_t k = 0; k < involved.size(); k++)
+  {
+   bool r = job(involved[k]);
+   if (results)
+    (*results)[k] = r;
+   ok = r && ok;
+  }
+  return ok;
+ }
+
+ {
+  std::lock_guard<std::mutex> lock(workMutex);
+  current = &job;
+  for (std::size_t k = 1; k < involved.size(); k++)
+   workers[involved[k]].pending = true;
+  outstanding = involved.size() - 1;
+ }
+ workReady.notify_all();
+
+ bool ok = job(involved[0]);
+ if (results)
+  (*results)[0] = ok;
+
+ std::unique_lock<std::mutex> lock(workMutex);
+ workDone.wait(lock, [&]
+               { return outstanding == 0; });
+ for (std::size_t k = 1; k < involved.size(); k++)
+ {
+  bool r = workers[involved[k]].result;
+  if (results)
+   (*results)[k] = r;
+  ok = r && ok;
+ }
+ current = nullptr;
+ return ok;
+}
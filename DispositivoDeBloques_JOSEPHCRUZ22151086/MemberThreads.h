@@ -0,0 +1,54 @@
+#ifndef MEMBERTHREADS_H
+#define MEMBERTHREADS_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Un hilo por miembro de un arreglo de dispositivos (franjas, espejo) para que la E/S de
+// todos los miembros ocurra al mismo tiempo. run() reparte un trabajo entre los miembros
+// indicados: el hilo llamador atiende el primero y los hilos de los demas el resto, y
+// vuelve cuando terminaron todos. Solo se ejecuta un run() a la vez.
+class MemberThreads
+{
+public:
+ // Trabajo de un miembro; devuelve false si fallo
+ using Job = std::function<bool(std::size_t member)>;
+
+ MemberThreads() {}
+ ~MemberThreads();
+
+ MemberThreads(const MemberThreads &) = delete;
+ MemberThreads &operator=(const MemberThreads &) = delete;
+
+ void start(std::size_t members);
+ void stop();
+ bool running() const { return !workers.empty(); }
+
+ // results (opcional) recibe el resultado de cada miembro, en el orden de involved
+ bool run(const std::vector<std::size_t> &involved, const Job &job, std::vector<bool> *results = nullptr);
+
+private:
+ struct Worker
+ {
+  std::thread thread;
+  bool pending = false;
+  bool result = true;
+ };
+
+ std::mutex runMutex;
+ std::vector<Worker> workers;
+ std::mutex workMutex;
+ std::condition_variable workReady;
+ std::condition_variable workDone;
+ const Job *current = nullptr;
+ std::size_t outstanding = 0;
+ bool stopping = false;
+
+ void workerLoop(std::size_t index);
+};
+
+#endif // MEMBERTHREADS_H
@@ -0,0 +1,780 @@
+#include "MirroredBlockDevice.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+// Cabecera en el bloque 0 de cada miembro; el mapa de regiones sucias sigue en los bloques 1..bitmapBlocks
+struct MirrorHeader
+{
+ uint64_t magic;
+ uint64_t arrayId;     // igual en todos los miembros del mismo espejo
+ uint64_t events;      // el miembro con el mayor valor es el que esta al dia
+ uint32_t memberIndex; // posicion de este miembro en el arreglo
+ uint32_t memberCount;
+ uint64_t regionBlocks;
+ uint64_t blockSize;
+ uint64_t bitmapBlocks;
+};
+
+MirroredBlockDevice::MirroredBlockDevice(std::vector<std::unique_ptr<IBlockDevice>> memberDevices)
+    : members(std::move(memberDevices)), state(new MemberState[members.size()])
+{
+ blockSize = members.empty() ? 0 : members[0]->blockSize;
+ memberBlocks.resize(members.size());
+ memberReads.resize(members.size());
+}
+
+MirroredBlockDevice::~MirroredBlockDevice()
+{
+ if (opened)
+  close();
+}
+
+bool MirroredBlockDevice::isMirrored(IBlockDevice &device)
+{
+ if (device.blockSize < sizeof(MirrorHeader) || device.blockCount == 0)
+  return false;
+ std::vector<char> raw(device.blockSize);
+ if (!device.readBlock(0, raw.data()))
+  return false;
+ MirrorHeader header;
+ std::memcpy(&header, raw.data(), sizeof(header));
+ return header.magic == header_magic;
+}
+
+// Capacidad: la del miembro mas chico menos la cabecera y el mapa
+bool MirroredBlockDevice::setGeometry(std::size_t regions, std::size_t bitmap)
+{
+ if (members.size() < 2 || regions == 0)
+ {
+  std::cerr << "Un espejo necesita al menos 2 miembros y regiones de al menos un bloque.\n";
+  return false;
+ }
+ std::size_t smallest = SIZE_MAX;
+ for (auto &m : members)
+ {
+  if (m->blockSize != blockSize || m->blockSize < sizeof(MirrorHeader))
+  {
+   std::cerr << "Todos los miembros deben tener el mismo tamaño de bloque.\n";
+   return false;
+  }
+  smallest = std::min(smallest, m->blockCount);
+ }
+ regionBlocks = regions;
+ bitmapBlocks = bitmap;
+ dataStart = 1 + bitmapBlocks;
+ if (smallest <= dataStart)
+ {
+  std::cerr << "Los miembros son demasiado chicos para el espejo.\n";
+  return false;
+ }
+ blockCount = smallest - dataStart;
+ std::size_t regionCount = (blockCount + regionBlocks - 1) / regionBlocks;
+ if ((regionCount + 7) / 8 > bitmapBlocks * blockSize)
+ {
+  std::cerr << "El mapa de regiones del espejo no alcanza para los miembros.\n";
+  return false;
+ }
+ dirtyMap.assign(bitmapBlocks * blockSize, 0);
+ return true;
+}
+
+bool MirroredBlockDevice::writeHeader(std::size_t index)
+{
+ MirrorHeader header{};
+ header.magic = header_magic;
+ header.arrayId = arrayId;
+ header.events = events;
+ header.memberIndex = (uint32_t)index;
+ header.memberCount = (uint32_t)members.size();
+ header.regionBlocks = regionBlocks;
+ header.blockSize = blockSize;
+ header.bitmapBlocks = bitmapBlocks;
+ return members[index]->writeBlock(0, reinterpret_cast<const char *>(&header), sizeof(header)) && members[index]->flush();
+}
+
+bool MirroredBlockDevice::create(std::size_t regions)
+{
+ if (members.empty() || regions == 0)
+  return false;
+
+ // El mapa se dimensiona con la capacidad sin descontarlo, alcanza de sobra
+ std::size_t smallest = SIZE_MAX;
+ for (auto &m : members)
+  smallest = std::min(smallest, m->blockCount);
+ std::size_t regionCount = smallest > 1 ? (smallest - 1 + regions - 1) / regions : 1;
+ std::size_t bitmap = blockSize > 0 ? ((regionCount + 7) / 8 + blockSize - 1) / blockSize : 0;
+ if (!setGeometry(regions, bitmap))
+  return false;
+
+ arrayId = ((uint64_t)std::random_device{}() << 32) | std::random_device{}();
+ events = 1;
+ source = 0;
+ std::vector<char> zeros(blockSize, 0);
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  bool ok = true;
+  for (std::size_t b = 0; b < bitmapBlocks && ok; b++)
+   ok = members[i]->writeBlock(1 + b, zeros.data(), blockSize);
+  if (!ok || !writeHeader(i))
+  {
+   std::cerr << "Error escribiendo la cabecera del miembro " << i << ".\n";
+   return false;
+  }
+ }
+
+ threads.start(members.size());
+ opened = true;
+ return true;
+}
+
+bool MirroredBlockDevice::open()
+{
+ if (members.empty() || blockSize < sizeof(MirrorHeader))
+  return false;
+
+ std::vector<MirrorHeader> headers(members.size());
+ std::vector<char> raw(blockSize);
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (members[i]->blockSize != blockSize || !members[i]->readBlock(0, raw.data()))
+  {
+   std::cerr << "Error leyendo la cabecera del miembro " << i << ".\n";
+   return false;
+  }
+  std::memcpy(&headers[i], raw.data(), sizeof(MirrorHeader));
+  if (headers[i].magic != header_magic)
+  {
+   std::cerr << "El miembro " << i << " no pertenece a un espejo.\n";
+   return false;
+  }
+ }
+
+ // Todos del mismo espejo, con la misma geometria, y cada posicion una sola vez
+ std::vector<std::unique_ptr<IBlockDevice>> ordered(members.size());
+ std::vector<uint64_t> memberEvents(members.size());
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  const MirrorHeader &h = headers[i];
+  if (h.arrayId != headers[0].arrayId || h.memberCount != members.size() || h.regionBlocks != headers[0].regionBlocks ||
+      h.bitmapBlocks != headers[0].bitmapBlocks || h.blockSize != blockSize || h.memberIndex >= members.size() ||
+      ordered[h.memberIndex])
+  {
+   std::cerr << "Los miembros no forman un espejo completo (" << headers[0].memberCount << " miembros esperados).\n";
+   return false;
+  }
+  ordered[h.memberIndex] = std::move(members[i]);
+  memberEvents[h.memberIndex] = h.events;
+ }
+ members = std::move(ordered);
+
+ if (!setGeometry((std::size_t)headers[0].regionBlocks, (std::size_t)headers[0].bitmapBlocks))
+  return false;
+ arrayId = headers[0].arrayId;
+ events = *std::max_element(memberEvents.begin(), memberEvents.end());
+ source = (std::size_t)(std::find(memberEvents.begin(), memberEvents.end(), events) - memberEvents.begin());
+
+ // Se une el mapa de todos los miembros: una region marcada en cualquiera puede diferir
+ std::vector<char> bitmap(bitmapBlocks * blockSize);
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  for (std::size_t b = 0; b < bitmapBlocks; b++)
+  {
+   if (!members[i]->readBlock(1 + b, bitmap.data() + b * blockSize))
+   {
+    std::cerr << "Error leyendo el mapa de regiones del miembro " << i << ".\n";
+    return false;
+   }
+  }
+  for (std::size_t k = 0; k < dirtyMap.size(); k++)
+   dirtyMap[k] |= (uint8_t)bitmap[k];
+ }
+ bool dirty = dirtyRegions() > 0;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  state[i].failed = false;
+  // Tras una caida no se sabe que miembro llego a escribir, manda el de origen
+  state[i].stale = i != source && (dirty || memberEvents[i] < events);
+ }
+
+ threads.start(members.size());
+ opened = true;
+ return true;
+}
+
+bool MirroredBlockDevice::close()
+{
+ if (!opened)
+  return false;
+ bool ok = flush();
+ threads.stop();
+ for (auto &m : members)
+  ok = m->close() && ok;
+ opened = false;
+ return ok;
+}
+
+std::size_t MirroredBlockDevice::liveMembers() const
+{
+ std::size_t live = 0;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (!state[i].failed)
+   live++;
+ }
+ return live;
+}
+
+std::size_t MirroredBlockDevice::dirtyRegions() const
+{
+ std::lock_guard<std::mutex> lock(stateMutex);
+ std::size_t count = 0;
+ for (uint8_t byte : dirtyMap)
+  count += (std::size_t)__builtin_popcount(byte);
+ return count;
+}
+
+MirroredBlockDevice::MemberStats MirroredBlockDevice::memberStats(std::size_t index) const
+{
+ std::lock_guard<std::mutex> lock(stateMutex);
+ MemberStats st;
+ st.reads = state[index].reads.load();
+ st.writes = state[index].writes.load();
+ st.failed = state[index].failed;
+ st.stale = state[index].stale;
+ return st;
+}
+
+// Escribe los bloques del mapa que contienen los bytes [firstByte, lastByte] en los miembros
+// vivos y los sincroniza. Con stateMutex tomado.
+bool MirroredBlockDevice::writeBitmap(std::size_t firstByte, std::size_t lastByte)
+{
+ bool anyOk = false;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (state[i].failed)
+   continue;
+  bool ok = true;
+  for (std::size_t b = firstByte / blockSize; b <= lastByte / blockSize && ok; b++)
+   ok = members[i]->writeBlock(1 + b, reinterpret_cast<const char *>(dirtyMap.data()) + b * blockSize, blockSize);
+  if (ok && members[i]->flush())
+   anyOk = true;
+  else
+   failMember(i);
+ }
+ return anyOk;
+}
+
+// Marca las regiones de los bloques antes de escribirlos; solo hay E/S si alguna region
+// estaba limpia
+bool MirroredBlockDevice::markDirty(const std::vector<std::size_t> &blockNumbers)
+{
+ std::lock_guard<std::mutex> lock(stateMutex);
+ std::size_t firstByte = SIZE_MAX, lastByte = 0;
+ for (auto blk : blockNumbers)
+ {
+  std::size_t region = blk / regionBlocks;
+  if (isDirty(region))
+   continue;
+  dirtyMap[region / 8] |= (uint8_t)(1u << (region % 8));
+  firstByte = std::min(firstByte, region / 8);
+  lastByte = std::max(lastByte, region / 8);
+ }
+ if (firstByte == SIZE_MAX)
+  return true;
+ if (!writeBitmap(firstByte, lastByte))
+ {
+  std::cerr << "Error escribiendo el mapa de regiones del espejo.\n";
+  return false;
+ }
+ return true;
+}
+
+void MirroredBlockDevice::markFailed(std::size_t index)
+{
+ std::lock_guard<std::mutex> lock(stateMutex);
+ failMember(index);
+}
+
+// El miembro queda fuera del arreglo; los demas registran el cambio con un evento nuevo
+// para que al reabrir se sepa cual quedo desactualizado
+void MirroredBlockDevice::failMember(std::size_t index)
+{
+ if (state[index].failed)
+  return;
+ state[index].failed = true;
+ std::cerr << "El miembro " << index << " del espejo falló y quedó fuera del arreglo.\n";
+ if (index == source)
+ {
+  // El nuevo origen es cualquier miembro vivo que no tenga datos viejos
+  for (std::size_t i = 0; i < members.size(); i++)
+  {
+   if (!state[i].failed && !state[i].stale)
+   {
+    source = i;
+    break;
+   }
+  }
+ }
+ events++;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (!state[i].failed && !writeHeader(i))
+   std::cerr << "Error actualizando la cabecera del miembro " << i << ".\n";
+ }
+}
+
+bool MirroredBlockDevice::usable(std::size_t index, std::size_t blockNumber) const
+{
+ const MemberState &st = state[index];
+ return !st.failed && (!st.stale || !isDirty(blockNumber / regionBlocks));
+}
+
+// Miembro con menos lecturas en curso; a igualdad, el que leyo por ultimo mas cerca
+std::size_t MirroredBlockDevice::chooseMember(std::size_t blockNumber) const
+{
+ std::lock_guard<std::mutex> lock(stateMutex);
+ std::size_t best = SIZE_MAX;
+ unsigned bestLoad = 0;
+ std::size_t bestDistance = 0;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (!usable(i, blockNumber))
+   continue;
+  unsigned load = state[i].inFlight.load();
+  std::size_t last = state[i].lastBlock.load();
+  std::size_t distance = last > blockNumber ? last - blockNumber : blockNumber - last;
+  if (best == SIZE_MAX || load < bestLoad || (load == bestLoad && distance < bestDistance))
+  {
+   best = i;
+   bestLoad = load;
+   bestDistance = distance;
+  }
+ }
+ return best;
+}
+
+bool MirroredBlockDevice::readFrom(std::size_t index, std::size_t blockNumber, char *buffer)
+{
+ MemberState &st = state[index];
+ st.inFlight++;
+ st.lastBlock = blockNumber;
+ st.reads++;
+ bool ok = members[index]->readBlock(dataStart + blockNumber, buffer);
+ st.inFlight--;
+ return ok;
+}
+
+bool MirroredBlockDevice::readBlock(std::size_t blockNumber, char *buffer)
+{
+ if (blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque fuera de rango.\n";
+  return false;
+ }
+ // Si el miembro elegido falla se reintenta en otro
+ while (true)
+ {
+  std::size_t index = chooseMember(blockNumber);
+  if (index == SIZE_MAX)
+  {
+   std::cerr << "Ningún miembro del espejo tiene el bloque " << blockNumber << " al día.\n";
+   return false;
+  }
+  if (readFrom(index, blockNumber, buffer))
+   return true;
+  markFailed(index);
+ }
+}
+
+bool MirroredBlockDevice::writeBlock(std::size_t blockNumber, const char *data, std::size_t size)
+{
+ if (blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque fuera de rango.\n";
+  return false;
+ }
+ std::shared_lock<std::shared_mutex> gate(writeGate);
+ if (!markDirty(std::vector<std::size_t>{blockNumber}))
+  return false;
+
+ // Un solo bloque: despertar hilos cuesta mas que escribir uno tras otro
+ bool anyOk = false;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  {
+   std::lock_guard<std::mutex> lock(stateMutex);
+   if (state[i].failed)
+    continue;
+  }
+  state[i].writes++;
+  if (members[i]->writeBlock(dataStart + blockNumber, data, size))
+   anyOk = true;
+  else
+   markFailed(i);
+ }
+ return anyOk;
+}
+
+bool MirroredBlockDevice::readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+ {
+  std::cerr << "La cantidad de bloques y de buffers no coincide.\n";
+  return false;
+ }
+ for (auto blk : blockNumbers)
+ {
+  if (blk >= blockCount)
+  {
+   std::cerr << "Número de bloque fuera de rango.\n";
+   return false;
+  }
+ }
+
+ std::lock_guard<std::mutex> lock(batchMutex);
+ std::vector<std::size_t> candidates;
+ std::vector<std::size_t> involved;
+ std::vector<std::size_t> fallback; // posiciones del lote sin miembro al dia
+ {
+  std::lock_guard<std::mutex> stateLock(stateMutex);
+  for (std::size_t k = 0; k < members.size(); k++)
+  {
+   std::size_t i = (nextStart + k) % members.size();
+   if (!state[i].failed)
+    candidates.push_back(i);
+  }
+  nextStart = (nextStart + 1) % members.size();
+  if (candidates.empty())
+  {
+   std::cerr << "No queda ningún miembro del espejo.\n";
+   return false;
+  }
+
+  // Tramos contiguos, uno por miembro, para que cada uno siga leyendo en secuencia
+  for (auto &blocks : memberBlocks)
+   blocks.clear();
+  for (auto &bufs : memberReads)
+   bufs.clear();
+  std::size_t chunk = (blockNumbers.size() + candidates.size() - 1) / candidates.size();
+  for (std::size_t k = 0; k < blockNumbers.size(); k++)
+  {
+   std::size_t i = candidates[k / chunk];
+   if (!usable(i, blockNumbers[k]))
+   {
+    if (!usable(source, blockNumbers[k]))
+    {
+     fallback.push_back(k);
+     continue;
+    }
+    i = source;
+   }
+   memberBlocks[i].push_back(dataStart + blockNumbers[k]);
+   memberReads[i].push_back(buffers[k]);
+  }
+  for (std::size_t i = 0; i < members.size(); i++)
+  {
+   if (!memberBlocks[i].empty())
+    involved.push_back(i);
+  }
+ }
+
+ operation = Operation::Read;
+ std::vector<bool> results;
+ threads.run(involved, [this](std::size_t index)
+             { return runMember(index); },
+             &results);
+
+ // Lo que leyo un miembro que fallo se vuelve a pedir bloque por bloque a los demas
+ for (std::size_t k = 0; k < involved.size(); k++)
+ {
+  if (!results[k])
+   markFailed(involved[k]);
+ }
+ bool ok = true;
+ for (std::size_t k = 0; k < blockNumbers.size() && ok; k++)
+ {
+  std::size_t blk = blockNumbers[k];
+  for (std::size_t j = 0; j < involved.size(); j++)
+  {
+   if (results[j])
+    continue;
+   const auto &blocks = memberBlocks[involved[j]];
+   if (std::find(blocks.begin(), blocks.end(), dataStart + blk) != blocks.end())
+   {
+    ok = readBlock(blk, buffers[k]);
+    break;
+   }
+  }
+ }
+ for (std::size_t k : fallback)
+ {
+  if (ok)
+   ok = readBlock(blockNumbers[k], buffers[k]);
+ }
+ return ok;
+}
+
+bool MirroredBlockDevice::writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+ {
+  std::cerr << "La cantidad de bloques y de buffers no coincide.\n";
+  return false;
+ }
+ for (auto blk : blockNumbers)
+ {
+  if (blk >= blockCount)
+  {
+   std::cerr << "Número de bloque fuera de rango.\n";
+   return false;
+  }
+ }
+ std::shared_lock<std::shared_mutex> gate(writeGate);
+ if (!markDirty(blockNumbers))
+  return false;
+
+ std::lock_guard<std::mutex> lock(batchMutex);
+ batchBlocks.clear();
+ for (auto blk : blockNumbers)
+  batchBlocks.push_back(dataStart + blk);
+ batchWrites = &buffers;
+
+ std::vector<std::size_t> involved;
+ {
+  std::lock_guard<std::mutex> stateLock(stateMutex);
+  for (std::size_t i = 0; i < members.size(); i++)
+  {
+   if (!state[i].failed)
+    involved.push_back(i);
+  }
+ }
+ operation = Operation::Write;
+ std::vector<bool> results;
+ threads.run(involved, [this](std::size_t index)
+             { return runMember(index); },
+             &results);
+ batchWrites = nullptr;
+
+ bool anyOk = false;
+ for (std::size_t k = 0; k < involved.size(); k++)
+ {
+  if (results[k])
+   anyOk = true;
+  else
+   markFailed(involved[k]);
+ }
+ return anyOk;
+}
+
+// Sublote de un miembro para la operacion en curso
+bool MirroredBlockDevice::runMember(std::size_t index)
+{
+ IBlockDevice &m = *members[index];
+ MemberState &st = state[index];
+ switch (operation)
+ {
+ case Operation::Read:
+ {
+  std::size_t count = memberBlocks[index].size();
+  st.inFlight += (unsigned)count;
+  st.lastBlock = memberBlocks[index].back() - dataStart;
+  st.reads += count;
+  bool ok = m.readBlocks(memberBlocks[index], memberReads[index]);
+  st.inFlight -= (unsigned)count;
+  return ok;
+ }
+ case Operation::Write:
+  st.writes += batchBlocks.size();
+  return m.writeBlocks(batchBlocks, *batchWrites);
+ case Operation::Flush:
+  return m.flush();
+ }
+ return false;
+}
+
+// Sincroniza todos los miembros en paralelo; si todos confirmaron y ninguno quedo atras,
+// las regiones dejan de estar sucias
+bool MirroredBlockDevice::flush()
+{
+ if (!opened)
+  return false;
+ std::unique_lock<std::shared_mutex> gate(writeGate);
+ std::lock_guard<std::mutex> lock(batchMutex);
+
+ std::vector<std::size_t> involved;
+ {
+  std::lock_guard<std::mutex> stateLock(stateMutex);
+  for (std::size_t i = 0; i < members.size(); i++)
+  {
+   if (!state[i].failed)
+    involved.push_back(i);
+  }
+ }
+ operation = Operation::Flush;
+ std::vector<bool> results;
+ threads.run(involved, [this](std::size_t index)
+             { return runMember(index); },
+             &results);
+
+ std::lock_guard<std::mutex> stateLock(stateMutex);
+ bool anyOk = false;
+ for (std::size_t k = 0; k < involved.size(); k++)
+ {
+  if (results[k])
+   anyOk = true;
+  else
+   failMember(involved[k]);
+ }
+ if (!anyOk)
+  return false;
+
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (state[i].failed || state[i].stale)
+   return true;
+ }
+ auto first = std::find_if(dirtyMap.begin(), dirtyMap.end(), [](uint8_t b)
+                           { return b != 0; });
+ if (first == dirtyMap.end())
+  return true;
+ std::size_t firstByte = (std::size_t)(first - dirtyMap.begin());
+ std::size_t lastByte = dirtyMap.size() - 1;
+ while (dirtyMap[lastByte] == 0)
+  lastByte--;
+ std::fill(dirtyMap.begin(), dirtyMap.end(), 0);
+ return writeBitmap(firstByte, lastByte);
+}
+
+bool MirroredBlockDevice::resync(std::size_t &copiedBlocks)
+{
+ copiedBlocks = 0;
+ if (!opened)
+  return false;
+ std::unique_lock<std::shared_mutex> gate(writeGate);
+ std::lock_guard<std::mutex> lock(batchMutex);
+ std::lock_guard<std::mutex> stateLock(stateMutex);
+
+ if (state[source].failed || state[source].stale)
+ {
+  std::cerr << "No hay un miembro al día desde el cual copiar.\n";
+  return false;
+ }
+
+ // Se intenta con todos los demas, tambien con los que fallaron antes
+ std::vector<bool> ok(members.size(), true);
+ std::vector<char> data(regionBlocks * blockSize);
+ std::vector<std::size_t> blocks;
+ std::vector<char *> reads;
+ std::vector<const char *> writes;
+ std::size_t regionCount = (blockCount + regionBlocks - 1) / regionBlocks;
+ for (std::size_t region = 0; region < regionCount; region++)
+ {
+  if (!isDirty(region))
+   continue;
+  blocks.clear();
+  reads.clear();
+  writes.clear();
+  for (std::size_t blk = region * regionBlocks; blk < std::min((region + 1) * regionBlocks, blockCount); blk++)
+  {
+   char *buffer = data.data() + (blk - region * regionBlocks) * blockSize;
+   blocks.push_back(dataStart + blk);
+   reads.push_back(buffer);
+   writes.push_back(buffer);
+  }
+  if (!members[source]->readBlocks(blocks, reads))
+  {
+   std::cerr << "Error leyendo la región " << region << " del miembro de origen.\n";
+   failMember(source);
+   return false;
+  }
+  for (std::size_t i = 0; i < members.size(); i++)
+  {
+   if (i != source && ok[i])
+    ok[i] = members[i]->writeBlocks(blocks, writes);
+  }
+  copiedBlocks += blocks.size();
+ }
+
+ bool complete = true;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (i == source)
+   continue;
+  if (ok[i] && members[i]->flush())
+  {
+   state[i].failed = false;
+   state[i].stale = false;
+  }
+  else
+  {
+   complete = false;
+   state[i].failed = false; // failMember solo actua sobre miembros vivos
+   failMember(i);
+  }
+ }
+ if (!complete)
+  return false;
+
+ // Todos iguales otra vez: mapa limpio y un evento nuevo en todas las cabeceras
+ std::fill(dirtyMap.begin(), dirtyMap.end(), 0);
+ events++;
+ bool written = writeBitmap(0, dirtyMap.size() - 1);
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (!writeHeader(i))
+   written = false;
+ }
+ return written;
+}
+
+bool MirroredBlockDevice::discardBlocks(const std::vector<std::size_t> &blockNumbers)
+{
+ std::vector<std::size_t> translated;
+ for (auto blk : blockNumbers)
+ {
+  if (blk < blockCount)
+   translated.push_back(dataStart + blk);
+ }
+ // Descartar es opcional: un miembro que no puede no queda fuera del arreglo
+ bool ok = true;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  {
+   std::lock_guard<std::mutex> lock(stateMutex);
+   if (state[i].failed)
+    continue;
+  }
+  ok = members[i]->discardBlocks(translated) && ok;
+ }
+ return ok;
+}
+
+bool MirroredBlockDevice::supportsDiscard() const
+{
+ for (auto &m : members)
+ {
+  if (!m->supportsDiscard())
+   return false;
+ }
+ return !members.empty();
+}
+
+bool MirroredBlockDevice::requiresAlignment() const
+{
+ for (auto &m : members)
+ {
+  if (m->requiresAlignment())
+   return true;
+ }
+ return false;
+}
+
+std::size_t MirroredBlockDevice::bufferAlignment() const
+{
+ std::size_t alignment = 1;
+ for (auto &m : members)
+  alignment = std::max(alignment, m->bufferAlignment());
+ return alignment;
+}
@@ -0,0 +1,136 @@
+#ifndef MIRROREDBLOCKDEVICE_H
+#define MIRROREDBLOCKDEVICE_H
+
+#include "IBlockDevice.h"
+#include "MemberThreads.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+// Espejo (RAID-1) sobre dos o mas dispositivos con el mismo contenido.
+// Las escrituras van a todos los miembros (en paralelo para los lotes); cada lectura va a
+// un solo miembro, el que tenga menos lecturas en curso y, a igualdad, el que leyo por
+// ultimo mas cerca del bloque pedido. Los lotes de lectura se parten en tramos contiguos,
+// uno por miembro, que se leen al mismo tiempo.
+//
+// Cada miembro guarda en su bloque 0 una cabecera (identificador del arreglo, posicion,
+// contador de eventos) y a continuacion un mapa de regiones sucias: un bit por cada
+// regionBlocks bloques. Antes de la primera escritura a una region se marca su bit en
+// todos los miembros y se sincronizan; flush() los limpia cuando todos los miembros
+// confirmaron sus escrituras. Si un miembro falla queda fuera del arreglo (el resto sigue
+// funcionando) y los bits no se limpian hasta resync(), que copia solo las regiones marcadas
+// desde el miembro al dia hacia los demas. Tras una caida tambien quedan regiones marcadas:
+// hasta el resync, en esas regiones se lee unicamente del miembro de origen.
+class MirroredBlockDevice : public IBlockDevice
+{
+public:
+ struct MemberStats
+ {
+  uint64_t reads = 0;  // bloques leidos de este miembro
+  uint64_t writes = 0; // bloques escritos en este miembro
+  bool failed = false; // fuera del arreglo por un error de E/S
+  bool stale = false;  // puede tener datos viejos en las regiones sucias
+ };
+
+ explicit MirroredBlockDevice(std::vector<std::unique_ptr<IBlockDevice>> members);
+ ~MirroredBlockDevice() override;
+
+ // Escribe cabeceras y mapas limpios; el contenido de los miembros se considera igual
+ // (imagenes recien creadas)
+ bool create(std::size_t regionBlocks = 64);
+ bool open();
+ // true si el dispositivo es miembro de un espejo
+ static bool isMirrored(IBlockDevice &device);
+
+ bool readBlock(std::size_t blockNumber, char *buffer) override;
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) override;
+ bool readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers) override;
+ bool writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers) override;
+ bool flush() override;
+ bool close() override;
+
+ bool discardBlocks(const std::vector<std::size_t> &blockNumbers) override;
+ bool supportsDiscard() const override;
+
+ bool requiresAlignment() const override;
+ std::size_t bufferAlignment() const override;
+
+ // Copia las regiones sucias desde el miembro de origen a los demas (incluidos los que
+ // fallaron, que vuelven al arreglo si la copia funciona). Devuelve los bloques copiados
+ // en copiedBlocks.
+ bool resync(std::size_t &copiedBlocks);
+
+ std::size_t memberCount() const { return members.size(); }
+ IBlockDevice &member(std::size_t index) { return *members[index]; }
+ std::size_t regionSize() const { return regionBlocks; }
+ std::size_t dirtyRegions() const;
+ std::size_t sourceMember() const { return source; }
+ MemberStats memberStats(std::size_t index) const;
+
+private:
+ enum class Operation
+ {
+  Read,
+  Write,
+  Flush
+ };
+
+ struct MemberState
+ {
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> writes{0};
+  std::atomic<unsigned> inFlight{0};        // lecturas en curso
+  std::atomic<std::size_t> lastBlock{0};    // ultimo bloque leido, para la localidad
+  bool failed = false;
+  bool stale = false;
+ };
+
+ std::vector<std::unique_ptr<IBlockDevice>> members;
+ std::unique_ptr<MemberState[]> state;
+ MemberThreads threads;
+ bool opened = false;
+
+ uint64_t arrayId = 0;
+ uint64_t events = 0;          // sube cada vez que cambia la composicion del arreglo
+ std::size_t regionBlocks = 0;
+ std::size_t bitmapBlocks = 0;
+ std::size_t dataStart = 0;
+ std::size_t source = 0;       // miembro al dia, de donde se copia en el resync
+
+ // Mapa de regiones sucias y estado de los miembros (protegidos por stateMutex)
+ mutable std::mutex stateMutex;
+ std::vector<uint8_t> dirtyMap;
+ // Las escrituras lo toman compartido; flush() y resync() en exclusiva para que ninguna
+ // escritura quede sin confirmar cuando se limpia el mapa
+ std::shared_mutex writeGate;
+
+ // Lote en curso, repartido por miembro (protegido por batchMutex)
+ std::mutex batchMutex;
+ Operation operation = Operation::Read;
+ std::vector<std::vector<std::size_t>> memberBlocks;
+ std::vector<std::vector<char *>> memberReads;
+ const std::vector<const char *> *batchWrites = nullptr;
+ std::vector<std::size_t> batchBlocks;     // bloques de la escritura en curso, ya traducidos
+ std::size_t nextStart = 0;                // miembro que recibe el primer tramo del proximo lote
+
+ bool setGeometry(std::size_t regionBlocks, std::size_t bitmapBlocks);
+ bool writeHeader(std::size_t index);
+ bool writeBitmap(std::size_t firstByte, std::size_t lastByte);
+ bool isDirty(std::size_t region) const { return dirtyMap[region / 8] & (1u << (region % 8)); }
+ bool markDirty(const std::vector<std::size_t> &blockNumbers);
+ void markFailed(std::size_t index);
+ void failMember(std::size_t index); // con stateMutex tomado
+ bool usable(std::size_t index, std::size_t blockNumber) const;
+ std::size_t chooseMember(std::size_t blockNumber) const;
+ bool readFrom(std::size_t index, std::size_t blockNumber, char *buffer);
+ bool runMember(std::size_t index);
+ std::size_t liveMembers() const;
+
+ static constexpr uint64_t header_magic = 0x315252494D564544ULL; // "DEVMIRR1"
+};
+
+#endif // MIRROREDBLOCKDEVICE_H
@@ -0,0 +1,154 @@
+#include "RamBlockDevice.h"
+#include <iostream>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+RamBlockDevice::~RamBlockDevice()
+{
+ release();
+}
+
+bool RamBlockDevice::create(std::size_t bSize, std::size_t bCount)
+{
+ if (bSize == 0 || bCount == 0)
+ {
+  std::cerr << "El tamaño de bloque y la cantidad de bloques deben ser mayores a 0.\n";
+  return false;
+ }
+
+ release();
+ void *addr = ::mmap(nullptr, bSize * bCount, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+ if (addr == MAP_FAILED)
+ {
+  std::cerr << "No hay memoria suficiente para el dispositivo.\n";
+  return false;
+ }
+
+ base = static_cast<char *>(addr);
+ length = bSize * bCount;
+ blockSize = bSize;
+ blockCount = bCount;
+ return true;
+}
+
+void RamBlockDevice::release()
+{
+ if (base)
+  ::munmap(base, length);
+ base = nullptr;
+ length = 0;
+}
+
+bool RamBlockDevice::close()
+{
+ if (!base)
+ {
+  std::cerr << "No hay dispositivo abierto.\n";
+  return false;
+ }
+ release();
+ std::cout << "Dispositivo cerrado (el contenido en memoria se descartó).\n";
+ return true;
+}
+
+// No hay nada que persistir
+bool RamBlockDevice::flush()
+{
+ return base != nullptr;
+}
+
+bool RamBlockDevice::readBlock(std::size_t blockNumber, char *buffer)
+{
+ if (!base || blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque inválido.\n";
+  return false;
+ }
+ std::memcpy(buffer, base + blockNumber * blockSize, blockSize);
+ return true;
+}
+
+bool RamBlockDevice::writeBlock(std::size_t blockNumber, const char *data, std::size_t size)
+{
+ if (!base || blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque inválido.\n";
+  return false;
+ }
+ if (size > blockSize)
+ {
+  std::cerr << "Datos demasiado grandes para el bloque.\n";
+  return false;
+ }
+
+ char *block = base + blockNumber * blockSize;
+ std::memcpy(block, data, size);
+ std::memset(block + size, 0, blockSize - size);
+ return true;
+}
+
+bool RamBlockDevice::grow(std::size_t newBlockCount)
+{
+ if (!base)
+ {
+  std::cerr << "No hay dispositivo abierto.\n";
+  return false;
+ }
+ if (newBlockCount <= blockCount)
+ {
+  std::cerr << "La nueva cantidad de bloques debe ser mayor a la actual.\n";
+  return false;
+ }
+ // Las paginas nuevas de un mapeo anonimo vienen en ceros
+ void *addr = ::mremap(base, length, blockSize * newBlockCount, MREMAP_MAYMOVE);
+ if (addr == MAP_FAILED)
+ {
+  std::cerr << "No hay memoria suficiente para agrandar el dispositivo.\n";
+  return false;
+ }
+ base = static_cast<char *>(addr);
+ length = blockSize * newBlockCount;
+ blockCount = newBlockCount;
+ return true;
+}
+
+// Las paginas completas dentro del rango se devuelven al sistema (se leen como ceros
+// despues); los extremos que comparten pagina con otros bloques se llenan con ceros
+bool RamBlockDevice::discardBlocks(const std::vector<std::size_t> &blockNumbers)
+{
+ if (!base)
+  return false;
+
+ static const std::size_t page = (std::size_t)::sysconf(_SC_PAGESIZE);
+ for (std::size_t blockNumber : blockNumbers)
+ {
+  if (blockNumber >= blockCount)
+  {
+   std::cerr << "Número de bloque inválido.\n";
+   return false;
+  }
+
+  std::size_t start = blockNumber * blockSize;
+  std::size_t end = start + blockSize;
+  std::size_t pageStart = (start + page - 1) / page * page;
+  std::size_t pageEnd = end / page * page;
+  if (pageStart < pageEnd && ::madvise(base + pageStart, pageEnd - pageStart, MADV_DONTNEED) == 0)
+  {
+   std::memset(base + start, 0, pageStart - start);
+   std::memset(base + pageEnd, 0, end - pageEnd);
+  }
+  else
+  {
+   std::memset(base + start, 0, blockSize);
+  }
+ }
+ return true;
+}
+
+BlockView RamBlockDevice::blockView(std::size_t blockNumber) const
+{
+ if (!base || blockNumber >= blockCount)
+  return BlockView();
+ return BlockView{base + blockNumber * blockSize, blockSize};
+}
@@ -0,0 +1,43 @@
+#ifndef RAMBLOCKDEVICE_H
+#define RAMBLOCKDEVICE_H
+
+#include "IBlockDevice.h"
+#include <cstddef>
+
+// Dispositivo de bloques completamente en memoria, sin archivo en el host.
+// Sirve para medir el costo de CPU del FS sin E/S real y para sistemas de archivos
+// temporales; el contenido se pierde al cerrarlo.
+// La memoria es un mapeo anonimo: las paginas se reservan al escribirse por primera vez
+// y discardBlocks las devuelve al sistema. Varios hilos pueden leer y escribir bloques
+// distintos al mismo tiempo.
+class RamBlockDevice : public IBlockDevice
+{
+public:
+ RamBlockDevice() {}
+ ~RamBlockDevice() override;
+
+ bool create(std::size_t block_size, std::size_t block_count);
+ bool close() override;
+ bool flush() override;
+
+ bool readBlock(std::size_t blockNumber, char *buffer) override;
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) override;
+
+ bool discardBlocks(const std::vector<std::size_t> &blockNumbers) override;
+ bool supportsDiscard() const override { return base != nullptr; }
+
+ // El mapeo se agranda con mremap (puede moverse)
+ bool grow(std::size_t newBlockCount) override;
+ bool supportsGrow() const override { return base != nullptr; }
+
+ BlockView blockView(std::size_t blockNumber) const override;
+ bool providesViews() const override { return base != nullptr; }
+
+private:
+ char *base = nullptr;
+ std::size_t length = 0;
+
+ void release();
+};
+
+#endif // RAMBLOCKDEVICE_H
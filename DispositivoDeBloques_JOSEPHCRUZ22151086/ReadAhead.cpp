@@ -0,0 +1,185 @@
+#include "ReadAhead.h"
+#include <algorithm>
+#include <cstring>
+
+ReadAhead::ReadAhead(IBlockDevice &device, std::size_t maxWindow, std::size_t minWindow)
+    : device(device), maxWin(std::max<std::size_t>(1, maxWindow)), minWin(std::max<std::size_t>(1, std::min(minWindow, maxWindow)))
+{
+ // Caben dos ventanas completas: la que se esta leyendo y la siguiente
+ capacity = maxWin * 2;
+ pool.reset(device.blockSize, 4096, capacity);
+ io = std::make_unique<AsyncBlockIO>(device, (unsigned)std::min<std::size_t>(maxWin, 256));
+}
+
+ReadAhead::~ReadAhead()
+{
+ // Las lecturas en vuelo escriben en buffers del pool, hay que esperarlas
+ io->drain();
+ io.reset();
+}
+
+bool ReadAhead::readRaw(std::size_t blockNumber, char *buffer)
+{
+ BlockMap identity = [this](std::size_t index, std::size_t &blockNumber)
+ {
+  blockNumber = index;
+  return index < device.blockCount;
+ };
+ return read(raw_stream, blockNumber, identity, buffer);
+}
+
+bool ReadAhead::read(uint64_t stream, std::size_t index, const BlockMap &map, char *buffer)
+{
+ std::size_t blockNumber;
+ if (!map(index, blockNumber))
+  return false;
+
+ counters.reads++;
+ io->poll();
+
+ // Deteccion de acceso secuencial: la primera posicion o la que sigue a la anterior
+ StreamState &state = streams[stream];
+ bool sequential = index == 0 || index == state.nextIndex;
+ state.nextIndex = index + 1;
+ if (!sequential)
+ {
+  state.window = 0;
+  state.prefetchedEnd = index + 1;
+ }
+ else if (state.window == 0)
+ {
+  state.window = minWin;
+  state.prefetchedEnd = std::max(state.prefetchedEnd, index + 1);
+ }
+ else if (index + state.window / 2 >= state.prefetchedEnd && state.window < maxWin)
+ {
+  // El lector ya consumio la mitad de lo pedido: la ventana no alcanza, se agranda
+  state.window = std::min(maxWin, state.window * 2);
+ }
+
+ if (state.window > 0)
+ {
+  if (state.prefetchedEnd < index + 1)
+   state.prefetchedEnd = index + 1;
+  prefetch(state, index + 1 + state.window, map);
+ }
+
+ auto it = entries.find(blockNumber);
+ if (it != entries.end())
+ {
+  if (!it->second.ready)
+  {
+   counters.waits++;
+   while (!it->second.ready && io->inFlight() > 0)
+   {
+    io->wait(1);
+    it = entries.find(blockNumber);
+   }
+  }
+  if (it != entries.end() && it->second.ready && it->second.ok && !it->second.stale)
+  {
+   counters.hits++;
+   std::memcpy(buffer, it->second.buffer, device.blockSize);
+   release(blockNumber);
+   return true;
+  }
+  if (it != entries.end())
+   release(blockNumber);
+ }
+
+ return device.readBlock(blockNumber, buffer);
+}
+
+// Pide de forma asincrona las posiciones [prefetchedEnd, upTo) que no esten ya en memoria
+void ReadAhead::prefetch(StreamState &state, std::size_t upTo, const BlockMap &map)
+{
+ while (state.prefetchedEnd < upTo)
+ {
+  std::size_t blockNumber;
+  if (!map(state.prefetchedEnd, blockNumber))
+  {
+   // Fin del stream, no tiene sentido seguir intentando
+   state.prefetchedEnd = upTo;
+   break;
+  }
+  state.prefetchedEnd++;
+
+  if (entries.count(blockNumber) || (prefetchFilter && !prefetchFilter(blockNumber)))
+   continue;
+
+  makeRoom();
+  char *buf = pool.acquire();
+  if (!buf)
+   break;
+  entries[blockNumber] = Entry{buf, false, false, false};
+  order.push_back(blockNumber);
+  counters.prefetched++;
+
+  bool submitted = io->submitRead(blockNumber, buf, [this](std::size_t blk, bool ok)
+                                  {
+                                   auto e = entries.find(blk);
+                                   if (e != entries.end())
+                                   {
+                                    e->second.ready = true;
+                                    e->second.ok = ok;
+                                   } });
+  if (!submitted)
+  {
+   entries.erase(blockNumber);
+   order.pop_back();
+   pool.release(buf);
+   break;
+  }
+ }
+}
+
+// Descarta los bloques precargados mas viejos hasta dejar lugar para uno nuevo
+void ReadAhead::makeRoom()
+{
+ while (entries.size() >= capacity && !order.empty())
+ {
+  std::size_t oldest = order.front();
+  auto it = entries.find(oldest);
+  if (it == entries.end())
+  {
+   order.pop_front();
+   continue;
+  }
+  // Un buffer en vuelo no se puede reutilizar hasta que llegue su completion
+  while (!it->second.ready && io->inFlight() > 0)
+  {
+   io->wait(1);
+   it = entries.find(oldest);
+  }
+  counters.wasted++;
+  release(oldest);
+ }
+}
+
+void ReadAhead::release(std::size_t blockNumber)
+{
+ auto it = entries.find(blockNumber);
+ if (it == entries.end())
+  return;
+ if (!it->second.ready)
+ {
+  // Todavia en vuelo: solo se marca, se libera cuando makeRoom lo alcance
+  it->second.stale = true;
+  return;
+ }
+ pool.release(it->second.buffer);
+ entries.erase(it);
+ auto pos = std::find(order.begin(), order.end(), blockNumber);
+ if (pos != order.end())
+  order.erase(pos);
+}
+
+void ReadAhead::invalidate(std::size_t blockNumber)
+{
+ release(blockNumber);
+}
+
+void ReadAhead::forgetStream(uint64_t stream)
+{
+ streams.erase(stream);
+}
@@ -0,0 +1,93 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "AlignedBufferPool.h"
+#include "AsyncBlockIO.h"
+#include "IBlockDevice.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+// Lectura anticipada de bloques.
+// Cada stream (un archivo, o el flujo de bloques crudos del dispositivo) recuerda la
+// ultima posicion leida. Cuando las lecturas son secuenciales se piden por adelantado
+// los siguientes bloques con AsyncBlockIO y quedan guardados en memoria hasta que se lean.
+// La ventana empieza en minWindow y se duplica cada vez que el lector alcanza la mitad
+// de lo ya pedido, hasta maxWindow; un salto en la posicion la apaga hasta que vuelva
+// a haber acceso secuencial.
+class ReadAhead
+{
+public:
+ struct Stats
+ {
+  uint64_t reads = 0;      // lecturas atendidas
+  uint64_t hits = 0;       // atendidas con un bloque ya precargado
+  uint64_t waits = 0;      // el bloque estaba pedido pero aun no llegaba
+  uint64_t prefetched = 0; // bloques pedidos por adelantado
+  uint64_t wasted = 0;     // precargados que se descartaron sin leerse
+ };
+
+ // Traduce una posicion del stream al bloque fisico; false si esta fuera del stream
+ using BlockMap = std::function<bool(std::size_t index, std::size_t &blockNumber)>;
+ // Si devuelve false para un bloque, ese bloque no se precarga (por ejemplo, si hay
+ // una version mas nueva en una cache de escritura)
+ using PrefetchFilter = std::function<bool(std::size_t blockNumber)>;
+
+ static constexpr uint64_t raw_stream = UINT64_MAX;
+
+ ReadAhead(IBlockDevice &device, std::size_t maxWindow = 32, std::size_t minWindow = 4);
+ ~ReadAhead();
+
+ ReadAhead(const ReadAhead &) = delete;
+ ReadAhead &operator=(const ReadAhead &) = delete;
+
+ // Lee la posicion index del stream en buffer (blockSize bytes) y actualiza la ventana
+ bool read(uint64_t stream, std::size_t index, const BlockMap &map, char *buffer);
+ // Lectura del stream de bloques crudos: la posicion es el propio numero de bloque
+ bool readRaw(std::size_t blockNumber, char *buffer);
+
+ // Descarta cualquier copia precargada del bloque (se llama al escribirlo)
+ void invalidate(std::size_t blockNumber);
+ void forgetStream(uint64_t stream);
+ void setPrefetchFilter(PrefetchFilter filter) { prefetchFilter = std::move(filter); }
+
+ std::size_t maxWindow() const { return maxWin; }
+ Stats stats() const { return counters; }
+
+private:
+ struct StreamState
+ {
+  std::size_t nextIndex = 0;     // posicion que se espera en una lectura secuencial
+  std::size_t window = 0;        // 0 = sin lectura anticipada
+  std::size_t prefetchedEnd = 0; // primera posicion todavia no pedida
+ };
+
+ struct Entry
+ {
+  char *buffer = nullptr;
+  bool ready = false;
+  bool ok = false;
+  bool stale = false; // se escribio el bloque mientras la lectura estaba en vuelo
+ };
+
+ IBlockDevice &device;
+ std::size_t maxWin;
+ std::size_t minWin;
+ std::size_t capacity;
+ AlignedBufferPool pool;
+ std::unique_ptr<AsyncBlockIO> io;
+ std::unordered_map<uint64_t, StreamState> streams;
+ std::unordered_map<std::size_t, Entry> entries;
+ std::deque<std::size_t> order; // orden de llegada de entries, para descartar los mas viejos
+ PrefetchFilter prefetchFilter;
+ Stats counters;
+
+ void prefetch(StreamState &state, std::size_t upTo, const BlockMap &map);
+ void makeRoom();
+ void release(std::size_t blockNumber);
+};
+
+#endif // READAHEAD_H
@@ -0,0 +1,395 @@
+#include "RemoteBlockDevice.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Manda todos los segmentos aunque el socket acepte menos de lo pedido. MSG_NOSIGNAL evita
+// SIGPIPE si el servidor cerro la conexion, en ese caso simplemente falla
+static bool sendAll(int fd, struct iovec *iov, std::size_t count)
+{
+ while (count > 0)
+ {
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = std::min<std::size_t>(count, IOV_MAX);
+  ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+  if (n < 0)
+  {
+   if (errno == EINTR)
+    continue;
+   return false;
+  }
+  std::size_t left = (std::size_t)n;
+  while (count > 0 && left >= iov->iov_len)
+  {
+   left -= iov->iov_len;
+   iov++;
+   count--;
+  }
+  if (count > 0)
+  {
+   iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+   iov->iov_len -= left;
+  }
+ }
+ return true;
+}
+
+static bool receiveAll(int fd, struct iovec *iov, std::size_t count)
+{
+ while (count > 0)
+ {
+  ssize_t n = ::readv(fd, iov, (int)std::min<std::size_t>(count, IOV_MAX));
+  if (n < 0 && errno == EINTR)
+   continue;
+  if (n <= 0)
+   return false;
+  std::size_t left = (std::size_t)n;
+  while (count > 0 && left >= iov->iov_len)
+  {
+   left -= iov->iov_len;
+   iov++;
+   count--;
+  }
+  if (count > 0)
+  {
+   iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+   iov->iov_len -= left;
+  }
+ }
+ return true;
+}
+
+static bool receiveAll(int fd, void *buffer, std::size_t length)
+{
+ struct iovec iov = {buffer, length};
+ return receiveAll(fd, &iov, 1);
+}
+
+RemoteBlockDevice::~RemoteBlockDevice()
+{
+ if (sock >= 0)
+  close();
+}
+
+bool RemoteBlockDevice::connect(const std::string &socketPath)
+{
+ if (sock >= 0)
+ {
+  std::cerr << "El dispositivo ya está conectado.\n";
+  return false;
+ }
+ struct sockaddr_un addr = {};
+ addr.sun_family = AF_UNIX;
+ if (socketPath.size() >= sizeof(addr.sun_path))
+ {
+  std::cerr << "La ruta del socket es demasiado larga.\n";
+  return false;
+ }
+ std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+ sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+ if (sock < 0 || ::connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+ {
+  std::cerr << "No se pudo conectar con el servidor: " << std::strerror(errno) << "\n";
+  if (sock >= 0)
+   ::close(sock);
+  sock = -1;
+  return false;
+ }
+ if (!hello())
+ {
+  ::close(sock);
+  sock = -1;
+  return false;
+ }
+
+ zeroBlock.assign(blockSize, 0);
+ broken = false;
+ receiver = std::thread(&RemoteBlockDevice::receiveLoop, this);
+ return true;
+}
+
+// Primer intercambio, antes de arrancar el receptor: el servidor describe el dispositivo
+bool RemoteBlockDevice::hello()
+{
+ BlockRequest request{};
+ request.op = (uint32_t)BlockOp::Hello;
+ struct iovec iov = {&request, sizeof(request)};
+ BlockResponse response{};
+ BlockDeviceInfo info{};
+ if (!sendAll(sock, &iov, 1) || !receiveAll(sock, &response, sizeof(response)) ||
+     response.status != BLOCK_STATUS_OK || response.length != sizeof(info) || !receiveAll(sock, &info, sizeof(info)))
+ {
+  std::cerr << "El servidor no respondió como se esperaba.\n";
+  return false;
+ }
+ if (info.blockSize == 0 || info.blockCount == 0)
+ {
+  std::cerr << "El servidor no tiene un dispositivo abierto.\n";
+  return false;
+ }
+ blockSize = (std::size_t)info.blockSize;
+ blockCount = (std::size_t)info.blockCount;
+ discardSupported = (info.flags & BLOCK_INFO_DISCARD) != 0;
+ return true;
+}
+
+bool RemoteBlockDevice::close()
+{
+ if (sock < 0)
+ {
+  std::cerr << "No hay dispositivo abierto.\n";
+  return false;
+ }
+ // El receptor ve el fin de la conexion, falla lo que quede pendiente y termina
+ ::shutdown(sock, SHUT_RDWR);
+ if (receiver.joinable())
+  receiver.join();
+ ::close(sock);
+ sock = -1;
+ std::cout << "Conexión cerrada.\n";
+ return true;
+}
+
+void RemoteBlockDevice::failAll()
+{
+ std::lock_guard<std::mutex> lock(callMutex);
+ broken = true;
+ for (auto &entry : inFlight)
+ {
+  entry.second->status = BLOCK_STATUS_ERROR;
+  entry.second->done = true;
+ }
+ inFlight.clear();
+ answered.notify_all();
+}
+
+void RemoteBlockDevice::receiveLoop()
+{
+ std::vector<struct iovec> iov;
+ while (true)
+ {
+  BlockResponse response;
+  if (!receiveAll(sock, &response, sizeof(response)))
+   break;
+
+  Call *call = nullptr;
+  {
+   std::lock_guard<std::mutex> lock(callMutex);
+   auto it = inFlight.find(response.tag);
+   if (it != inFlight.end())
+    call = it->second;
+  }
+  if (!call)
+  {
+   std::cerr << "Respuesta del servidor para un pedido desconocido.\n";
+   break;
+  }
+
+  // Los datos de una lectura van directo a los buffers del llamador, que sigue esperando
+  if (response.length > 0)
+  {
+   if (response.length != call->targets.size() * blockSize)
+   {
+    std::cerr << "Respuesta del servidor con un tamaño inesperado.\n";
+    break;
+   }
+   iov.clear();
+   for (char *target : call->targets)
+    iov.push_back({target, blockSize});
+   if (!receiveAll(sock, iov.data(), iov.size()))
+    break;
+  }
+
+  {
+   std::lock_guard<std::mutex> lock(callMutex);
+   call->status = response.status;
+   call->done = true;
+   inFlight.erase(response.tag);
+  }
+  answered.notify_all();
+ }
+ failAll();
+}
+
+bool RemoteBlockDevice::exchange(std::vector<Call> &calls)
+{
+ if (sock < 0)
+ {
+  std::cerr << "No hay dispositivo abierto.\n";
+  return false;
+ }
+ if (calls.empty())
+  return true;
+
+ {
+  // Todos los pedidos salen juntos: las respuestas se esperan despues, una sola vez
+  std::lock_guard<std::mutex> sendLock(sendMutex);
+  {
+   std::lock_guard<std::mutex> lock(callMutex);
+   if (broken)
+   {
+    std::cerr << "Se perdió la conexión con el servidor.\n";
+    return false;
+   }
+   for (Call &call : calls)
+   {
+    call.request.tag = nextTag++;
+    inFlight[call.request.tag] = &call;
+   }
+  }
+  std::vector<struct iovec> iov;
+  for (Call &call : calls)
+  {
+   iov.push_back({&call.request, sizeof(call.request)});
+   iov.insert(iov.end(), call.payload.begin(), call.payload.end());
+  }
+  // Si no se pudo mandar todo se corta la conexion, el receptor falla lo pendiente
+  if (!sendAll(sock, iov.data(), iov.size()))
+   ::shutdown(sock, SHUT_RDWR);
+ }
+
+ std::unique_lock<std::mutex> lock(callMutex);
+ answered.wait(lock, [&]
+               { return std::all_of(calls.begin(), calls.end(), [](const Call &c)
+                                    { return c.done; }); });
+ for (const Call &call : calls)
+ {
+  if (call.status == BLOCK_STATUS_OK)
+   continue;
+  if (broken)
+   std::cerr << "Se perdió la conexión con el servidor.\n";
+  else if (call.status == BLOCK_STATUS_INVALID)
+   std::cerr << "El servidor rechazó el pedido.\n";
+  else
+   std::cerr << "Error de E/S en el servidor.\n";
+  return false;
+ }
+ return true;
+}
+
+std::vector<RemoteBlockDevice::Call> RemoteBlockDevice::runs(BlockOp op, const std::vector<std::size_t> &blockNumbers) const
+{
+ std::vector<Call> calls;
+ std::size_t i = 0;
+ while (i < blockNumbers.size())
+ {
+  std::size_t run = 1;
+  while (i + run < blockNumbers.size() && blockNumbers[i + run] == blockNumbers[i] + run &&
+         run < BLOCK_MAX_REQUEST_BLOCKS)
+   run++;
+  calls.emplace_back();
+  calls.back().request.op = (uint32_t)op;
+  calls.back().request.block = blockNumbers[i];
+  calls.back().request.count = (uint32_t)run;
+  i += run;
+ }
+ return calls;
+}
+
+bool RemoteBlockDevice::readBlock(std::size_t blockNumber, char *buffer)
+{
+ return readBlocks(std::vector<std::size_t>{blockNumber}, std::vector<char *>{buffer});
+}
+
+bool RemoteBlockDevice::writeBlock(std::size_t blockNumber, const char *data, std::size_t size)
+{
+ if (blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque inválido.\n";
+  return false;
+ }
+ if (size > blockSize)
+ {
+  std::cerr << "Datos demasiado grandes para el bloque.\n";
+  return false;
+ }
+ std::vector<Call> calls(1);
+ calls[0].request.op = (uint32_t)BlockOp::Write;
+ calls[0].request.block = blockNumber;
+ calls[0].request.count = 1;
+ // El relleno sale del bloque de ceros, sin copiar los datos
+ calls[0].payload.push_back({const_cast<char *>(data), size});
+ if (size < blockSize)
+  calls[0].payload.push_back({zeroBlock.data(), blockSize - size});
+ return exchange(calls);
+}
+
+bool RemoteBlockDevice::readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+ {
+  std::cerr << "La cantidad de bloques y de buffers no coincide.\n";
+  return false;
+ }
+ for (auto blk : blockNumbers)
+ {
+  if (blk >= blockCount)
+  {
+   std::cerr << "Número de bloque inválido.\n";
+   return false;
+  }
+ }
+ std::vector<Call> calls = runs(BlockOp::Read, blockNumbers);
+ std::size_t k = 0;
+ for (Call &call : calls)
+  for (uint32_t b = 0; b < call.request.count; b++)
+   call.targets.push_back(buffers[k++]);
+ return exchange(calls);
+}
+
+bool RemoteBlockDevice::writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+ {
+  std::cerr << "La cantidad de bloques y de buffers no coincide.\n";
+  return false;
+ }
+ for (auto blk : blockNumbers)
+ {
+  if (blk >= blockCount)
+  {
+   std::cerr << "Número de bloque inválido.\n";
+   return false;
+  }
+ }
+ // El servidor atiende los pedidos en orden: con bloques repetidos gana la ultima escritura
+ std::vector<Call> calls = runs(BlockOp::Write, blockNumbers);
+ std::size_t k = 0;
+ for (Call &call : calls)
+  for (uint32_t b = 0; b < call.request.count; b++)
+   call.payload.push_back({const_cast<char *>(buffers[k++]), blockSize});
+ return exchange(calls);
+}
+
+bool RemoteBlockDevice::flush()
+{
+ std::vector<Call> calls(1);
+ calls[0].request.op = (uint32_t)BlockOp::Flush;
+ return exchange(calls);
+}
+
+bool RemoteBlockDevice::discardBlocks(const std::vector<std::size_t> &blockNumbers)
+{
+ if (!discardSupported)
+  return false;
+ for (std::size_t n : blockNumbers)
+ {
+  if (n >= blockCount)
+  {
+   std::cerr << "Número de bloque inválido.\n";
+   return false;
+  }
+ }
+ std::vector<std::size_t> sorted(blockNumbers);
+ std::sort(sorted.begin(), sorted.end());
+ sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+ std::vector<Call> calls = runs(BlockOp::Discard, sorted);
+ return exchange(calls);
+}
@@ -0,0 +1,74 @@
+#ifndef REMOTEBLOCKDEVICE_H
+#define REMOTEBLOCKDEVICE_H
+
+#include "BlockProtocol.h"
+#include "IBlockDevice.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Dispositivo servido por otro proceso (BlockServer) a traves de un socket Unix, ver
+// BlockProtocol.h. Los lotes se mandan como una serie de pedidos sin esperar respuesta y
+// un hilo receptor completa cada uno cuando llega la suya, asi un lote de N rachas cuesta
+// una sola ida y vuelta. Varios hilos pueden usar el dispositivo a la vez y sus pedidos se
+// intercalan en el mismo socket. Si la conexion se corta todas las operaciones fallan.
+class RemoteBlockDevice : public IBlockDevice
+{
+public:
+ RemoteBlockDevice() {}
+ ~RemoteBlockDevice() override;
+
+ // Se conecta al servidor y toma blockSize y blockCount de su respuesta
+ bool connect(const std::string &socketPath);
+ bool close() override;
+ bool flush() override;
+
+ bool readBlock(std::size_t blockNumber, char *buffer) override;
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) override;
+ bool readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers) override;
+ bool writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers) override;
+
+ bool discardBlocks(const std::vector<std::size_t> &blockNumbers) override;
+ bool supportsDiscard() const override { return discardSupported; }
+
+ bool connected() const { return sock >= 0; }
+
+private:
+ // Un pedido en vuelo. El que lo manda espera hasta que el receptor marca done
+ struct Call
+ {
+  BlockRequest request{};
+  std::vector<iovec> payload;  // datos de Write
+  std::vector<char *> targets; // un buffer por bloque de Read
+  bool done = false;
+  uint32_t status = BLOCK_STATUS_ERROR;
+ };
+
+ int sock = -1;
+ bool discardSupported = false;
+ std::vector<char> zeroBlock;
+
+ std::mutex sendMutex; // los pedidos de un lote salen juntos
+ uint64_t nextTag = 1;
+
+ std::mutex callMutex;
+ std::condition_variable answered;
+ std::unordered_map<uint64_t, Call *> inFlight;
+ bool broken = false;
+ std::thread receiver;
+
+ bool hello();
+ bool exchange(std::vector<Call> &calls);
+ void receiveLoop();
+ void failAll();
+ // Arma los pedidos de un lote: una racha de bloques consecutivos (en el orden dado) por pedido
+ std::vector<Call> runs(BlockOp op, const std::vector<std::size_t> &blockNumbers) const;
+};
+
+#endif // REMOTEBLOCKDEVICE_H
@@ -0,0 +1,567 @@
+#include "SnapshotBlockDevice.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+// Cabecera en el bloque 0 del dispositivo de abajo; la lista de instantaneas va a continuacion
+struct SnapshotHeader
+{
+ uint64_t magic;
+ uint64_t logicalBlocks;
+ uint64_t blockSize;
+ uint64_t mapStart;
+ uint64_t mapBlocks;
+ uint64_t logStart;
+ uint64_t logBlocks;
+ uint64_t dataStart;
+ uint64_t physicalBlocks;
+ uint64_t logEntries;
+ uint32_t currentEpoch;
+ uint32_t snapshotCount;
+};
+
+SnapshotView::SnapshotView(SnapshotBlockDevice &parent, uint32_t id)
+    : IBlockDevice(parent.blockCount, parent.blockSize), parent(parent), id(id)
+{
+}
+
+bool SnapshotView::readBlock(std::size_t blockNumber, char *buffer)
+{
+ return parent.readSnapshotBlock(id, blockNumber, buffer);
+}
+
+bool SnapshotView::writeBlock(std::size_t, const char *, std::size_t)
+{
+ std::cerr << "La instantánea " << id << " es de solo lectura.\n";
+ return false;
+}
+
+SnapshotBlockDevice::SnapshotBlockDevice(std::unique_ptr<IBlockDevice> innerDevice) : inner(std::move(innerDevice))
+{
+ blockSize = inner->blockSize;
+}
+
+SnapshotBlockDevice::~SnapshotBlockDevice()
+{
+ if (opened)
+  flush();
+}
+
+bool SnapshotBlockDevice::hasSnapshots(IBlockDevice &device)
+{
+ if (device.blockSize < sizeof(SnapshotHeader) || device.blockCount == 0)
+  return false;
+ std::vector<char> raw(device.blockSize);
+ if (!device.readBlock(0, raw.data()))
+  return false;
+ SnapshotHeader header;
+ std::memcpy(&header, raw.data(), sizeof(header));
+ return header.magic == header_magic;
+}
+
+// Ubica mapa, tabla de remapeo y datos para logicalBlocks bloques logicos
+bool SnapshotBlockDevice::layout(std::size_t logicalBlocks, std::size_t innerBlocks)
+{
+ mapBlocks = (logicalBlocks * sizeof(MapEntry) + blockSize - 1) / blockSize;
+ logStart = mapStart + mapBlocks;
+ if (logicalBlocks == 0 || innerBlocks <= logStart)
+  return false;
+ // Cada bloque fisico aparece a lo sumo una vez en la tabla
+ std::size_t available = innerBlocks - logStart;
+ logBlocks = (available * sizeof(Remap) + blockSize - 1) / blockSize;
+ dataStart = logStart + logBlocks;
+ // Las direcciones fisicas se guardan +1 en 32 bits
+ return dataStart < innerBlocks && innerBlocks - dataStart < UINT32_MAX && logicalBlocks < UINT32_MAX;
+}
+
+bool SnapshotBlockDevice::create(std::size_t logicalBlocks)
+{
+ if (blockSize < sizeof(SnapshotHeader) + sizeof(SnapshotRecord))
+ {
+  std::cerr << "Bloques demasiado chicos para la capa de instantáneas.\n";
+  return false;
+ }
+ std::size_t innerBlocks = inner->blockCount;
+ if (logicalBlocks == 0 && innerBlocks > mapStart)
+ {
+  // Primero con una estimacion por exceso del mapa, despues con el valor final
+  if (layout((innerBlocks - mapStart) * 3 / 4, innerBlocks))
+   logicalBlocks = (innerBlocks - dataStart) * 3 / 4;
+ }
+ if (!layout(logicalBlocks, innerBlocks))
+ {
+  std::cerr << "El dispositivo es demasiado chico para la capa de instantáneas.\n";
+  return false;
+ }
+
+ // Mapa en cero: ningun bloque escrito todavia. La tabla vacia no hace falta limpiarla
+ std::vector<char> zeros(blockSize, 0);
+ for (std::size_t i = 0; i < mapBlocks; i++)
+ {
+  if (!inner->writeBlock(mapStart + i, zeros.data(), blockSize))
+   return false;
+ }
+
+ blockCount = logicalBlocks;
+ maxSnapshots = (blockSize - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord);
+ currentEpoch = 1;
+ snapshotList.clear();
+ log.clear();
+ logSaved = 0;
+ if (!saveHeader() || !inner->flush())
+ {
+  std::cerr << "Error escribiendo la cabecera de instantáneas.\n";
+  return false;
+ }
+ return true;
+}
+
+bool SnapshotBlockDevice::saveHeader()
+{
+ std::vector<char> block(blockSize, 0);
+ SnapshotHeader header{};
+ header.magic = header_magic;
+ header.logicalBlocks = blockCount;
+ header.blockSize = blockSize;
+ header.mapStart = mapStart;
+ header.mapBlocks = mapBlocks;
+ header.logStart = logStart;
+ header.logBlocks = logBlocks;
+ header.dataStart = dataStart;
+ header.physicalBlocks = inner->blockCount - dataStart;
+ header.logEntries = logSaved;
+ header.currentEpoch = currentEpoch;
+ header.snapshotCount = (uint32_t)snapshotList.size();
+ std::memcpy(block.data(), &header, sizeof(header));
+ if (!snapshotList.empty())
+  std::memcpy(block.data() + sizeof(header), snapshotList.data(), snapshotList.size() * sizeof(SnapshotRecord));
+ if (!inner->writeBlock(0, block.data(), blockSize))
+  return false;
+ headerDirty = false;
+ return true;
+}
+
+bool SnapshotBlockDevice::open()
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ std::vector<char> block(blockSize);
+ SnapshotHeader header;
+ if (blockSize < sizeof(header) || !inner->readBlock(0, block.data()))
+  return false;
+ std::memcpy(&header, block.data(), sizeof(header));
+
+ maxSnapshots = (blockSize - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord);
+ if (header.magic != header_magic || header.blockSize != blockSize || header.mapStart != mapStart ||
+     !layout(header.logicalBlocks, inner->blockCount) || header.mapBlocks != mapBlocks || header.logStart != logStart ||
+     header.logBlocks != logBlocks || header.dataStart != dataStart || header.snapshotCount > maxSnapshots ||
+     header.logEntries > logBlocks * blockSize / sizeof(Remap))
+ {
+  std::cerr << "La cabecera de instantáneas no es válida.\n";
+  return false;
+ }
+ blockCount = header.logicalBlocks;
+ currentEpoch = header.currentEpoch;
+ snapshotList.resize(header.snapshotCount);
+ std::memcpy(snapshotList.data(), block.data() + sizeof(header), snapshotList.size() * sizeof(SnapshotRecord));
+
+ // Mapa y tabla de remapeo estan seguidos, se leen en un solo lote
+ std::size_t logBlocksUsed = (header.logEntries * sizeof(Remap) + blockSize - 1) / blockSize;
+ std::vector<char> raw((mapBlocks + logBlocksUsed) * blockSize);
+ std::vector<std::size_t> numbers;
+ std::vector<char *> buffers;
+ for (std::size_t i = 0; i < mapBlocks + logBlocksUsed; i++)
+ {
+  numbers.push_back(mapStart + i);
+  buffers.push_back(raw.data() + i * blockSize);
+ }
+ if (!inner->readBlocks(numbers, buffers))
+ {
+  std::cerr << "Error leyendo los metadatos de instantáneas.\n";
+  return false;
+ }
+ map.resize(blockCount);
+ std::memcpy(map.data(), raw.data(), blockCount * sizeof(MapEntry));
+ mapDirty.assign(mapBlocks, 0);
+ log.resize(header.logEntries);
+ std::memcpy(log.data(), raw.data() + mapBlocks * blockSize, log.size() * sizeof(Remap));
+ logSaved = log.size();
+ logRewrite = false;
+
+ // La ocupacion de los bloques fisicos se reconstruye desde el mapa y las tablas
+ used.assign(inner->blockCount - dataStart, 0);
+ remaps.clear();
+ for (const SnapshotRecord &snap : snapshotList)
+  remaps[snap.id];
+ auto claim = [this](uint32_t physical)
+ {
+  if (physical == 0)
+   return true;
+  if (physical > used.size() || used[physical - 1])
+   return false;
+  used[physical - 1] = 1;
+  return true;
+ };
+ for (const MapEntry &entry : map)
+ {
+  if (!claim(entry.physical))
+  {
+   std::cerr << "El mapa de instantáneas está corrupto.\n";
+   return false;
+  }
+ }
+ for (const Remap &r : log)
+ {
+  if (r.logical >= blockCount || remaps.find(r.snapshot) == remaps.end() || !claim(r.physical))
+  {
+   std::cerr << "La tabla de remapeo está corrupta.\n";
+   return false;
+  }
+  remaps[r.snapshot][r.logical] = r.physical;
+ }
+
+ pendingFree.clear();
+ cursor = 0;
+ counters = Stats();
+ opened = true;
+ return true;
+}
+
+// Algun bloque fisico libre (desde el cursor, dando la vuelta); no_block si no queda
+std::size_t SnapshotBlockDevice::allocate()
+{
+ for (std::size_t step = 0; step < used.size(); step++)
+ {
+  std::size_t index = (cursor + step) % used.size();
+  if (!used[index])
+  {
+   used[index] = 1;
+   cursor = index + 1;
+   return index;
+  }
+ }
+ return no_block;
+}
+
+// Se libera en el proximo flush, cuando ningun metadato en disco apunte al bloque
+void SnapshotBlockDevice::release(uint32_t physical)
+{
+ if (physical != 0)
+  pendingFree.push_back(physical - 1);
+}
+
+bool SnapshotBlockDevice::readPhysical(uint32_t physical, char *buffer)
+{
+ if (physical == 0)
+ {
+  std::memset(buffer, 0, blockSize);
+  return true;
+ }
+ return inner->readBlock(dataStart + physical - 1, buffer);
+}
+
+// Lo escrito en una epoca que ve alguna instantanea no se puede pisar
+bool SnapshotBlockDevice::shared(const MapEntry &entry) const
+{
+ return !snapshotList.empty() && entry.epoch <= snapshotList.back().id;
+}
+
+void SnapshotBlockDevice::addRemap(uint32_t snapshot, uint32_t logical, uint32_t physical)
+{
+ remaps[snapshot][logical] = physical;
+ log.push_back(Remap{snapshot, logical, physical});
+}
+
+bool SnapshotBlockDevice::readBlock(std::size_t blockNumber, char *buffer)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!opened || blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque inválido.\n";
+  return false;
+ }
+ return readPhysical(map[blockNumber].physical, buffer);
+}
+
+bool SnapshotBlockDevice::writeBlock(std::size_t blockNumber, const char *data, std::size_t size)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!opened || blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque inválido.\n";
+  return false;
+ }
+ if (size > blockSize)
+ {
+  std::cerr << "Datos demasiado grandes para el bloque.\n";
+  return false;
+ }
+
+ MapEntry &entry = map[blockNumber];
+ bool copy = shared(entry);
+ if (!copy && entry.physical != 0)
+ {
+  // Nadie mas ve este bloque: se escribe en su lugar
+  if (!inner->writeBlock(dataStart + entry.physical - 1, data, size))
+   return false;
+  counters.inPlace++;
+  return true;
+ }
+ if (copy && log.size() >= logBlocks * blockSize / sizeof(Remap))
+ {
+  std::cerr << "La tabla de remapeo de instantáneas está llena.\n";
+  return false;
+ }
+
+ std::size_t physical = allocate();
+ if (physical == no_block)
+ {
+  std::cerr << "No queda espacio físico para copias de instantáneas.\n";
+  return false;
+ }
+ if (!inner->writeBlock(dataStart + physical, data, size))
+ {
+  used[physical] = 0;
+  return false;
+ }
+ // La version anterior pasa a la instantanea mas reciente, que es la que la ve
+ if (copy)
+ {
+  addRemap(snapshotList.back().id, (uint32_t)blockNumber, entry.physical);
+  counters.copies++;
+ }
+ entry.physical = (uint32_t)physical + 1;
+ entry.epoch = currentEpoch;
+ mapDirty[blockNumber * sizeof(MapEntry) / blockSize] = 1;
+ return true;
+}
+
+bool SnapshotBlockDevice::discardBlocks(const std::vector<std::size_t> &blockNumbers)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ for (std::size_t blockNumber : blockNumbers)
+ {
+  if (!opened || blockNumber >= blockCount)
+  {
+   std::cerr << "Número de bloque inválido.\n";
+   return false;
+  }
+  MapEntry &entry = map[blockNumber];
+  if (entry.physical == 0)
+   continue;
+  if (shared(entry) && log.size() >= logBlocks * blockSize / sizeof(Remap))
+  {
+   std::cerr << "La tabla de remapeo de instantáneas está llena.\n";
+   return false;
+  }
+  if (shared(entry))
+   addRemap(snapshotList.back().id, (uint32_t)blockNumber, entry.physical);
+  else
+   release(entry.physical);
+  entry.physical = 0;
+  entry.epoch = currentEpoch;
+  mapDirty[blockNumber * sizeof(MapEntry) / blockSize] = 1;
+ }
+ return true;
+}
+
+bool SnapshotBlockDevice::readSnapshotBlock(uint32_t id, std::size_t blockNumber, char *buffer)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!opened || blockNumber >= blockCount || remaps.find(id) == remaps.end())
+ {
+  std::cerr << "Bloque o instantánea inválidos.\n";
+  return false;
+ }
+ counters.snapshotReads++;
+ for (auto it = remaps.find(id); it != remaps.end(); ++it)
+ {
+  auto found = it->second.find((uint32_t)blockNumber);
+  if (found != it->second.end())
+   return readPhysical(found->second, buffer);
+ }
+ return readPhysical(map[blockNumber].physical, buffer);
+}
+
+bool SnapshotBlockDevice::createSnapshot(uint32_t &id)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!opened)
+  return false;
+ if (snapshotList.size() >= maxSnapshots)
+ {
+  std::cerr << "Se alcanzó el máximo de " << maxSnapshots << " instantáneas.\n";
+  return false;
+ }
+ // La instantanea ve todo lo escrito hasta la epoca actual, que se cierra
+ SnapshotRecord record{};
+ record.id = currentEpoch;
+ record.created = (int64_t)std::time(nullptr);
+ snapshotList.push_back(record);
+ remaps[record.id];
+ currentEpoch++;
+ headerDirty = true;
+ if (!saveMetadata() || !inner->flush())
+ {
+  std::cerr << "Error guardando la instantánea.\n";
+  return false;
+ }
+ id = record.id;
+ return true;
+}
+
+// Las versiones que guardaba la instantanea pasan a la anterior si esta no tiene su propia
+// version de ese bloque (la anterior las leia a traves de esta); si no, se liberan
+bool SnapshotBlockDevice::deleteSnapshot(uint32_t id)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ auto it = remaps.find(id);
+ if (!opened || it == remaps.end())
+ {
+  std::cerr << "No existe la instantánea " << id << ".\n";
+  return false;
+ }
+ auto previous = it == remaps.begin() ? remaps.end() : std::prev(it);
+ for (const auto &entry : it->second)
+ {
+  if (previous != remaps.end() && previous->second.find(entry.first) == previous->second.end())
+   previous->second[entry.first] = entry.second;
+  else
+   release(entry.second);
+ }
+ remaps.erase(it);
+ views.erase(id);
+ snapshotList.erase(std::remove_if(snapshotList.begin(), snapshotList.end(), [id](const SnapshotRecord &r)
+                                   { return r.id == id; }),
+                    snapshotList.end());
+
+ log.clear();
+ for (const auto &snap : remaps)
+ {
+  for (const auto &entry : snap.second)
+   log.push_back(Remap{snap.first, entry.first, entry.second});
+ }
+ logRewrite = true;
+ headerDirty = true;
+ return true;
+}
+
+std::vector<SnapshotBlockDevice::SnapshotInfo> SnapshotBlockDevice::snapshots() const
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ std::vector<SnapshotInfo> list;
+ for (const SnapshotRecord &record : snapshotList)
+ {
+  SnapshotInfo info;
+  info.id = record.id;
+  info.created = record.created;
+  auto it = remaps.find(record.id);
+  if (it != remaps.end())
+   info.ownBlocks = (std::size_t)std::count_if(it->second.begin(), it->second.end(), [](const auto &entry)
+                                               { return entry.second != 0; });
+  list.push_back(info);
+ }
+ return list;
+}
+
+SnapshotView *SnapshotBlockDevice::snapshotDevice(uint32_t id)
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (remaps.find(id) == remaps.end())
+  return nullptr;
+ auto &view = views[id];
+ if (!view)
+  view = std::make_unique<SnapshotView>(*this, id);
+ return view.get();
+}
+
+// Tabla de remapeo (solo las entradas nuevas, o entera si se borro una instantanea),
+// despues el mapa y por ultimo la cabecera con la cantidad de entradas validas
+bool SnapshotBlockDevice::saveMetadata()
+{
+ std::size_t first = logRewrite ? 0 : logSaved;
+ if (first < log.size() || logRewrite)
+ {
+  const char *raw = reinterpret_cast<const char *>(log.data());
+  std::size_t total = log.size() * sizeof(Remap);
+  std::size_t firstBlock = first * sizeof(Remap) / blockSize;
+  std::size_t endBlock = (total + blockSize - 1) / blockSize;
+  for (std::size_t b = firstBlock; b < endBlock; b++)
+  {
+   std::size_t offset = b * blockSize;
+   if (!inner->writeBlock(logStart + b, raw + offset, std::min(blockSize, total - offset)))
+   {
+    std::cerr << "Error escribiendo la tabla de remapeo.\n";
+    return false;
+   }
+  }
+  logSaved = log.size();
+  logRewrite = false;
+  headerDirty = true;
+ }
+
+ const char *raw = reinterpret_cast<const char *>(map.data());
+ std::size_t total = map.size() * sizeof(MapEntry);
+ for (std::size_t i = 0; i < mapBlocks; i++)
+ {
+  if (!mapDirty[i])
+   continue;
+  std::size_t offset = i * blockSize;
+  if (!inner->writeBlock(mapStart + i, raw + offset, std::min(blockSize, total - offset)))
+  {
+   std::cerr << "Error escribiendo el mapa de instantáneas.\n";
+   return false;
+  }
+  mapDirty[i] = 0;
+ }
+
+ // La cabecera tiene la epoca, la lista de instantaneas y las entradas validas de la tabla
+ return !headerDirty || saveHeader();
+}
+
+// Orden: metadatos, flush de abajo; recien entonces se liberan los bloques fisicos que
+// ya no usa nadie y se descartan abajo
+bool SnapshotBlockDevice::flush()
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ if (!opened)
+  return false;
+ if (!saveMetadata() || !inner->flush())
+  return false;
+
+ std::vector<std::size_t> freed;
+ for (std::size_t index : pendingFree)
+ {
+  used[index] = 0;
+  freed.push_back(dataStart + index);
+ }
+ pendingFree.clear();
+ if (!freed.empty() && inner->supportsDiscard())
+  inner->discardBlocks(freed);
+ return true;
+}
+
+bool SnapshotBlockDevice::close()
+{
+ if (!opened)
+ {
+  std::cerr << "No hay dispositivo abierto.\n";
+  return false;
+ }
+ bool ok = flush();
+ views.clear();
+ opened = false;
+ return inner->close() && ok;
+}
+
+SnapshotBlockDevice::Stats SnapshotBlockDevice::stats() const
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ return counters;
+}
+
+std::size_t SnapshotBlockDevice::physicalBlocksInUse() const
+{
+ std::lock_guard<std::mutex> lock(mutex);
+ return (std::size_t)std::count(used.begin(), used.end(), 1) - pendingFree.size();
+}
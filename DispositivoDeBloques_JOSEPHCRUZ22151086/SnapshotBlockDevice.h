@@ -0,0 +1,163 @@
+#ifndef SNAPSHOTBLOCKDEVICE_H
+#define SNAPSHOTBLOCKDEVICE_H
+
+#include "IBlockDevice.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class SnapshotBlockDevice;
+
+// Instantanea vista como dispositivo de solo lectura (se puede montar un FS encima para
+// leer sus archivos). Pertenece al SnapshotBlockDevice y deja de ser valida si se borra la
+// instantanea.
+class SnapshotView : public IBlockDevice
+{
+public:
+ SnapshotView(SnapshotBlockDevice &parent, uint32_t id);
+
+ bool readBlock(std::size_t blockNumber, char *buffer) override;
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) override;
+ bool flush() override { return true; }
+ bool close() override { return true; }
+
+ uint32_t snapshotId() const { return id; }
+
+private:
+ SnapshotBlockDevice &parent;
+ uint32_t id;
+};
+
+// Capa de instantaneas copy-on-write sobre otro dispositivo.
+// Un mapa traduce cada bloque logico del volumen vivo a un bloque fisico de abajo, junto
+// con la epoca en la que se escribio. Crear una instantanea es O(1): solo se cierra la epoca
+// actual. Al sobrescribir un bloque escrito en una epoca que alguna instantanea ve, el dato
+// nuevo va a otro bloque fisico y el viejo queda anotado en la tabla de remapeo de la
+// instantanea mas reciente; los bloques que no comparte ninguna instantanea se escriben en
+// su lugar. Una instantanea lee cada bloque de la primera tabla con ese bloque entre ella y
+// las mas nuevas, y si ninguna lo tiene, del volumen vivo.
+//
+// Disposicion abajo: bloque 0 cabecera y lista de instantaneas, luego el mapa (8 bytes por
+// bloque logico), la tabla de remapeo (12 bytes por entrada, a lo sumo una por bloque fisico)
+// y los bloques fisicos de datos. Como en la capa de compresion, los bloques fisicos que
+// quedan libres se reutilizan recien despues de guardar los metadatos en flush().
+class SnapshotBlockDevice : public IBlockDevice
+{
+public:
+ struct SnapshotInfo
+ {
+  uint32_t id = 0;
+  int64_t created = 0;     // segundos desde epoch
+  std::size_t ownBlocks = 0; // bloques fisicos que solo conserva esta instantanea
+ };
+
+ struct Stats
+ {
+  uint64_t copies = 0;      // sobrescrituras redirigidas a un bloque nuevo
+  uint64_t inPlace = 0;     // sobrescrituras de bloques no compartidos
+  uint64_t snapshotReads = 0;
+ };
+
+ explicit SnapshotBlockDevice(std::unique_ptr<IBlockDevice> inner);
+ ~SnapshotBlockDevice() override;
+
+ // Escribe cabecera, mapa y tabla vacios. logicalBlocks = 0 ofrece 3/4 del espacio de
+ // datos y deja el resto para las copias.
+ bool create(std::size_t logicalBlocks = 0);
+ bool open();
+ // true si el dispositivo tiene la cabecera de esta capa
+ static bool hasSnapshots(IBlockDevice &device);
+
+ bool readBlock(std::size_t blockNumber, char *buffer) override;
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) override;
+ bool flush() override;
+ bool close() override;
+
+ bool discardBlocks(const std::vector<std::size_t> &blockNumbers) override;
+ bool supportsDiscard() const override { return true; }
+
+ IBlockDevice *underlying() override { return inner.get(); }
+
+ // Instantaneas. createSnapshot guarda la cabecera de inmediato.
+ bool createSnapshot(uint32_t &id);
+ bool deleteSnapshot(uint32_t id);
+ std::vector<SnapshotInfo> snapshots() const;
+ // Dispositivo de solo lectura con el contenido de la instantanea; nullptr si no existe
+ SnapshotView *snapshotDevice(uint32_t id);
+ bool readSnapshotBlock(uint32_t id, std::size_t blockNumber, char *buffer);
+
+ Stats stats() const;
+ std::size_t physicalBlocks() const { return used.size(); }
+ std::size_t physicalBlocksInUse() const;
+
+private:
+ // Entrada del mapa del volumen vivo tal como se guarda en disco
+ struct MapEntry
+ {
+  uint32_t physical; // bloque fisico + 1 (0 = nunca escrito, se lee en ceros)
+  uint32_t epoch;    // epoca en la que se escribio
+ };
+ static_assert(sizeof(MapEntry) == 8, "Cada entrada del mapa mide 8 bytes");
+
+ // Entrada de la tabla de remapeo: version del bloque que ve la instantanea
+ struct Remap
+ {
+  uint32_t snapshot;
+  uint32_t logical;
+  uint32_t physical; // igual que en MapEntry, 0 = el bloque estaba en ceros
+ };
+ static_assert(sizeof(Remap) == 12, "Cada entrada de remapeo mide 12 bytes");
+
+ struct SnapshotRecord
+ {
+  uint32_t id;
+  uint32_t reserved;
+  int64_t created;
+ };
+
+ static constexpr uint64_t header_magic = 0x3150414E53564544ULL; // "DEVSNAP1"
+ static constexpr std::size_t no_block = SIZE_MAX;
+
+ std::unique_ptr<IBlockDevice> inner;
+ mutable std::mutex mutex;
+ bool opened = false;
+
+ std::size_t mapStart = 1;
+ std::size_t mapBlocks = 0;
+ std::size_t logStart = 0;
+ std::size_t logBlocks = 0;
+ std::size_t dataStart = 0;
+ std::size_t maxSnapshots = 0;
+
+ uint32_t currentEpoch = 1;
+ std::vector<SnapshotRecord> snapshotList; // ordenadas por id (= epoca en que se tomaron)
+ std::vector<MapEntry> map;
+ std::vector<uint8_t> mapDirty;
+ // Tablas de remapeo: por instantanea, bloque logico -> fisico
+ std::map<uint32_t, std::unordered_map<uint32_t, uint32_t>> remaps;
+ std::vector<Remap> log;          // las mismas entradas, en el orden en que se guardan
+ std::size_t logSaved = 0;        // entradas de log que ya estan en disco
+ bool logRewrite = false;         // se borro una instantanea, la tabla se reescribe entera
+ bool headerDirty = false;
+
+ std::vector<uint8_t> used;       // por bloque fisico de datos
+ std::vector<std::size_t> pendingFree;
+ std::size_t cursor = 0;
+ std::map<uint32_t, std::unique_ptr<SnapshotView>> views;
+ Stats counters;
+
+ bool layout(std::size_t logicalBlocks, std::size_t innerBlocks);
+ bool saveHeader();
+ bool saveMetadata();
+ std::size_t allocate();
+ void release(uint32_t physical);
+ bool readPhysical(uint32_t physical, char *buffer);
+ bool shared(const MapEntry &entry) const;
+ void addRemap(uint32_t snapshot, uint32_t logical, uint32_t physical);
+};
+
+#endif // SNAPSHOTBLOCKDEVICE_H
@@ -0,0 +1,376 @@
+#include "StripedBlockDevice.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+// Cabecera en el bloque 0 de cada miembro
+struct StripeHeader
+{
+ uint64_t magic;
+ uint64_t arrayId;     // igual en todos los miembros del mismo arreglo
+ uint32_t memberIndex; // posicion de este miembro en el arreglo
+ uint32_t memberCount;
+ uint64_t stripeBlocks;
+ uint64_t blockSize;
+};
+
+StripedBlockDevice::StripedBlockDevice(std::vector<std::unique_ptr<IBlockDevice>> memberDevices)
+    : members(std::move(memberDevices)), counters(new Counters[members.size()])
+{
+ blockSize = members.empty() ? 0 : members[0]->blockSize;
+ memberBlocks.resize(members.size());
+ memberReads.resize(members.size());
+ memberWrites.resize(members.size());
+}
+
+StripedBlockDevice::~StripedBlockDevice()
+{
+ if (opened)
+  close();
+}
+
+bool StripedBlockDevice::isStriped(IBlockDevice &device)
+{
+ if (device.blockSize < sizeof(StripeHeader) || device.blockCount == 0)
+  return false;
+ std::vector<char> raw(device.blockSize);
+ if (!device.readBlock(0, raw.data()))
+  return false;
+ StripeHeader header;
+ std::memcpy(&header, raw.data(), sizeof(header));
+ return header.magic == header_magic;
+}
+
+// Capacidad: cada miembro aporta la misma cantidad de franjas completas (la del mas chico)
+bool StripedBlockDevice::setGeometry(std::size_t stripe)
+{
+ if (members.size() < 2 || stripe == 0)
+ {
+  std::cerr << "Un arreglo en franjas necesita al menos 2 miembros y una unidad de franja mayor a 0.\n";
+  return false;
+ }
+ std::size_t smallest = SIZE_MAX;
+ for (auto &m : members)
+ {
+  if (m->blockSize != blockSize || m->blockSize < sizeof(StripeHeader))
+  {
+   std::cerr << "Todos los miembros deben tener el mismo tamaño de bloque.\n";
+   return false;
+  }
+  smallest = std::min(smallest, m->blockCount);
+ }
+ std::size_t rows = smallest > data_start ? (smallest - data_start) / stripe : 0;
+ if (rows == 0)
+ {
+  std::cerr << "Los miembros son demasiado chicos para la unidad de franja.\n";
+  return false;
+ }
+ stripeBlocks = stripe;
+ blockCount = rows * stripe * members.size();
+ return true;
+}
+
+bool StripedBlockDevice::create(std::size_t stripe)
+{
+ if (!setGeometry(stripe))
+  return false;
+
+ StripeHeader header{};
+ header.magic = header_magic;
+ header.arrayId = ((uint64_t)std::random_device{}() << 32) | std::random_device{}();
+ header.memberCount = (uint32_t)members.size();
+ header.stripeBlocks = stripeBlocks;
+ header.blockSize = blockSize;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  header.memberIndex = (uint32_t)i;
+  if (!members[i]->writeBlock(0, reinterpret_cast<const char *>(&header), sizeof(header)) || !members[i]->flush())
+  {
+   std::cerr << "Error escribiendo la cabecera del miembro " << i << ".\n";
+   return false;
+  }
+ }
+
+ threads.start(members.size());
+ opened = true;
+ return true;
+}
+
+bool StripedBlockDevice::open()
+{
+ if (members.empty() || blockSize < sizeof(StripeHeader))
+  return false;
+
+ std::vector<StripeHeader> headers(members.size());
+ std::vector<char> raw(blockSize);
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (members[i]->blockSize != blockSize || !members[i]->readBlock(0, raw.data()))
+  {
+   std::cerr << "Error leyendo la cabecera del miembro " << i << ".\n";
+   return false;
+  }
+  std::memcpy(&headers[i], raw.data(), sizeof(StripeHeader));
+  if (headers[i].magic != header_magic)
+  {
+   std::cerr << "El miembro " << i << " no pertenece a un arreglo en franjas.\n";
+   return false;
+  }
+ }
+
+ // Todos del mismo arreglo, con la misma geometria, y cada posicion una sola vez
+ std::vector<std::unique_ptr<IBlockDevice>> ordered(members.size());
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  const StripeHeader &h = headers[i];
+  if (h.arrayId != headers[0].arrayId || h.memberCount != members.size() || h.stripeBlocks != headers[0].stripeBlocks ||
+      h.blockSize != blockSize || h.memberIndex >= members.size() || ordered[h.memberIndex])
+  {
+   std::cerr << "Los miembros no forman un arreglo completo (" << headers[0].memberCount << " miembros esperados).\n";
+   return false;
+  }
+  ordered[h.memberIndex] = std::move(members[i]);
+ }
+ members = std::move(ordered);
+
+ if (!setGeometry((std::size_t)headers[0].stripeBlocks))
+  return false;
+ threads.start(members.size());
+ opened = true;
+ return true;
+}
+
+bool StripedBlockDevice::close()
+{
+ if (!opened)
+  return false;
+ bool ok = flush();
+ threads.stop();
+ for (auto &m : members)
+  ok = m->close() && ok;
+ opened = false;
+ return ok;
+}
+
+void StripedBlockDevice::map(std::size_t blockNumber, std::size_t &memberIndex, std::size_t &memberBlock) const
+{
+ std::size_t stripe = blockNumber / stripeBlocks;
+ memberIndex = stripe % members.size();
+ memberBlock = data_start + (stripe / members.size()) * stripeBlocks + blockNumber % stripeBlocks;
+}
+
+bool StripedBlockDevice::readBlock(std::size_t blockNumber, char *buffer)
+{
+ if (blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque fuera de rango.\n";
+  return false;
+ }
+ std::size_t index, memberBlock;
+ map(blockNumber, index, memberBlock);
+ counters[index].reads++;
+ return members[index]->readBlock(memberBlock, buffer);
+}
+
+bool StripedBlockDevice::writeBlock(std::size_t blockNumber, const char *data, std::size_t size)
+{
+ if (blockNumber >= blockCount)
+ {
+  std::cerr << "Número de bloque fuera de rango.\n";
+  return false;
+ }
+ std::size_t index, memberBlock;
+ map(blockNumber, index, memberBlock);
+ counters[index].writes++;
+ return members[index]->writeBlock(memberBlock, data, size);
+}
+
+// Reparte un lote entre los miembros; cada sublote queda en el orden original
+template <typename BufferPtr>
+void StripedBlockDevice::distribute(const std::vector<std::size_t> &blockNumbers, const std::vector<BufferPtr> &buffers,
+                                    std::vector<std::vector<BufferPtr>> &memberBuffers)
+{
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  memberBlocks[i].clear();
+  memberBuffers[i].clear();
+ }
+ for (std::size_t i = 0; i < blockNumbers.size(); i++)
+ {
+  std::size_t index, memberBlock;
+  map(blockNumbers[i], index, memberBlock);
+  memberBlocks[index].push_back(memberBlock);
+  memberBuffers[index].push_back(buffers[i]);
+ }
+}
+
+bool StripedBlockDevice::readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+ {
+  std::cerr << "La cantidad de bloques y de buffers no coincide.\n";
+  return false;
+ }
+ for (auto blk : blockNumbers)
+ {
+  if (blk >= blockCount)
+  {
+   std::cerr << "Número de bloque fuera de rango.\n";
+   return false;
+  }
+ }
+ std::lock_guard<std::mutex> lock(batchMutex);
+ distribute(blockNumbers, buffers, memberReads);
+ return dispatch(Operation::Read);
+}
+
+bool StripedBlockDevice::writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers)
+{
+ if (blockNumbers.size() != buffers.size())
+ {
+  std::cerr << "La cantidad de bloques y de buffers no coincide.\n";
+  return false;
+ }
+ for (auto blk : blockNumbers)
+ {
+  if (blk >= blockCount)
+  {
+   std::cerr << "Número de bloque fuera de rango.\n";
+   return false;
+  }
+ }
+ std::lock_guard<std::mutex> lock(batchMutex);
+ distribute(blockNumbers, buffers, memberWrites);
+ return dispatch(Operation::Write);
+}
+
+// El fsync de cada disco es lo mas lento, se hacen todos al mismo tiempo
+bool StripedBlockDevice::flush()
+{
+ if (!opened)
+  return false;
+ std::lock_guard<std::mutex> lock(batchMutex);
+ return dispatch(Operation::Flush);
+}
+
+bool StripedBlockDevice::discardBlocks(const std::vector<std::size_t> &blockNumbers)
+{
+ std::lock_guard<std::mutex> lock(batchMutex);
+ for (auto &blocks : memberBlocks)
+  blocks.clear();
+ for (auto blk : blockNumbers)
+ {
+  if (blk >= blockCount)
+   continue;
+  std::size_t index, memberBlock;
+  map(blk, index, memberBlock);
+  memberBlocks[index].push_back(memberBlock);
+ }
+ bool ok = true;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (!memberBlocks[i].empty())
+   ok = members[i]->discardBlocks(memberBlocks[i]) && ok;
+ }
+ return ok;
+}
+
+bool StripedBlockDevice::supportsDiscard() const
+{
+ for (auto &m : members)
+ {
+  if (!m->supportsDiscard())
+   return false;
+ }
+ return !members.empty();
+}
+
+BlockView StripedBlockDevice::blockView(std::size_t blockNumber) const
+{
+ if (blockNumber >= blockCount)
+  return BlockView();
+ std::size_t index, memberBlock;
+ map(blockNumber, index, memberBlock);
+ counters[index].reads++;
+ return members[index]->blockView(memberBlock);
+}
+
+void StripedBlockDevice::recordRead(std::size_t firstBlock, std::size_t count, bool ok, uint64_t startNanos)
+{
+ for (std::size_t b = firstBlock; b < firstBlock + count && b < blockCount; b++)
+ {
+  std::size_t index, memberBlock;
+  map(b, index, memberBlock);
+  members[index]->recordRead(memberBlock, 1, ok, startNanos);
+ }
+}
+
+bool StripedBlockDevice::providesViews() const
+{
+ for (auto &m : members)
+ {
+  if (!m->providesViews())
+   return false;
+ }
+ return !members.empty();
+}
+
+bool StripedBlockDevice::requiresAlignment() const
+{
+ for (auto &m : members)
+ {
+  if (m->requiresAlignment())
+   return true;
+ }
+ return false;
+}
+
+std::size_t StripedBlockDevice::bufferAlignment() const
+{
+ std::size_t alignment = 1;
+ for (auto &m : members)
+  alignment = std::max(alignment, m->bufferAlignment());
+ return alignment;
+}
+
+StripedBlockDevice::MemberStats StripedBlockDevice::memberStats(std::size_t index) const
+{
+ MemberStats st;
+ st.reads = counters[index].reads.load();
+ st.writes = counters[index].writes.load();
+ return st;
+}
+
+// Sublote de un miembro para la operacion en curso
+bool StripedBlockDevice::runMember(std::size_t index)
+{
+ IBlockDevice &m = *members[index];
+ switch (operation)
+ {
+ case Operation::Read:
+  counters[index].reads += memberBlocks[index].size();
+  return m.readBlocks(memberBlocks[index], memberReads[index]);
+ case Operation::Write:
+  counters[index].writes += memberBlocks[index].size();
+  return m.writeBlocks(memberBlocks[index], memberWrites[index]);
+ case Operation::Flush:
+  return m.flush();
+ }
+ return false;
+}
+
+// Ejecuta la operacion en paralelo en todos los miembros con trabajo.
+// Se llama con batchMutex tomado.
+bool StripedBlockDevice::dispatch(Operation op)
+{
+ operation = op;
+ std::vector<std::size_t> involved;
+ for (std::size_t i = 0; i < members.size(); i++)
+ {
+  if (op == Operation::Flush || !memberBlocks[i].empty())
+   involved.push_back(i);
+ }
+ return threads.run(involved, [this](std::size_t index)
+                    { return runMember(index); });
+}
@@ -0,0 +1,104 @@
+#ifndef STRIPEDBLOCKDEVICE_H
+#define STRIPEDBLOCKDEVICE_H
+
+#include "IBlockDevice.h"
+#include "MemberThreads.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Arreglo en franjas (RAID-0) sobre varios dispositivos, normalmente imagenes en discos
+// distintos del host. Los bloques logicos se reparten en franjas de stripeBlocks bloques:
+// la franja k va al miembro k % miembros, asi las lecturas y escrituras secuenciales se
+// reparten entre todos. No hay redundancia: si falla un miembro se pierde el arreglo.
+//
+// Cada miembro guarda en su bloque 0 una cabecera con el identificador del arreglo, su
+// posicion y la unidad de franja; open() acepta los miembros en cualquier orden.
+// Los lotes (readBlocks/writeBlocks) y flush() se reparten por miembro y cada miembro tiene
+// un hilo propio, asi la E/S de todos los discos ocurre al mismo tiempo. Dentro de cada
+// miembro el lote conserva el orden y los bloques consecutivos se siguen agrupando.
+class StripedBlockDevice : public IBlockDevice
+{
+public:
+ struct MemberStats
+ {
+  uint64_t reads = 0;  // bloques leidos de este miembro
+  uint64_t writes = 0; // bloques escritos en este miembro
+ };
+
+ explicit StripedBlockDevice(std::vector<std::unique_ptr<IBlockDevice>> members);
+ ~StripedBlockDevice() override;
+
+ // Escribe las cabeceras en todos los miembros (deben tener el mismo tamaño de bloque)
+ bool create(std::size_t stripeBlocks);
+ bool open();
+ // true si el dispositivo es miembro de un arreglo en franjas
+ static bool isStriped(IBlockDevice &device);
+
+ bool readBlock(std::size_t blockNumber, char *buffer) override;
+ bool writeBlock(std::size_t blockNumber, const char *data, std::size_t size) override;
+ bool readBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<char *> &buffers) override;
+ bool writeBlocks(const std::vector<std::size_t> &blockNumbers, const std::vector<const char *> &buffers) override;
+ bool flush() override;
+ bool close() override;
+
+ bool discardBlocks(const std::vector<std::size_t> &blockNumbers) override;
+ bool supportsDiscard() const override;
+
+ BlockView blockView(std::size_t blockNumber) const override;
+ bool providesViews() const override;
+ // Las lecturas por vista se anotan en el miembro que tiene cada bloque
+ void recordRead(std::size_t firstBlock, std::size_t count, bool ok, uint64_t startNanos) override;
+
+ bool requiresAlignment() const override;
+ std::size_t bufferAlignment() const override;
+
+ std::size_t memberCount() const { return members.size(); }
+ IBlockDevice &member(std::size_t index) { return *members[index]; }
+ std::size_t stripeUnit() const { return stripeBlocks; }
+ MemberStats memberStats(std::size_t index) const;
+
+private:
+ enum class Operation
+ {
+  Read,
+  Write,
+  Flush
+ };
+
+ struct Counters
+ {
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> writes{0};
+ };
+
+ std::vector<std::unique_ptr<IBlockDevice>> members;
+ std::unique_ptr<Counters[]> counters;
+ std::size_t stripeBlocks = 0;
+ bool opened = false;
+
+ // Lote en curso, repartido por miembro (protegido por batchMutex)
+ std::mutex batchMutex;
+ Operation operation = Operation::Read;
+ std::vector<std::vector<std::size_t>> memberBlocks;
+ std::vector<std::vector<char *>> memberReads;
+ std::vector<std::vector<const char *>> memberWrites;
+
+ MemberThreads threads;
+
+ void map(std::size_t blockNumber, std::size_t &memberIndex, std::size_t &memberBlock) const;
+ bool setGeometry(std::size_t stripe);
+ bool runMember(std::size_t index);
+ bool dispatch(Operation op);
+ template <typename BufferPtr>
+ void distribute(const std::vector<std::size_t> &blockNumbers, const std::vector<BufferPtr> &buffers,
+                 std::vector<std::vector<BufferPtr>> &memberBuffers);
+
+ static constexpr std::size_t data_start = 1; // bloque 0 de cada miembro: cabecera
+ static constexpr uint64_t header_magic = 0x3150525453564544ULL; // "DEVSTRP1"
+};
+
+#endif // STRIPEDBLOCKDEVICE_H
@@ -2,8 +2,37 @@
 #define SUPERBLOCK_H
 
 #include <cstdint>
+#include <vector>
 
+// Rango de bloques contiguos
+struct Extent
+{
+ uint64_t start;
+ uint64_t count;
+};
+
+// Geometria del FS en memoria. Las dos versiones del formato en disco se traducen a esta
+// al cargar y desde esta al guardar.
 struct SuperBlock
+{
+ uint32_t version = 0;
+ uint32_t blockSize = 0;
+ uint64_t blockCount = 0;
+ uint64_t inodeCount = 0;          // Cantidad total de inodos
+ uint64_t dataStart = 0;           // Bloque inicial de datos (lo que agrega grow va despues)
+ uint32_t features = 0;            // SUPERBLOCK_FEATURE_*, solo formato 2
+ uint64_t rootInode = 0;           // directorio raiz, con SUPERBLOCK_FEATURE_DIRECTORIES
+ std::vector<Extent> bitmapExtents; // bloques del mapa de bloques libres, en orden
+ std::vector<Extent> inodeExtents;  // tablas de inodos, en orden
+};
+
+// Formato 1 (el original): numeros de bloque de 32 bits. El mapa y las tablas de inodos que
+// agrego grow van al final; las imagenes formateadas antes los tienen en cero, lo que
+// significa un solo bloque de mapa (el 1) y una sola tabla de inodos
+constexpr uint32_t MAX_BITMAP_BLOCKS = 64; // con bloques de 1024 bytes: 64*8192 bloques
+constexpr uint32_t MAX_INODE_GROUPS = 16;
+
+struct SuperBlockV1
 {
  uint32_t blockSize;
  uint32_t blockCount;
@@ -11,6 +40,42 @@ struct SuperBlock
  uint32_t inodeBlocks; // Cantidad de bloques de inodos
  uint32_t inodeCount;  // Cantidad total de inodos
  uint32_t dataStart;   // Bloque inicial de datos
+
+ uint32_t bitmapCount;                         // bloques del mapa de bloques libres
+ uint32_t inodeGroupCount;                     // tablas de inodos agregadas al crecer
+ uint32_t bitmapLocations[MAX_BITMAP_BLOCKS];  // el bloque k del mapa cubre k*blockSize*8 en adelante
+ uint32_t inodeGroupStart[MAX_INODE_GROUPS];   // cada tabla agregada es contigua
+ uint32_t inodeGroupBlocks[MAX_INODE_GROUPS];
+};
+
+// Formato 2: numeros de bloque de 64 bits, el mapa y los inodos como listas de rangos.
+// Empieza con un numero magico que no puede confundirse con blockSize/blockCount del formato 1
+constexpr uint64_t SUPERBLOCK_V2_MAGIC = 0x3253464C504D4953ULL; // "SIMPLFS2"
+constexpr uint32_t MAX_BITMAP_EXTENTS = 16;
+constexpr uint32_t MAX_INODE_EXTENTS = 8;
+
+// Funciones opcionales del formato 2
+// Directorios: los archivos se buscan por ruta, bajando desde rootInode por el arbol de
+// entradas de cada directorio. Sin esta hay un solo espacio de nombres plano
+constexpr uint32_t SUPERBLOCK_FEATURE_DIRECTORIES = 1;
+
+struct SuperBlockV2
+{
+ uint64_t magic;
+ uint32_t version; // 2
+ uint32_t blockSize;
+ uint64_t blockCount;
+ uint64_t inodeCount;
+ uint64_t dataStart;
+ uint32_t inodeSize; // bytes de cada inodo en la tabla
+ uint16_t bitmapExtentCount;
+ uint16_t inodeExtentCount;
+ Extent bitmapExtents[MAX_BITMAP_EXTENTS];
+ Extent inodeExtents[MAX_INODE_EXTENTS];
+ uint32_t features; // en cero en las imagenes anteriores a este campo
+ uint32_t reserved;
+ uint64_t rootInode;
 };
+static_assert(sizeof(SuperBlockV2) <= 512, "El SuperBlock del formato 2 debe entrar en un bloque de 512 bytes");
 
 #endif // SUPERBLOCK_H
@@ -0,0 +1,219 @@
+// Reproduce una traza grabada con BlockDevice::startTrace (comando trace del REPL) sobre una
+// imagen y mide throughput y latencia.
+//
+// Uso: TraceReplay <traza> <imagen> [stream|mmap|pread|direct] [original] [lecturas]
+//   original: respeta los tiempos de la traza (por defecto va tan rapido como puede)
+//   lecturas: omite escrituras y descartes, para reproducir sobre una imagen que no se
+//             puede modificar
+//
+// Las llamadas se emiten desde un solo hilo en el orden en que empezaron; los lotes se
+// vuelven a armar igual que en la traza. Como la traza no guarda los datos, las escrituras
+// llevan un patron que depende del numero de bloque.
+#include "BlockDevice.h"
+#include "BlockTrace.h"
+#include "IoStats.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static void fillPattern(char *buffer, std::size_t blockNumber, std::size_t size)
+{
+ std::memset(buffer, (int)(blockNumber % 251) + 1, size);
+ std::memcpy(buffer, &blockNumber, std::min(size, sizeof(blockNumber)));
+}
+
+static void printLatency(const char *label, const Histogram::Summary &lat)
+{
+ std::cout << "    " << label << " ns: p50 " << lat.percentile(0.50) << "  p90 " << lat.percentile(0.90) << "  p99 "
+           << lat.percentile(0.99) << "  max " << lat.max << "  media " << lat.mean() << "\n";
+}
+
+int main(int argc, char *argv[])
+{
+ if (argc < 3)
+ {
+  std::cerr << "Uso: " << argv[0] << " <traza> <imagen> [stream|mmap|pread|direct] [original] [lecturas]\n";
+  return 2;
+ }
+
+ BlockDevice::Backend backend = BlockDevice::Backend::Stream;
+ bool originalTiming = false;
+ bool readsOnly = false;
+ for (int i = 3; i < argc; i++)
+ {
+  std::string option = argv[i];
+  if (option == "stream")
+   backend = BlockDevice::Backend::Stream;
+  else if (option == "mmap")
+   backend = BlockDevice::Backend::Mmap;
+  else if (option == "pread")
+   backend = BlockDevice::Backend::Pread;
+  else if (option == "direct")
+   backend = BlockDevice::Backend::Direct;
+  else if (option == "original")
+   originalTiming = true;
+  else if (option == "lecturas")
+   readsOnly = true;
+  else
+  {
+   std::cerr << "Opción desconocida: " << option << "\n";
+   return 2;
+  }
+ }
+
+ TraceHeader header;
+ std::vector<TraceRecord> records;
+ if (!loadTrace(argv[1], header, records))
+  return 1;
+
+ BlockDevice image;
+ if (!image.open(argv[2], backend))
+  return 1;
+ if (image.blockSize != header.blockSize)
+ {
+  std::cerr << "La traza es de bloques de " << header.blockSize << " bytes y la imagen de " << image.blockSize << ".\n";
+  return 1;
+ }
+ for (const TraceRecord &r : records)
+ {
+  if (r.block + r.count > image.blockCount)
+  {
+   std::cerr << "La traza usa el bloque " << r.block + r.count - 1 << " y la imagen tiene " << image.blockCount
+             << " bloques.\n";
+   return 1;
+  }
+ }
+
+ // Los registros quedaron en el orden en que terminaron las llamadas; se reproducen en el
+ // orden en que empezaron. Las rachas de un mismo lote tienen el mismo tiempo y el orden
+ // estable las deja juntas.
+ std::stable_sort(records.begin(), records.end(),
+                  [](const TraceRecord &a, const TraceRecord &b)
+                  { return a.time < b.time; });
+
+ Histogram recorded[IoStats::op_count];
+ std::vector<std::size_t> blocks;
+ std::vector<char> data;
+ std::vector<char *> readBuffers;
+ std::vector<const char *> writeBuffers;
+ uint64_t calls = 0;
+ uint64_t skipped = 0;
+ uint64_t failed = 0;
+ uint64_t originalFailures = 0;
+ Histogram lag; // con original: cuanto se atraso cada llamada respecto de la traza
+
+ image.resetIoStats();
+ uint64_t begin = IoStats::now();
+ std::size_t i = 0;
+ while (i < records.size())
+ {
+  // Un registro, o un lote completo (el primero y los que lo continuan)
+  const TraceRecord &head = records[i];
+  std::size_t end = i + 1;
+  while (end < records.size() && (records[end].flags & TRACE_CONTINUES) && records[end].op == head.op &&
+         records[end].time == head.time)
+   end++;
+  bool batch = (head.flags & TRACE_BATCH) != 0;
+  IoStats::Op op = (IoStats::Op)head.op;
+
+  if (readsOnly && (op == IoStats::Op::Write || op == IoStats::Op::Discard))
+  {
+   skipped++;
+   i = end;
+   continue;
+  }
+
+  blocks.clear();
+  for (std::size_t k = i; k < end; k++)
+   for (uint32_t b = 0; b < records[k].count; b++)
+    blocks.push_back(records[k].block + b);
+  if (op == IoStats::Op::Read || op == IoStats::Op::Write)
+  {
+   if (data.size() < blocks.size() * image.blockSize)
+    data.resize(blocks.size() * image.blockSize);
+   readBuffers.clear();
+   writeBuffers.clear();
+   for (std::size_t k = 0; k < blocks.size(); k++)
+   {
+    char *buffer = data.data() + k * image.blockSize;
+    if (op == IoStats::Op::Write)
+     fillPattern(buffer, blocks[k], image.blockSize);
+    readBuffers.push_back(buffer);
+    writeBuffers.push_back(buffer);
+   }
+  }
+
+  if (originalTiming)
+  {
+   uint64_t target = begin + head.time;
+   uint64_t now = IoStats::now();
+   if (now < target)
+    std::this_thread::sleep_for(std::chrono::nanoseconds(target - now));
+   now = IoStats::now();
+   lag.record(now > target ? now - target : 0);
+  }
+
+  bool ok = false;
+  switch (op)
+  {
+  case IoStats::Op::Read:
+   ok = batch ? image.readBlocks(blocks, readBuffers) : image.readBlock(head.block, readBuffers[0]);
+   break;
+  case IoStats::Op::Write:
+   ok = batch ? image.writeBlocks(blocks, writeBuffers) : image.writeBlock(head.block, writeBuffers[0], head.size);
+   break;
+  case IoStats::Op::Flush:
+   ok = image.flush();
+   break;
+  case IoStats::Op::Discard:
+   ok = image.discardBlocks(blocks);
+   break;
+  }
+
+  calls++;
+  if (!ok)
+   failed++;
+  if (!(head.flags & TRACE_OK))
+   originalFailures++;
+  recorded[head.op].record(head.duration);
+  i = end;
+ }
+ uint64_t elapsed = IoStats::now() - begin;
+
+ IoStats::Summary st = image.ioStats();
+ double seconds = (double)elapsed / 1e9;
+ uint64_t bytes = st.op(IoStats::Op::Read).bytes + st.op(IoStats::Op::Write).bytes;
+ std::cout << "Traza: " << records.size() << " registros, " << calls << " llamadas reproducidas";
+ if (skipped > 0)
+  std::cout << ", " << skipped << " omitidas";
+ std::cout << "\n";
+ std::cout << "Tiempo: " << seconds << " s  (" << (seconds > 0 ? calls / seconds : 0) << " llamadas/s, "
+           << (seconds > 0 ? bytes / seconds / (1024 * 1024) : 0) << " MB/s)\n";
+ if (failed > 0 || originalFailures > 0)
+  std::cout << "Fallidas: " << failed << " (en la traza original: " << originalFailures << ")\n";
+
+ const IoStats::Op ops[] = {IoStats::Op::Read, IoStats::Op::Write, IoStats::Op::Flush, IoStats::Op::Discard};
+ for (IoStats::Op op : ops)
+ {
+  const IoStats::OpSummary &o = st.op(op);
+  Histogram::Summary original = recorded[(std::size_t)op].summary();
+  if (o.calls == 0 && original.count == 0)
+   continue;
+  std::cout << "  " << IoStats::opName(op) << ": " << o.calls << " llamadas, " << o.blocks << " bloques\n";
+  printLatency("traza     ", original);
+  printLatency("reproducida", o.latency);
+ }
+ if (originalTiming)
+ {
+  Histogram::Summary l = lag.summary();
+  std::cout << "  atraso respecto de la traza ns: p50 " << l.percentile(0.50) << "  p99 " << l.percentile(0.99)
+            << "  max " << l.max << "\n";
+ }
+
+ image.close();
+ return failed == 0 ? 0 : 1;
+}
@@ -1,9 +1,19 @@
 #include "BlockDevice.h"
+#include "RamBlockDevice.h"
+#include "RemoteBlockDevice.h"
+#include "Crc32c.h"
+#include "CompressedBlockDevice.h"
+#include "StripedBlockDevice.h"
+#include "MirroredBlockDevice.h"
+#include "SnapshotBlockDevice.h"
 #include "FileSystem.h"
 #include <iostream>
 #include <sstream>
 #include <vector>
 #include <string>
+#include <memory>
+#include <ctime>
+#include <algorithm>
 
 static std::vector<std::string> splitInput(const std::string &input)
 {
@@ -17,10 +27,133 @@ static std::vector<std::string> splitInput(const std::string &input)
  return tokens;
 }
 
+// La imagen en archivo debajo de las capas (compresion, etc.), si la hay
+static BlockDevice *imageOf(IBlockDevice *device)
+{
+ while (device)
+ {
+  if (BlockDevice *image = dynamic_cast<BlockDevice *>(device))
+   return image;
+  device = device->underlying();
+ }
+ return nullptr;
+}
+
+// La capa de compresion, que puede estar debajo de la de instantaneas
+static CompressedBlockDevice *compressedLayerOf(IBlockDevice *device)
+{
+ while (device)
+ {
+  if (CompressedBlockDevice *layer = dynamic_cast<CompressedBlockDevice *>(device))
+   return layer;
+  device = device->underlying();
+ }
+ return nullptr;
+}
+
+// Imagenes del dispositivo: la de abajo de las capas, o la de cada miembro de un arreglo
+static std::vector<BlockDevice *> imagesOf(IBlockDevice *device)
+{
+ std::vector<BlockDevice *> images;
+ if (StripedBlockDevice *array = dynamic_cast<StripedBlockDevice *>(device))
+ {
+  for (std::size_t i = 0; i < array->memberCount(); i++)
+   images.push_back(imageOf(&array->member(i)));
+ }
+ else if (MirroredBlockDevice *array = dynamic_cast<MirroredBlockDevice *>(device))
+ {
+  for (std::size_t i = 0; i < array->memberCount(); i++)
+   images.push_back(imageOf(&array->member(i)));
+ }
+ else if (BlockDevice *image = imageOf(device))
+ {
+  images.push_back(image);
+ }
+ return images;
+}
+
+static void printIoStats(const IoStats::Summary &st, std::size_t blockSize)
+{
+ const IoStats::Op ops[] = {IoStats::Op::Read, IoStats::Op::Write, IoStats::Op::Flush, IoStats::Op::Discard};
+ for (IoStats::Op op : ops)
+ {
+  const IoStats::OpSummary &o = st.op(op);
+  if (o.calls == 0)
+   continue;
+  const Histogram::Summary &lat = o.latency;
+  std::cout << "  " << IoStats::opName(op) << ": " << o.calls << " llamadas";
+  if (op != IoStats::Op::Flush)
+   std::cout << ", " << o.blocks << " bloques (" << o.bytes << " bytes)";
+  if (o.errors > 0)
+   std::cout << ", " << o.errors << " con error";
+  std::cout << "\n";
+  std::cout << "    latencia ns: min " << lat.min << "  media " << lat.mean() << "  p50 " << lat.percentile(0.50)
+            << "  p90 " << lat.percentile(0.90) << "  p99 " << lat.percentile(0.99) << "  p99.9 "
+            << lat.percentile(0.999) << "  max " << lat.max << "\n";
+  if (lat.sum > 0 && op != IoStats::Op::Flush && op != IoStats::Op::Discard)
+   std::cout << "    " << (double)o.blocks * blockSize / lat.sum << " GB/s dentro de las llamadas\n";
+ }
+ uint64_t accesses = st.sequential + st.seeks;
+ if (accesses > 0)
+ {
+  std::cout << "  accesos: " << st.sequential << " secuenciales, " << st.seeks << " con salto ("
+            << 100.0 * st.seeks / accesses << "%)\n";
+  if (st.seeks > 0)
+   std::cout << "    distancia en bloques: media " << st.seekDistance.mean() << "  p50 "
+             << st.seekDistance.percentile(0.50) << "  p99 " << st.seekDistance.percentile(0.99) << "  max "
+             << st.seekDistance.max << "\n";
+ }
+}
+
+// Monta sobre device las capas que indica su contenido (compresion, instantaneas); cada
+// capa pasa a ser duena de la de abajo y device queda apuntando a la de arriba
+static bool stackLayers(IBlockDevice *&device)
+{
+ bool opened = true;
+ if (CompressedBlockDevice::isCompressed(*device))
+ {
+  // El FS se monta sobre la capa de compresion, que pasa a ser duena de la imagen
+  CompressedBlockDevice *layer = new CompressedBlockDevice(std::unique_ptr<IBlockDevice>(device));
+  device = layer;
+  opened = layer->open();
+  if (opened)
+   std::cout << "Compresión activa: " << layer->blockCount << " bloques lógicos.\n";
+ }
+ if (opened && SnapshotBlockDevice::hasSnapshots(*device))
+ {
+  SnapshotBlockDevice *layer = new SnapshotBlockDevice(std::unique_ptr<IBlockDevice>(device));
+  device = layer;
+  opened = layer->open();
+  if (opened)
+   std::cout << "Instantáneas activas: " << layer->snapshots().size() << " guardadas, " << layer->blockCount
+             << " bloques lógicos.\n";
+ }
+ return opened;
+}
+
+static bool parseBackend(const std::string &name, BlockDevice::Backend &backend)
+{
+ if (name == "stream")
+  backend = BlockDevice::Backend::Stream;
+ else if (name == "mmap")
+  backend = BlockDevice::Backend::Mmap;
+ else if (name == "pread")
+  backend = BlockDevice::Backend::Pread;
+ else if (name == "direct")
+  backend = BlockDevice::Backend::Direct;
+ else
+  return false;
+ return true;
+}
+
 int main()
 {
- BlockDevice *device = nullptr;
+ IBlockDevice *device = nullptr;
  FileSystem *fs = nullptr;
+ std::size_t cacheBlocks = 0; // bloques de la cache del FS, 0 = sin cache
+ std::size_t readAheadWindow = 0; // ventana maxima de lectura anticipada, 0 = desactivada
+ bool discardFreed = true;        // perforar en el host los bloques que el FS libera
+ bool dedupWrites = false;        // compartir bloques de datos con el mismo contenido
  std::string command;
 
  std::cout << "SISTEMA DE ARCHIVOS SIMPLE + DISPOSITIVO DE BLOQUES\n";
@@ -44,34 +177,112 @@ int main()
   {
    std::cout << "Comandos disponibles:\n";
    std::cout << "Parte 1 (Dispositivo Bloques):\n";
-   std::cout << "  create <nombre> <tamaño_bloque> <cantidad_bloques>\n";
-   std::cout << "  open <nombre>\n";
+   std::cout << "  create <nombre> <tamaño_bloque> <cantidad_bloques> [aligned] [sparse|reserve|zero] [checksum] [compressed] [snapshots]\n";
+   std::cout << "  open <nombre> [stream|mmap|pread|direct]\n";
+   std::cout << "  ram <tamaño_bloque> <cantidad_bloques>\n";
+   std::cout << "  connect <socket>\n";
+   std::cout << "  stripe create <unidad_bloques> <imagen1> <imagen2> [...]\n";
+   std::cout << "  stripe open <imagen1> <imagen2> [...] [stream|mmap|pread|direct]\n";
+   std::cout << "  stripe\n";
+   std::cout << "  mirror create <bloques_por_region> <imagen1> <imagen2> [...]\n";
+   std::cout << "  mirror open <imagen1> <imagen2> [...] [stream|mmap|pread|direct]\n";
+   std::cout << "  mirror [resync]\n";
    std::cout << "  info\n";
    std::cout << "  dwrite <numero_bloque> <texto>\n";
    std::cout << "  dread <numero_bloque> <offset> <length>\n";
+   std::cout << "  cache [cantidad_bloques]\n";
+   std::cout << "  readahead [ventana_maxima]\n";
+   std::cout << "  checksum\n";
+   std::cout << "  stats [reset|hist]\n";
+   std::cout << "  trace [start <archivo>|stop]\n";
+   std::cout << "  compression\n";
+   std::cout << "  snapshot [create|list|delete <id>|mount <id>|unmount]\n";
+   std::cout << "  grow <cantidad_bloques>\n";
+   std::cout << "  sync\n";
    std::cout << "  close\n";
    std::cout << "  exit\n\n";
 
    std::cout << "Parte 2 (Sistema de Archivos):\n";
-   std::cout << "  format\n";
-   std::cout << "  ls\n";
+   std::cout << "  format [v1|v2]\n";
+   std::cout << "  ls [directorio]\n";
+   std::cout << "  mkdir <directorio>\n";
+   std::cout << "  rmdir <directorio>\n";
    std::cout << "  cat <archivo>\n";
    std::cout << "  write <archivo> <texto>\n";
    std::cout << "  hexdump <archivo>\n";
    std::cout << "  copy out <archivo_fs> <archivo_host>\n";
    std::cout << "  copy in <archivo_host> <archivo_fs>\n";
    std::cout << "  rm <archivo>\n";
+   std::cout << "  discard [on|off]\n";
+   std::cout << "  dedup [on|off]\n";
   }
-  else if (args[0] == "create" && args.size() == 4)
+  else if (args[0] == "create" && args.size() >= 4 && args.size() <= 9)
   {
    std::string filename = args[1];
    std::size_t blockSize = std::stoul(args[2]);
    std::size_t blockCount = std::stoul(args[3]);
+   BlockDevice::Layout layout = BlockDevice::Layout::Compact;
+   BlockDevice::Allocation allocation = BlockDevice::Allocation::Sparse;
+   bool withChecksums = false;
+   bool compressed = false;
+   bool withSnapshots = false;
+   bool validOptions = true;
+   for (std::size_t i = 4; i < args.size(); i++)
+   {
+    if (args[i] == "aligned")
+     layout = BlockDevice::Layout::Aligned;
+    else if (args[i] == "sparse")
+     allocation = BlockDevice::Allocation::Sparse;
+    else if (args[i] == "reserve")
+     allocation = BlockDevice::Allocation::Reserved;
+    else if (args[i] == "zero")
+     allocation = BlockDevice::Allocation::Zeroed;
+    else if (args[i] == "checksum")
+     withChecksums = true;
+    else if (args[i] == "compressed")
+     compressed = true;
+    else if (args[i] == "snapshots")
+     withSnapshots = true;
+    else
+     validOptions = false;
+   }
+   if (!validOptions)
+   {
+    std::cerr << "Opción desconocida. Use aligned, sparse, reserve, zero, checksum, compressed o snapshots.\n";
+    continue;
+   }
+   // El FS guarda una referencia al dispositivo, no puede sobrevivirlo
+   if (fs)
+   {
+    delete fs;
+    fs = nullptr;
+   }
    if (device)
     delete device;
 
-   device = new BlockDevice(blockCount, blockSize);
-   if (device->create(filename, blockSize, blockCount))
+   BlockDevice *image = new BlockDevice(blockCount, blockSize);
+   device = image;
+   bool created = image->create(filename, blockSize, blockCount, layout, allocation, withChecksums);
+   if (created && (compressed || withSnapshots))
+   {
+    // Las capas escriben su cabecera y sus metadatos sobre la imagen recien creada,
+    // la de instantaneas encima de la de compresion
+    auto raw = std::make_unique<BlockDevice>();
+    created = raw->open(filename);
+    std::unique_ptr<IBlockDevice> stack = std::move(raw);
+    if (created && compressed)
+    {
+     auto layer = std::make_unique<CompressedBlockDevice>(std::move(stack));
+     created = layer->create() && layer->open();
+     stack = std::move(layer);
+    }
+    if (created && withSnapshots)
+    {
+     SnapshotBlockDevice layer(std::move(stack));
+     created = layer.create();
+    }
+   }
+   if (created)
    {
     std::cout << "Dispositivo creado exitosamente.\n";
    }
@@ -82,16 +293,36 @@ int main()
     device = nullptr;
    }
   }
-  else if (args[0] == "open" && args.size() == 2)
+  else if (args[0] == "open" && (args.size() == 2 || args.size() == 3))
   {
    std::string filename = args[1];
-   if (!device)
-    device = new BlockDevice();
-   if (device->open(filename))
+   BlockDevice::Backend backend = BlockDevice::Backend::Stream;
+   if (args.size() == 3 && !parseBackend(args[2], backend))
    {
-    if (fs)
-     delete fs;
-    fs = new FileSystem(*device);
+    std::cerr << "Backend desconocido. Use stream, mmap, pread o direct.\n";
+    continue;
+   }
+   // El FS anterior escribe su cache al dispositivo actual antes de reabrirlo
+   if (fs)
+   {
+    delete fs;
+    fs = nullptr;
+   }
+   // Solo una imagen en archivo se puede abrir, un dispositivo en memoria se reemplaza
+   BlockDevice *image = dynamic_cast<BlockDevice *>(device);
+   if (!image)
+   {
+    delete device;
+    image = new BlockDevice();
+    device = image;
+   }
+   bool opened = image->open(filename, backend) && stackLayers(device);
+   if (opened)
+   {
+    fs = new FileSystem(*device, cacheBlocks);
+    fs->setReadAhead(readAheadWindow);
+    fs->setDiscard(discardFreed);
+    fs->setDedup(dedupWrites);
     if (!fs->load())
     {
      std::cout << "El dispositivo no parece tener un FS formateado.\n";
@@ -107,6 +338,189 @@ int main()
     }
    }
   }
+  else if (args[0] == "connect" && args.size() == 2)
+  {
+   if (fs)
+   {
+    delete fs;
+    fs = nullptr;
+   }
+   if (device)
+    delete device;
+
+   // Dispositivo servido por BlockServer; las capas y el FS se montan igual que con open
+   RemoteBlockDevice *remote = new RemoteBlockDevice();
+   device = remote;
+   bool opened = remote->connect(args[1]);
+   if (opened)
+    std::cout << "Conectado a " << args[1] << ": " << remote->blockCount << " bloques de " << remote->blockSize
+              << " bytes.\n";
+   opened = opened && stackLayers(device);
+   if (opened)
+   {
+    fs = new FileSystem(*device, cacheBlocks);
+    fs->setReadAhead(readAheadWindow);
+    fs->setDiscard(discardFreed);
+    fs->setDedup(dedupWrites);
+    if (!fs->load())
+    {
+     std::cout << "El dispositivo no parece tener un FS formateado.\n";
+    }
+   }
+   else
+   {
+    std::cerr << "Error al conectar el dispositivo.\n";
+    delete device;
+    device = nullptr;
+   }
+  }
+  else if (args[0] == "ram" && args.size() == 3)
+  {
+   std::size_t blockSize = std::stoul(args[1]);
+   std::size_t blockCount = std::stoul(args[2]);
+   if (fs)
+   {
+    delete fs;
+    fs = nullptr;
+   }
+   if (device)
+    delete device;
+
+   RamBlockDevice *ram = new RamBlockDevice();
+   device = ram;
+   if (ram->create(blockSize, blockCount))
+   {
+    std::cout << "Dispositivo en memoria creado exitosamente.\n";
+   }
+   else
+   {
+    std::cerr << "Error al crear el dispositivo.\n";
+    delete device;
+    device = nullptr;
+   }
+  }
+  else if ((args[0] == "stripe" || args[0] == "mirror") &&
+           ((args.size() >= 5 && args[1] == "create") || (args.size() >= 4 && args[1] == "open")))
+  {
+   bool mirror = args[0] == "mirror";
+   bool creating = args[1] == "create";
+   std::size_t first = creating ? 3 : 2;
+   std::size_t end = args.size();
+   BlockDevice::Backend backend = BlockDevice::Backend::Stream;
+   if (!creating && parseBackend(args.back(), backend))
+    end--;
+   if (end - first < 2)
+   {
+    std::cerr << "Un arreglo necesita al menos 2 imágenes.\n";
+    continue;
+   }
+   if (fs)
+   {
+    delete fs;
+    fs = nullptr;
+   }
+   if (device)
+   {
+    delete device;
+    device = nullptr;
+   }
+
+   // Las imagenes se crean antes con 'create'; el arreglo pasa a ser dueño de cada una
+   std::vector<std::unique_ptr<IBlockDevice>> members;
+   bool opened = true;
+   for (std::size_t i = first; i < end && opened; i++)
+   {
+    auto image = std::make_unique<BlockDevice>();
+    opened = image->open(args[i], backend);
+    members.push_back(std::move(image));
+   }
+   if (mirror)
+   {
+    MirroredBlockDevice *array = new MirroredBlockDevice(std::move(members));
+    device = array;
+    if (opened)
+     opened = creating ? array->create(std::stoul(args[2])) : array->open();
+    if (opened)
+    {
+     std::cout << "Espejo: " << array->memberCount() << " miembros, " << array->blockCount << " bloques.\n";
+     if (array->dirtyRegions() > 0)
+      std::cout << array->dirtyRegions() << " regiones fuera de sincronía, use 'mirror resync'.\n";
+    }
+   }
+   else
+   {
+    StripedBlockDevice *array = new StripedBlockDevice(std::move(members));
+    device = array;
+    if (opened)
+     opened = creating ? array->create(std::stoul(args[2])) : array->open();
+    if (opened)
+     std::cout << "Arreglo en franjas: " << array->memberCount() << " miembros, unidad de " << array->stripeUnit()
+               << " bloques, " << array->blockCount << " bloques lógicos.\n";
+   }
+   if (!opened)
+   {
+    std::cerr << "Error al " << (creating ? "crear" : "abrir") << " el arreglo.\n";
+    delete device;
+    device = nullptr;
+    continue;
+   }
+   if (!creating)
+   {
+    fs = new FileSystem(*device, cacheBlocks);
+    fs->setReadAhead(readAheadWindow);
+    fs->setDiscard(discardFreed);
+    fs->setDedup(dedupWrites);
+    if (!fs->load())
+    {
+     std::cout << "El dispositivo no parece tener un FS formateado.\n";
+    }
+   }
+  }
+  else if (args[0] == "stripe" && args.size() == 1)
+  {
+   StripedBlockDevice *array = dynamic_cast<StripedBlockDevice *>(device);
+   if (!array)
+   {
+    std::cout << "El dispositivo no es un arreglo en franjas.\n";
+    continue;
+   }
+   std::cout << "Unidad de franja: " << array->stripeUnit() << " bloques\n";
+   for (std::size_t i = 0; i < array->memberCount(); i++)
+   {
+    StripedBlockDevice::MemberStats st = array->memberStats(i);
+    std::cout << "  miembro " << i << ": " << array->member(i).blockCount << " bloques, leídos " << st.reads
+              << ", escritos " << st.writes << "\n";
+   }
+  }
+  else if (args[0] == "mirror" && (args.size() == 1 || (args.size() == 2 && args[1] == "resync")))
+  {
+   MirroredBlockDevice *array = dynamic_cast<MirroredBlockDevice *>(device);
+   if (!array)
+   {
+    std::cout << "El dispositivo no es un espejo.\n";
+    continue;
+   }
+   if (args.size() == 2)
+   {
+    // Lo que esta en la cache del FS se escribe antes, a todos los miembros
+    if (fs)
+     fs->sync();
+    std::size_t copied = 0;
+    if (array->resync(copied))
+     std::cout << "Resincronización completa: " << copied << " bloques copiados.\n";
+    else
+     std::cerr << "Error en la resincronización (" << copied << " bloques copiados).\n";
+    continue;
+   }
+   std::cout << "Regiones de " << array->regionSize() << " bloques, fuera de sincronía: " << array->dirtyRegions()
+             << "  origen: miembro " << array->sourceMember() << "\n";
+   for (std::size_t i = 0; i < array->memberCount(); i++)
+   {
+    MirroredBlockDevice::MemberStats st = array->memberStats(i);
+    std::cout << "  miembro " << i << ": leídos " << st.reads << ", escritos " << st.writes
+              << (st.failed ? ", FALLADO" : "") << (st.stale ? ", desactualizado" : "") << "\n";
+   }
+  }
   else if (args[0] == "info")
   {
    if (device && device->blockCount > 0 && device->blockSize > 0)
@@ -114,12 +528,37 @@ int main()
     std::cout << "Información del dispositivo:\n";
     std::cout << "Tamaño de bloque: " << device->blockSize << " bytes\n";
     std::cout << "Cantidad de bloques: " << device->blockCount << "\n";
+    if (fs && fs->formatVersion() != 0)
+     std::cout << "FS en formato " << fs->formatVersion() << ", " << fs->inodeCount() << " inodos"
+               << (fs->hasDirectories() ? ", con directorios" : "") << "\n";
    }
    else
    {
     std::cerr << "No hay dispositivo abierto.\n";
    }
   }
+  else if (args[0] == "grow" && args.size() == 2)
+  {
+   if (!device)
+   {
+    std::cerr << "No hay dispositivo abierto.\n";
+    continue;
+   }
+   // Con el FS montado crecen el dispositivo y el FS juntos, sin desmontar
+   std::size_t newCount = std::stoul(args[1]);
+   bool grown = fs ? fs->grow(newCount) : device->grow(newCount);
+   if (grown)
+   {
+    std::cout << "El dispositivo ahora tiene " << device->blockCount << " bloques";
+    if (fs)
+     std::cout << " y el FS " << fs->inodeCount() << " inodos";
+    std::cout << ".\n";
+   }
+   else if (!fs && !device->supportsGrow())
+   {
+    std::cerr << "El dispositivo no puede crecer (solo las imágenes y los dispositivos en memoria sin capas).\n";
+   }
+  }
   else if (args[0] == "dwrite" && args.size() >= 3)
   {
    if (!device)
@@ -136,7 +575,13 @@ int main()
     continue;
    }
    std::string data = command.substr(pos);
-   if (device->writeBlock(blockNumber, std::vector<char>(data.begin(), data.end())))
+   // La escritura va directo al dispositivo, la cache del FS no debe quedar con una copia vieja
+   if (fs)
+   {
+    fs->sync();
+    fs->invalidateCachedBlock(blockNumber);
+   }
+   if (device->writeBlock(blockNumber, data.data(), data.size()))
    {
     std::cout << "Escritura en el bloque " << blockNumber << " exitosa.\n";
    }
@@ -156,7 +601,14 @@ int main()
    std::size_t offset = std::stoul(args[2]);
    std::size_t length = std::stoul(args[3]);
 
-   std::vector<char> data = device->readBlock(blockNumber);
+   if (fs)
+    fs->sync();
+   std::vector<char> data(device->blockSize);
+   // Con lectura anticipada activa, las lecturas crudas secuenciales tambien se precargan
+   bool ok = (fs && fs->readAhead()) ? fs->readAhead()->readRaw(blockNumber, data.data())
+                                     : device->readBlock(blockNumber, data.data());
+   if (!ok)
+    data.clear();
    if (!data.empty())
    {
     if (offset + length <= data.size())
@@ -174,50 +626,363 @@ int main()
     std::cerr << "Error al leer el bloque o está vacío.\n";
    }
   }
-  else if (args[0] == "close")
+  else if (args[0] == "cache" && args.size() <= 2)
   {
-   if (device && device->close())
+   if (args.size() == 2)
    {
-    std::cout << "Dispositivo cerrado exitosamente.\n";
-    delete device;
-    device = nullptr;
+    cacheBlocks = std::stoul(args[1]);
+    if (fs)
+     fs->setCacheCapacity(cacheBlocks);
+    std::cout << "Cache de bloques: " << cacheBlocks << " bloques.\n";
+   }
+   else if (fs && fs->blockCache())
+   {
+    const BlockCache *cache = fs->blockCache();
+    BlockCache::Stats st = cache->stats();
+    std::cout << "Capacidad: " << cache->capacity() << " bloques\n";
+    std::cout << "Sucios: " << cache->dirtyBlocks() << "\n";
+    std::cout << "Aciertos: " << st.hits << "  Fallos: " << st.misses << "\n";
+    std::cout << "Desalojos: " << st.evictions << "  Escrituras al disco: " << st.writebacks << "\n";
+    std::cout << "Shards: " << cache->shardCount() << "\n";
+    for (std::size_t i = 0; i < cache->shardCount(); i++)
+    {
+     BlockCache::Stats sh = cache->shardStats(i);
+     std::cout << "  shard " << i << ": aciertos " << sh.hits << ", fallos " << sh.misses
+               << ", desalojos " << sh.evictions << "\n";
+    }
+   }
+   else
+   {
+    std::cout << "Cache de bloques desactivada.\n";
+   }
+  }
+  else if (args[0] == "readahead" && args.size() <= 2)
+  {
+   if (args.size() == 2)
+   {
+    readAheadWindow = std::stoul(args[1]);
     if (fs)
+     fs->setReadAhead(readAheadWindow);
+    std::cout << "Lectura anticipada: ventana máxima de " << readAheadWindow << " bloques.\n";
+   }
+   else if (fs && fs->readAhead())
+   {
+    ReadAhead::Stats st = fs->readAhead()->stats();
+    std::cout << "Ventana máxima: " << fs->readAhead()->maxWindow() << " bloques\n";
+    std::cout << "Lecturas: " << st.reads << "  desde precarga: " << st.hits << "  esperas: " << st.waits << "\n";
+    std::cout << "Precargados: " << st.prefetched << "  descartados: " << st.wasted << "\n";
+   }
+   else
+   {
+    std::cout << "Lectura anticipada desactivada.\n";
+   }
+  }
+  else if (args[0] == "discard" && args.size() <= 2)
+  {
+   if (args.size() == 2)
+   {
+    if (args[1] != "on" && args[1] != "off")
+    {
+     std::cerr << "Opción desconocida. Use on u off.\n";
+     continue;
+    }
+    discardFreed = args[1] == "on";
+    if (fs)
+     fs->setDiscard(discardFreed);
+   }
+   std::cout << "Descarte de bloques libres: " << (discardFreed ? "activado" : "desactivado");
+   if (device && !device->supportsDiscard())
+    std::cout << " (el host no lo soporta)";
+   std::cout << "\n";
+  }
+  else if (args[0] == "dedup" && args.size() <= 2)
+  {
+   if (args.size() == 2)
+   {
+    if (args[1] != "on" && args[1] != "off")
+    {
+     std::cerr << "Opción desconocida. Use on u off.\n";
+     continue;
+    }
+    dedupWrites = args[1] == "on";
+    if (fs)
+     fs->setDedup(dedupWrites);
+   }
+   std::cout << "Deduplicación: " << (dedupWrites ? "activada" : "desactivada") << "\n";
+   if (fs)
+   {
+    FileSystem::DedupStats st = fs->dedupStats();
+    std::cout << "Bloques compartidos: " << st.sharedBlocks << "  bloques ahorrados: " << st.savedBlocks << "\n";
+    std::cout << "Escrituras evitadas: " << st.hits << " duplicadas, " << st.unchanged << " sin cambios"
+              << "  copias al modificar: " << st.copies << "\n";
+   }
+  }
+  else if (args[0] == "checksum" && args.size() == 1)
+  {
+   BlockDevice *image = imageOf(device);
+   if (!image || !image->checksumsEnabled())
+   {
+    std::cout << "El dispositivo no tiene checksums (cree la imagen con la opción checksum).\n";
+    continue;
+   }
+   BlockDevice::ChecksumStats st = image->checksumStats();
+   std::cout << "CRC32C (" << crc32cImplementation() << ")\n";
+   std::cout << "Verificados: " << st.verified << "  fallidos: " << st.failures << "  actualizados: " << st.updated << "\n";
+   if (st.verified > 0 && st.nanoseconds > 0)
+   {
+    double bytes = (double)st.verified * image->blockSize;
+    std::cout << "Costo: " << st.nanoseconds / st.verified << " ns por bloque (" << bytes / st.nanoseconds << " GB/s)\n";
+    // La verificacion ocurre dentro de las lecturas: su parte del tiempo de lectura es lo que
+    // se ganaria desactivandola. Con datos en la cache de paginas del host puede ser grande
+    uint64_t readNanos = image->ioStats().op(IoStats::Op::Read).latency.sum;
+    if (readNanos > 0)
+     std::cout << "Fracción del tiempo de lectura: " << std::min(100.0, 100.0 * st.nanoseconds / readNanos) << "%\n";
+   }
+  }
+  else if (args[0] == "stats" && (args.size() == 1 || (args.size() == 2 && (args[1] == "reset" || args[1] == "hist"))))
+  {
+   std::vector<BlockDevice *> images = imagesOf(device);
+   if (images.empty())
+   {
+    std::cout << "El dispositivo no tiene una imagen en archivo.\n";
+    continue;
+   }
+   for (std::size_t i = 0; i < images.size(); i++)
+   {
+    if (!images[i])
+     continue;
+    if (args.size() == 2 && args[1] == "reset")
+    {
+     images[i]->resetIoStats();
+     continue;
+    }
+    IoStats::Summary st = images[i]->ioStats();
+    if (images.size() > 1)
+     std::cout << "Miembro " << i << ":\n";
+    printIoStats(st, images[i]->blockSize);
+    if (args.size() == 2)
+    {
+     // Cubetas no vacias de la latencia de lecturas y escrituras
+     const IoStats::Op ops[] = {IoStats::Op::Read, IoStats::Op::Write};
+     for (IoStats::Op op : ops)
+     {
+      const Histogram::Summary &lat = st.op(op).latency;
+      if (lat.count == 0)
+       continue;
+      std::cout << "  histograma de " << IoStats::opName(op) << " (ns):\n";
+      for (const Histogram::Bucket &b : lat.buckets)
+       std::cout << "    " << b.low << "-" << std::min(b.high, lat.max) << ": " << b.count << "\n";
+     }
+    }
+   }
+   if (args.size() == 2 && args[1] == "reset")
+    std::cout << "Estadísticas de E/S reiniciadas.\n";
+  }
+  else if (args[0] == "trace" && (args.size() == 1 || (args.size() == 3 && args[1] == "start") ||
+                                   (args.size() == 2 && args[1] == "stop")))
+  {
+   std::vector<BlockDevice *> images = imagesOf(device);
+   if (images.empty())
+   {
+    std::cout << "El dispositivo no tiene una imagen en archivo.\n";
+    continue;
+   }
+   // En los arreglos cada miembro graba su propia traza: <archivo>.0, <archivo>.1, ...
+   for (std::size_t i = 0; i < images.size(); i++)
+   {
+    if (!images[i])
+     continue;
+    std::string label = images.size() > 1 ? "Miembro " + std::to_string(i) + ": " : "";
+    if (args.size() == 1)
+    {
+     if (images[i]->tracing())
+      std::cout << label << "grabando, " << images[i]->tracedRecords() << " registros.\n";
+     else
+      std::cout << label << "sin grabar.\n";
+    }
+    else if (args[1] == "start")
+    {
+     std::string filename = images.size() > 1 ? args[2] + "." + std::to_string(i) : args[2];
+     if (images[i]->startTrace(filename))
+      std::cout << label << "grabando la traza en " << filename << "\n";
+    }
+    else
+    {
+     uint64_t count = images[i]->tracedRecords();
+     if (images[i]->stopTrace())
+      std::cout << label << "traza cerrada, " << count << " registros.\n";
+     else
+      std::cout << label << "no se estaba grabando.\n";
+    }
+   }
+  }
+  else if (args[0] == "compression" && args.size() == 1)
+  {
+   CompressedBlockDevice *layer = compressedLayerOf(device);
+   if (!layer)
+   {
+    std::cout << "El dispositivo no está comprimido (cree la imagen con la opción compressed).\n";
+    continue;
+   }
+   CompressedBlockDevice::Stats st = layer->stats();
+   std::cout << "Bloques físicos en uso: " << layer->physicalBlocksInUse() << " de " << layer->physicalBlocks() << "\n";
+   std::cout << "Escrituras: " << st.writes << "  comprimidas: " << st.compressedBlocks << "  sin comprimir: " << st.rawBlocks
+             << "  en cero: " << st.zeroBlocks << "\n";
+   if (st.storedBytes > 0)
+    std::cout << "Razón de compresión: " << (double)st.logicalBytes / st.storedBytes << "\n";
+   std::cout << "Lecturas físicas: " << st.physicalReads << "  escrituras físicas: " << st.physicalWrites << "\n";
+   if (st.decompressNanos > 0)
+    std::cout << "Descompresión: " << (double)st.decompressedBytes / st.decompressNanos << " GB/s\n";
+  }
+  else if (args[0] == "snapshot" && args.size() <= 3)
+  {
+   SnapshotBlockDevice *layer = dynamic_cast<SnapshotBlockDevice *>(device);
+   if (!layer)
+   {
+    std::cout << "El dispositivo no tiene instantáneas (cree la imagen con la opción snapshots).\n";
+    continue;
+   }
+   std::string action = args.size() >= 2 ? args[1] : "list";
+   bool onSnapshot = fs && dynamic_cast<SnapshotView *>(&fs->blockDevice());
+   if (action == "create" && args.size() == 2)
+   {
+    // Lo que esta en la cache del FS entra en la instantanea
+    if (fs && !onSnapshot)
+     fs->sync();
+    uint32_t id;
+    if (layer->createSnapshot(id))
+     std::cout << "Instantánea " << id << " creada.\n";
+   }
+   else if (action == "list" && args.size() <= 2)
+   {
+    std::cout << "Bloques físicos en uso: " << layer->physicalBlocksInUse() << " de " << layer->physicalBlocks() << "\n";
+    SnapshotBlockDevice::Stats st = layer->stats();
+    std::cout << "Copias al sobrescribir: " << st.copies << "  escrituras en su lugar: " << st.inPlace << "\n";
+    for (const auto &snap : layer->snapshots())
+    {
+     char date[32];
+     std::time_t created = (std::time_t)snap.created;
+     std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", std::localtime(&created));
+     std::cout << "  " << snap.id << ": " << date << ", " << snap.ownBlocks << " bloques propios\n";
+    }
+   }
+   else if ((action == "delete" || action == "mount") && args.size() == 3)
+   {
+    uint32_t id = (uint32_t)std::stoul(args[2]);
+    SnapshotView *view = layer->snapshotDevice(id);
+    if (!view)
+    {
+     std::cerr << "No existe la instantánea " << id << ".\n";
+     continue;
+    }
+    // El FS que se monta o que estaba sobre la instantanea a borrar se reemplaza
+    if (action == "mount" || (fs && &fs->blockDevice() == view))
     {
      delete fs;
-     fs = nullptr;
+     fs = new FileSystem(action == "mount" ? *static_cast<IBlockDevice *>(view) : *device, cacheBlocks);
+     fs->setReadAhead(readAheadWindow);
+     fs->setDiscard(discardFreed);
+     fs->setDedup(dedupWrites);
+     if (!fs->load())
+      std::cout << "El dispositivo no parece tener un FS formateado.\n";
+    }
+    if (action == "mount")
+     std::cout << "Instantánea " << id << " montada (solo lectura).\n";
+    else if (layer->deleteSnapshot(id))
+     std::cout << "Instantánea " << id << " borrada.\n";
+   }
+   else if (action == "unmount" && args.size() == 2)
+   {
+    if (!onSnapshot)
+    {
+     std::cout << "No hay una instantánea montada.\n";
+     continue;
     }
+    delete fs;
+    fs = new FileSystem(*device, cacheBlocks);
+    fs->setReadAhead(readAheadWindow);
+    fs->setDiscard(discardFreed);
+    fs->setDedup(dedupWrites);
+    if (!fs->load())
+     std::cout << "El dispositivo no parece tener un FS formateado.\n";
+    else
+     std::cout << "Volumen vivo montado.\n";
    }
    else
    {
-    std::cerr << "No hay dispositivo abierto para cerrar.\n";
+    std::cerr << "Uso: snapshot [create|list|delete <id>|mount <id>|unmount]\n";
    }
   }
-  else if (args[0] == "exit")
+  else if (args[0] == "sync")
   {
-   if (device)
+   if (device && (fs ? fs->sync() : device->flush()))
    {
-    device->close();
+    std::cout << "Dispositivo sincronizado.\n";
+   }
+   else
+   {
+    std::cerr << "No hay dispositivo abierto para sincronizar.\n";
+   }
+  }
+  else if (args[0] == "close")
+  {
+   // El FS se destruye primero para que su cache se escriba antes de cerrar el dispositivo
+   if (fs)
+   {
+    delete fs;
+    fs = nullptr;
+   }
+   if (device && device->close())
+   {
+    std::cout << "Dispositivo cerrado exitosamente.\n";
     delete device;
     device = nullptr;
    }
+   else
+   {
+    std::cerr << "No hay dispositivo abierto para cerrar.\n";
+   }
+  }
+  else if (args[0] == "exit")
+  {
    if (fs)
    {
     delete fs;
     fs = nullptr;
    }
+   if (device)
+   {
+    device->close();
+    delete device;
+    device = nullptr;
+   }
    break;
   }
   // FS Commands
-  else if (args[0] == "format")
+  else if (args[0] == "format" && args.size() <= 2)
   {
+   // v2 (predeterminado): bloques de 64 bits; v1: el formato original
+   uint32_t version = 2;
+   if (args.size() == 2 && (args[1] == "v1" || args[1] == "v2"))
+    version = args[1] == "v1" ? 1 : 2;
+   else if (args.size() == 2)
+   {
+    std::cerr << "Versión de formato desconocida. Use v1 o v2.\n";
+    continue;
+   }
    if (!device)
    {
     std::cerr << "No hay dispositivo abierto.\n";
     continue;
    }
    if (!fs)
-    fs = new FileSystem(*device);
-   if (fs->format())
+   {
+    fs = new FileSystem(*device, cacheBlocks);
+    fs->setReadAhead(readAheadWindow);
+    fs->setDiscard(discardFreed);
+    fs->setDedup(dedupWrites);
+   }
+   if (fs->format(version))
    {
     std::cout << "Disco virtual formateado exitosamente.\n";
    }
@@ -226,14 +991,26 @@ int main()
     std::cerr << "Error al formatear.\n";
    }
   }
-  else if (args[0] == "ls")
+  else if (args[0] == "ls" && args.size() <= 2)
+  {
+   if (!fs)
+   {
+    std::cerr << "No hay FS cargado.\n";
+    continue;
+   }
+   fs->ls(args.size() == 2 ? args[1] : "");
+  }
+  else if ((args[0] == "mkdir" || args[0] == "rmdir") && args.size() == 2)
   {
    if (!fs)
    {
     std::cerr << "No hay FS cargado.\n";
     continue;
    }
-   fs->ls();
+   if (args[0] == "mkdir")
+    fs->mkdir(args[1]);
+   else
+    fs->rmdir(args[1]);
   }
   else if (args[0] == "cat" && args.size() == 2)
   {